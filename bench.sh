@@ -0,0 +1,123 @@
+#!/bin/bash
+# bench.sh — Compares the epoll and io_uring event loops on the same config.
+# Usage: ./bench.sh [-t] [config] [url] [connections] [seconds]
+# Each backend is built, started in benchmark mode (-s) and loaded with the
+# same keep-alive clients. Reported: requests/s, p50/p99 latency seen by the
+# clients, and the server's own count of system calls per request.
+# With -t it measures throughput instead: url (by default 4 GiB streamed by
+# a CGI script) is downloaded once, reported are MB/s and the CPU time the
+# server spent relaying it.
+
+THROUGHPUT=""
+if [ "$1" = "-t" ]; then
+    THROUGHPUT=1
+    shift
+fi
+
+CONFIG="${1:-config/config.conf}"
+if [ -n "$THROUGHPUT" ]; then
+    URL="${2:-http://127.0.0.1:8083/cgi-bin/stream.sh?4294967296}"
+else
+    URL="${2:-http://127.0.0.1:8080/}"
+fi
+CONNECTIONS="${3:-32}"
+SECONDS_RUN="${4:-10}"
+
+CYAN="\033[36m"
+NC="\033[0m"
+
+make -s NAME=webserv_epoll || exit 1
+make -s IO_BACKEND=uring NAME=webserv_uring || exit 1
+
+# Load generator: one thread per connection, each sending requests back to back
+function load() {
+python3 - "$URL" "$CONNECTIONS" "$SECONDS_RUN" <<'PYEOF'
+import socket, sys, threading, time
+from urllib.parse import urlparse
+
+url = urlparse(sys.argv[1])
+conns, duration = int(sys.argv[2]), float(sys.argv[3])
+host, port = url.hostname, url.port or 80
+request = ("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (url.path or "/", host)).encode()
+latencies, errors, lock = [], [0], threading.Lock()
+
+def read_response(sock, buf):
+    while b"\r\n\r\n" not in buf:
+        data = sock.recv(65536)
+        if not data:
+            raise ConnectionError("closed")
+        buf += data
+    head, _, rest = buf.partition(b"\r\n\r\n")
+    length, close = 0, False
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            length = int(value)
+        elif name.strip().lower() == b"connection" and b"close" in value.lower():
+            close = True
+    while len(rest) < length:
+        data = sock.recv(65536)
+        if not data:
+            raise ConnectionError("closed")
+        rest += data
+    return rest[length:], close
+
+def client(deadline):
+    mine, sock, buf = [], None, b""
+    while time.time() < deadline:
+        try:
+            if sock is None:
+                sock, buf = socket.create_connection((host, port)), b""
+            start = time.perf_counter()
+            sock.sendall(request)
+            buf, close = read_response(sock, buf)
+            mine.append(time.perf_counter() - start)
+            if close:
+                sock.close()
+                sock = None
+        except (OSError, ValueError):
+            with lock:
+                errors[0] += 1
+            if sock:
+                sock.close()
+            sock = None
+    if sock:
+        sock.close()
+    with lock:
+        latencies.extend(mine)
+
+deadline = time.time() + duration
+threads = [threading.Thread(target=client, args=(deadline,)) for _ in range(conns)]
+for t in threads: t.start()
+for t in threads: t.join()
+latencies.sort()
+n = len(latencies)
+if n == 0:
+    print("no successful request (%d errors)" % errors[0])
+    sys.exit(1)
+pct = lambda p: latencies[min(n - 1, int(n * p))] * 1000
+print("requests=%d errors=%d req/s=%.0f p50=%.2fms p99=%.2fms max=%.2fms"
+      % (n, errors[0], n / duration, pct(0.50), pct(0.99), latencies[-1] * 1000))
+PYEOF
+}
+
+# Throughput: one download of a large body, timed by curl
+function throughput() {
+    curl -s -o /dev/null -w '%{size_download} %{time_total}\n' "$URL" \
+        | awk '{ printf "bytes=%.0f seconds=%.2f MB/s=%.0f\n", $1, $2, $1 / $2 / 1048576 }'
+}
+
+for backend in epoll uring; do
+    echo -e "${CYAN}========== $backend ==========${NC}"
+    ./webserv_$backend -s "$CONFIG" > /tmp/webserv_bench_$backend.log 2>&1 &
+    pid=$!
+    sleep 1
+    if [ -n "$THROUGHPUT" ]; then
+        throughput
+    else
+        load
+    fi
+    kill -INT $pid
+    wait $pid
+    grep "^stats" /tmp/webserv_bench_$backend.log
+done
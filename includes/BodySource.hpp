@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <sys/types.h>
+#include "FileHandle.hpp"
+#include "SharedPtr.hpp"
+
+/**
+ * BodySource
+ * A response body produced while it is sent: the write path pulls it one
+ * chunk at a time as the socket drains, so a producer never has to hold its
+ * whole output. A body whose length is unknown goes out chunked.
+ */
+class BodySource
+{
+public:
+	virtual ~BodySource();
+
+	// Total bytes, or -1 when only the end of the data tells
+	virtual off_t length() const = 0;
+	// Appends about max bytes to out: returns how many, 0 at the end, -1 on error
+	virtual ssize_t read(std::string &out, size_t max) = 0;
+	// A pipe the next bytes (max at most) may be spliced from to the socket
+	// instead of being read; -1 when they must be read()
+	virtual int splicePipe(size_t &max);
+	// count bytes were spliced from splicePipe(), 0: the pipe ended
+	virtual void spliced(size_t count);
+};
+
+typedef SharedPtr<BodySource> BodyStream;
+
+/**
+ * MemorySource
+ * Bytes already in memory.
+ */
+class MemorySource : public BodySource
+{
+public:
+	explicit MemorySource(const std::string &data);
+
+	off_t length() const;
+	ssize_t read(std::string &out, size_t max);
+
+private:
+	std::string _data;
+	size_t _pos;
+};
+
+/**
+ * FileRangeSource
+ * length bytes of an open file from offset, read with pread() (the plain
+ * file segments of a response go out with sendfile() instead; this is for
+ * bodies that must pass through memory).
+ */
+class FileRangeSource : public BodySource
+{
+public:
+	FileRangeSource(const FileHandle &file, off_t offset, off_t length);
+
+	off_t length() const;
+	ssize_t read(std::string &out, size_t max);
+
+private:
+	FileHandle _file;
+	off_t _offset;
+	off_t _length;
+	off_t _done;
+};
+
+/**
+ * GeneratorSource
+ * A body computed piece by piece by generate(), of unknown length.
+ */
+class GeneratorSource : public BodySource
+{
+public:
+	GeneratorSource();
+
+	off_t length() const;
+	ssize_t read(std::string &out, size_t max);
+
+protected:
+	// Appends the next piece to out; false once there is nothing more
+	virtual bool generate(std::string &out) = 0;
+
+private:
+	bool _done;
+};
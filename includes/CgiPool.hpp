@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include <list>
+#include <deque>
+#include "CgiProcess.hpp"
+
+/**
+ * CgiPool
+ * Persistent workers of one location with cgi_pool_size: cgi_pass started
+ * once on the cgi_worker script, which then runs request after request, so
+ * the request path pays no fork/exec. A worker answers one request at a
+ * time; requests wait in arrival order while all of them are busy and the
+ * pool is full. Every event loop has its own pool, nothing here is locked.
+ *
+ * The protocol, on the worker's stdin and stdout, for each request:
+ *  - in: the CGI environment as NAME=VALUE lines, CGI_POOL_END among
+ *    them, then an empty line, then CONTENT_LENGTH bytes of body;
+ *  - out: the script's output (headers, empty line, body), then, starting
+ *    a line of its own, the value of CGI_POOL_END, a space and the
+ *    script's exit status.
+ */
+struct CgiPool
+{
+	std::string interpreter;       // cgi_pass
+	std::string script;            // cgi_worker
+	size_t size;
+	size_t spare;
+	std::list<CgiProcess *> workers;
+	std::deque<CgiProcess *> queue;    // requests waiting for a worker
+	unsigned long jobs;            // requests handed out, numbering end markers
+
+	CgiPool(const std::string &interpreter, const std::string &script, size_t size,
+			size_t spare);
+
+	CgiProcess *spawn();
+	CgiProcess *idleWorker() const;
+	size_t idleWorkers() const;
+};
@@ -0,0 +1,185 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "Connection.hpp"
+#include "LocationConfig.hpp"
+#include "HttpResponse.hpp"
+#include "BodySource.hpp"
+
+struct CgiProcess;
+struct FastCgiConnection;
+struct CgiPool;
+class ResponseCache;
+
+// One fd of a CGI child registered with the event loop (stdin, stdout or
+// its pidfd); the type says which. fd is -1 once closed.
+struct CgiPipe : Pollable
+{
+	CgiProcess *cgi;
+	bool armed;                    // io_uring: a poll is in flight on it
+};
+
+/**
+ * CgiOutput
+ * What a script wrote that the response did not take yet, shared between
+ * the CgiProcess filling it and the CgiSource sending it.
+ */
+struct CgiOutput
+{
+	std::string data;
+	bool eof;                      // stdout closed, data is all there is
+	int pipe;                      // the script's stdout, -1 once closed or ended
+	bool relay;                    // spliced from pipe by the response, not read
+	bool discard;                  // the response took all it wanted
+	bool truncated;                // the script was stopped (cgi_timeout) before its end
+
+	CgiOutput();
+};
+
+/**
+ * CgiProcess
+ * A running CGI script, driven by the event loop: stdin is fed and stdout
+ * read through non-blocking pipes as they become ready, and the exit is
+ * seen on a pidfd (or polled for, before Linux 5.3), so nothing here ever
+ * waits. The Connection it answers
+ * is NULL once the client is gone; the child is then killed, and only
+ * reaped later when its pidfd says so. The child leads a process group of
+ * its own: signals reach whatever the script started too.
+ * The request handler only prepares the script (startScript), the loop
+ * forks it (launch), once cgi_max_concurrent lets it. A cgi_cache refresh
+ * runs for no client at all: its response only goes to the cache. Under
+ * cgi_cache_lock a miss may not run at all: it waits for the request
+ * (of any loop of the process) already running the script for its key,
+ * and is answered from the cache that one fills.
+ * With fastcgi_pass there is no child: the request goes to a FastCGI
+ * server, whose FastCgiConnection fills the output instead. With
+ * cgi_pool_size neither: a worker of the pool (a CgiProcess too, running
+ * the cgi_worker script for request after request) fills it.
+ */
+struct CgiProcess
+{
+	CgiPipe stdinPipe;
+	CgiPipe stdoutPipe;
+	CgiPipe exitWatch;             // pidfd, readable once the child exited
+	pid_t pid;
+	int status;
+	bool exited;
+	std::string input;             // request body, inputSent bytes of it written
+	size_t inputSent;
+	SharedPtr<CgiOutput> output;
+	bool paused;                   // stdout left unread: the client is behind
+	HttpResponse response;         // what the request handler set, the output completes it
+	Connection *conn;
+	bool headQueued;               // the response is on its way, the rest streams
+	// cgi_pass
+	std::string script;            // run by interpreter, once launched
+	const LocationConfig *limit;   // cgi_max_concurrent: its location, NULL once the slot is free
+	int timeout;                   // cgi_timeout
+	bool timedOut;                 // past it: SIGTERM was sent, SIGKILL follows
+	rlim_t cpuLimit;               // cgi_rlimit, 0: inherited
+	rlim_t memoryLimit;
+	// cgi_cache
+	ResponseCache *cache;          // where the complete response goes, NULL: not cached
+	std::string cacheKey;
+	int cacheValid;
+	int cacheStale;
+	size_t cacheMax;               // more output than that streams, uncached
+	const ServerConfig *cacheGzip; // gzip on: the server whose settings compress the entry
+	bool cacheGzipped;             // the client takes gzip: its variant is stored compressed
+	bool refresh;                  // no client: replaces a stale entry of the cache
+	std::string sessionCookie;     // the client's own Set-Cookie, kept out of the cache
+	// cgi_cache_lock
+	int lockTimeout;               // cgi_cache_lock_timeout, 0: no cgi_cache_lock
+	time_t lockUntil;              // waiting: when it stops and runs the script
+	bool lockHeld;                 // runs the script of its key, the other misses wait
+	// fastcgi_pass
+	std::string fastcgiPass;
+	size_t fastcgiKeepalive;
+	std::vector<std::string> params;   // the CGI environment, as FCGI_PARAMS
+	FastCgiConnection *upstream;   // carrying the request, NULL once it ended
+	unsigned short requestId;
+	bool retried;                  // already resent after a stale keep-alive connection
+	bool failed;                   // no usable answer: 502
+	// cgi_pool_size
+	std::string interpreter;       // cgi_pass; request: with cgi_worker, naming its pool
+	std::string poolScript;
+	size_t poolSize;
+	size_t poolSpare;
+	CgiPool *pool;                 // worker: its pool, NULL once retired
+	CgiProcess *job;               // worker: the request it answers, NULL if aborted
+	CgiProcess *worker;            // request: the worker answering it
+	std::string endMarker;         // worker: ends the request's output, "" when idle
+
+	CgiProcess();
+	~CgiProcess();
+
+	bool start(const std::vector<char *> &args, const std::vector<char *> &envp,
+			   const std::string &body);
+	void startScript(const std::string &interpreter, const std::string &script,
+					 const LocationConfig &loc, const std::vector<std::string> &env,
+					 const std::string &body);
+	bool launch();
+	void startFastCgi(const std::string &address, size_t keepalive,
+					  const std::vector<std::string> &env, const std::string &body);
+	void startPooled(const std::string &interpreter, const std::string &script, size_t size,
+					 size_t spare, const std::vector<std::string> &env, const std::string &body);
+	void fail();
+	void assign(CgiProcess &request, unsigned long sequence);
+	bool passOutput();
+	bool writeInput();
+	bool readOutput(size_t max);
+	bool reap();
+	void kill();
+	void signal(int sig);
+	bool done() const;
+	bool idle() const;
+	size_t bodyOffset() const;
+
+private:
+	CgiProcess(const CgiProcess &other);
+	CgiProcess &operator=(const CgiProcess &other);
+};
+
+/**
+ * CgiLimit
+ * cgi_max_concurrent for one location in one event loop: the name of its
+ * slots in the SharedZones (which count the scripts running in all the
+ * loops), and this loop's requests waiting, in arrival order, for one of
+ * them to exit.
+ */
+struct CgiLimit
+{
+	std::string slots;
+	std::deque<CgiProcess *> queue;
+};
+
+/**
+ * CgiSource
+ * The body of a streamed CGI response, read from the script's CgiOutput.
+ * When the script has not written more yet, read() fails with EAGAIN: the
+ * write path waits for the next output instead of closing. With the
+ * script's Content-Length it ends there, and fails if the output ends
+ * short of it; so does an output cut by cgi_timeout, whatever its length:
+ * the client must not take it for complete. Unless it is framed as chunks
+ * (or compressed), the body is relayed from the script's stdout with
+ * splice() once what was read of it is out: the loop then leaves the pipe
+ * to the write path.
+ */
+class CgiSource : public BodySource
+{
+public:
+	CgiSource(const SharedPtr<CgiOutput> &output, off_t length);
+
+	off_t length() const;
+	ssize_t read(std::string &out, size_t max);
+	int splicePipe(size_t &max);
+	void spliced(size_t count);
+
+private:
+	SharedPtr<CgiOutput> _output;
+	off_t _length;                 // -1: until the output ends
+	off_t _sent;
+};
@@ -0,0 +1,137 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "HttpParser.hpp"
+#include "ServerConfig.hpp"
+#include "FileHandle.hpp"
+#include "SharedPtr.hpp"
+#include "BodySource.hpp"
+
+// What an epoll event points to
+enum PollType
+{
+    POLL_LISTENER,
+    POLL_CLIENT,
+    POLL_CGI_IN,                   // a CGI child's stdin, stdout and pidfd
+    POLL_CGI_OUT,
+    POLL_CGI_EXIT,
+    POLL_FASTCGI,                  // a connection to a FastCGI server
+    POLL_WAKE                      // the loop's eventfd, written by the other loops
+};
+
+// Which of the server's timeouts currently guards a connection
+enum TimerPhase
+{
+    TIMER_NONE = 0,
+    TIMER_HEADER,
+    TIMER_BODY,
+    TIMER_SEND,
+    TIMER_KEEPALIVE
+};
+
+// What pullSource() got out of the front body source
+enum PullResult
+{
+    PULL_OK,
+    PULL_WAIT,                     // nothing yet (a CGI still running), try again later
+    PULL_ERROR
+};
+
+struct CgiProcess;
+
+// A parsed request waiting for its response, in arrival order
+struct PendingRequest
+{
+    HttpParser parser;
+    bool keepAlive;
+    size_t number;      // 1 for the first request on the connection
+};
+
+// iovecs gathered by one writev()/sendmsg()
+#define OUTPUT_IOV_MAX 64
+// Bytes pulled from a body source at a time
+#define OUTPUT_CHUNK_SIZE (64 * 1024)
+// Bytes moved by one splice() from a script's stdout at most
+#define OUTPUT_SPLICE_SIZE (1024 * 1024)
+
+// One piece of a response on the wire: bytes in memory (status line and
+// headers, a body, chunk framing), possibly shared with the response cache,
+// a range of an open file, or a body source still to be pulled
+struct OutputSegment
+{
+    std::string data;
+    SharedBuffer shared;           // sent instead of data when set
+    FileHandle file;
+    off_t fileOffset;
+    off_t fileLength;
+    BodyStream source;             // pulled into data segments once at the front
+    bool chunked;                  // frame what the source gives as chunks
+    bool endOfResponse;            // last segment of its response
+
+    OutputSegment();
+    size_t size() const;
+    const std::string &bytes() const;
+};
+
+// Anything registered with epoll: epoll_event.data.ptr points to one of these
+// (with io_uring the SQE user_data carries the same pointer)
+struct Pollable
+{
+    PollType type;
+    int fd;
+};
+
+// A listen socket and the servers sharing its host:port
+struct Listener : Pollable
+{
+    std::vector<ServerConfig> servers;
+};
+
+/**
+ * Connection
+ * Everything the event loop knows about one client socket, so that each
+ * event costs a single lookup. Closed connections keep fd == -1 until the
+ * end of the epoll batch, in case another event of the batch points to them.
+ */
+struct Connection : Pollable
+{
+    HttpParser parser;
+    const std::vector<ServerConfig> *servers;
+    const ServerConfig *server;   // chosen by Host, the listener's default until then
+    std::deque<PendingRequest> requests;
+    // Everything still to send, responses one after the other. outputSent is
+    // how much of the front segment already went out.
+    std::deque<OutputSegment> output;
+    size_t outputSent;
+    size_t queuedResponses;
+    bool keepAlive;                // false once a request asked to close
+    size_t requestCount;
+    TimerPhase timerPhase;
+    // CGI scripts answering this client. The one whose response head is
+    // still to come (cgi) holds back the responses of the requests after it.
+    CgiProcess *cgi;
+    std::vector<CgiProcess *> cgis;
+    bool sourceWait;               // the front body source had nothing to give
+    // io_uring backend: operations the kernel still holds on this connection.
+    // A closed connection is only recycled once none are left in flight.
+    bool recvArmed;
+    bool sendArmed;
+    bool readPaused;               // too many pipelined responses, recv cancelled
+    struct msghdr sendMsg;         // SENDMSG in flight, over sendIov
+    struct iovec sendIov[OUTPUT_IOV_MAX];
+
+    bool idle() const;
+    void queueOutput(const std::string &data, bool endOfResponse);
+    void queueShared(const SharedBuffer &data, bool endOfResponse);
+    void queueFile(const FileHandle &file, off_t offset, off_t length, bool endOfResponse);
+    void queueSource(const BodyStream &source, bool chunked);
+    PullResult pullSource();
+    size_t gatherOutput(struct iovec *iov, size_t max) const;
+    void consumeOutput(size_t bytes);
+
+    void reset(int clientFd, const Listener &listener);
+};
@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <sys/socket.h>
+#include "Connection.hpp"
+
+// FastCGI 1.0 record types and constants
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+
+// Requests multiplexed on one connection at most, whatever FCGI_MAX_REQS says
+#define FASTCGI_MAX_MPX 64
+
+struct CgiProcess;
+struct FastCgiUpstream;
+
+/**
+ * FastCgiConnection
+ * One connection to a FastCGI server. With keepalive it stays open between
+ * requests (FCGI_KEEP_CONN). It carries one request at a time, unless the
+ * server answers the FCGI_GET_VALUES sent first with FCGI_MPXS_CONNS=1:
+ * then requests are multiplexed on it, up to its FCGI_MAX_REQS.
+ */
+struct FastCgiConnection : Pollable
+{
+	FastCgiUpstream *upstream;
+	bool connected;                // the non-blocking connect() completed
+	bool reused;                   // a request already went through it
+	std::string out;               // records still to write, outSent of them written
+	size_t outSent;
+	std::string in;                // received bytes not parsed yet
+	// Requests in flight by id; NULL for an aborted one until its END_REQUEST
+	std::map<unsigned short, CgiProcess *> requests;
+	unsigned short lastId;
+	size_t capacity;
+	bool paused;                   // left unread: a request's client is behind
+	bool readArmed;                // io_uring: polls in flight
+	bool writeArmed;
+
+	explicit FastCgiConnection(FastCgiUpstream &owner);
+	~FastCgiConnection();
+
+	bool open();
+	bool checkConnect();
+	bool full() const;
+	void submit(CgiProcess &cgi);
+	void abort(CgiProcess &cgi);
+	bool flush();
+	bool receive(std::vector<CgiProcess *> &progressed, size_t max);
+	bool idle() const;
+
+private:
+	void record(int type, unsigned short id, const std::string &content);
+	void stream(int type, unsigned short id, const std::string &data);
+	void endRequest(unsigned short id, const std::string &content,
+					std::vector<CgiProcess *> &progressed);
+	void getValuesResult(const std::string &content);
+
+	FastCgiConnection(const FastCgiConnection &other);
+	FastCgiConnection &operator=(const FastCgiConnection &other);
+};
+
+/**
+ * FastCgiUpstream
+ * A fastcgi_pass address and the connections one event loop keeps to it:
+ * busy ones plus at most `keepalive` idle ones. Every loop has its own, so
+ * nothing here is locked.
+ */
+struct FastCgiUpstream
+{
+	std::string address;
+	struct sockaddr_storage addr;
+	socklen_t addrLen;
+	size_t keepalive;
+	std::list<FastCgiConnection *> connections;
+
+	FastCgiUpstream(const std::string &address, size_t keepalive);
+	bool resolve();
+	size_t idleConnections() const;
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+/**
+ * FileHandle
+ * Reference-counted file descriptor: copies share the fd and the last one
+ * closes it, so a response can be copied around while its body stays an
+ * open file. The count is atomic, handles may be shared between threads.
+ */
+class FileHandle
+{
+public:
+	FileHandle();
+	explicit FileHandle(int fd);
+	FileHandle(const FileHandle &other);
+	FileHandle &operator=(const FileHandle &other);
+	~FileHandle();
+
+	int fd() const;
+	bool isOpen() const;
+	void reset();
+
+private:
+	int _fd;
+	int *_refs;
+};
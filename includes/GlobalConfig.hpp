@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Directives that live outside of any server block
+class GlobalConfig
+{
+public:
+	GlobalConfig();
+	GlobalConfig(const GlobalConfig &other);
+	GlobalConfig &operator=(const GlobalConfig &other);
+	~GlobalConfig();
+
+	int worker_processes;
+	int worker_threads;
+	bool cpu_affinity_auto;
+	std::vector<std::string> cpu_affinity_masks;
+
+	void reset();
+
+	int getWorkerCount() const;
+	int getThreadCount() const;
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <zlib.h>
+#include "BodySource.hpp"
+
+// Compresses in into out as a gzip stream; false if zlib fails
+bool gzipString(const std::string &in, std::string &out, int level);
+
+/**
+ * GzipSource
+ * Gzip-compresses another body source while it is pulled, so compression
+ * follows streamed and chunked bodies. The compressed length is unknown up
+ * front: the response goes out chunked.
+ */
+class GzipSource : public BodySource
+{
+public:
+	GzipSource(const BodyStream &input, int level);
+	~GzipSource();
+
+	off_t length() const;
+	ssize_t read(std::string &out, size_t max);
+
+private:
+	BodyStream _input;
+	z_stream _zs;
+	bool _ready;
+	bool _finished;
+	bool _buffered;				// input given to deflate() since the last flush
+
+	GzipSource(const GzipSource &other);
+	GzipSource &operator=(const GzipSource &other);
+};
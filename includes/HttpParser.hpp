@@ -43,6 +43,9 @@ public:
 	// Add data to the buffer and try to parse it
 	void appendData(const std::string &data);
 
+	// Bytes received after the end of a complete request (pipelining)
+	std::string takeRemainder();
+
 	// Status checkers
 	bool isComplete() const;
 	bool hasError() const;
@@ -50,6 +53,8 @@ public:
 
 	// Check if the headers are parsed
 	bool headersComplete() const;
+	// Check if any byte of the request has been received
+	bool hasStarted() const;
 	bool serverSelected() const;
 	bool serverIsChosen() const;
 	void setIpFromHeader() ;
@@ -2,6 +2,25 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <sys/types.h>
+#include "FileHandle.hpp"
+#include "SharedPtr.hpp"
+#include "BodySource.hpp"
+
+struct CgiProcess;
+
+/**
+ * BodyPart
+ * One piece of a multi-part body: either data, or the fileLength bytes at
+ * fileOffset of the response's file.
+ */
+struct BodyPart
+{
+	std::string data;
+	off_t fileOffset;
+	off_t fileLength;
+};
 
 class HttpResponse
 {
@@ -10,6 +29,21 @@ private:
 	std::string _reasonPhrase;
 	std::map<std::string, std::string> _headers;
 	std::string _body;
+	// Static file body, sent straight from the fd (sendfile) instead of _body
+	FileHandle _file;
+	off_t _fileOffset;
+	off_t _fileLength;
+	// Multi-part body (data and slices of _file), used instead of the above
+	std::vector<BodyPart> _parts;
+	// Body produced while it is sent, used instead of all of the above
+	BodyStream _source;
+	// Pre-serialized head and body shared with a cache entry; once set,
+	// _headers only holds the headers added on top of them
+	SharedBuffer _sharedHead;
+	SharedBuffer _sharedBody;
+	// CGI script still running: the event loop takes it over and completes
+	// the response with its output
+	CgiProcess *_cgi;
 
 public:
 	HttpResponse();
@@ -17,11 +51,36 @@ public:
 
 	void setStatus(int code, const std::string &reason);
 	void setHeader(const std::string &key, const std::string &value);
+	std::string getHeader(const std::string &key) const;
+	void removeHeader(const std::string &key);
+	int getStatus() const;
 	bool setBodyFromFile(const std::string &filePath);
+	void setBodyFromFile(const FileHandle &file, off_t offset, off_t length);
+	void setBodyParts(const FileHandle &file, const std::vector<BodyPart> &parts);
+	void setBodySource(const BodyStream &source);
+	void setCloseDelimited();
 	void setBody(const std::string &body);
 
-	// Format response to string
+	const std::string &getBody() const;
+	bool hasFileBody() const;
+	const FileHandle &getFile() const;
+	off_t getFileOffset() const;
+	off_t getFileLength() const;
+	const std::vector<BodyPart> &getBodyParts() const;
+	const BodyStream &getBodySource() const;
+	bool isChunked() const;
+	void setCgi(CgiProcess *cgi);
+	CgiProcess *getCgi() const;
+
+	void setShared(const SharedBuffer &head, const SharedBuffer &body);
+	bool isShared() const;
+	const SharedBuffer &getSharedHead() const;
+	const SharedBuffer &getSharedBody() const;
+
+	// Format response to string (a file body is not included)
 	std::string toString() const;
+	std::string headString() const;
+	std::string headerBlock() const;
 
 private:
 	std::string statusLine() const;
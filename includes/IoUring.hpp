@@ -0,0 +1,61 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <cstddef>
+
+/**
+ * IoUring
+ * Minimal io_uring wrapper over the raw syscalls (no liburing): maps the
+ * submission and completion rings, hands out SQEs and submits them all with
+ * the same io_uring_enter() that waits for completions.
+ */
+class IoUring
+{
+public:
+	IoUring();
+	~IoUring();
+
+	void init(unsigned entries);
+
+	// Next free submission entry, zeroed. Flushes the ring first if it is full.
+	struct io_uring_sqe *getSqe();
+	// Flushes early if fewer than count SQEs are free, so that a linked
+	// chain of count entries is never split across two submissions
+	void reserve(unsigned count);
+	// Submit what was queued and wait up to waitMs for at least one completion
+	int submitAndWait(int waitMs);
+
+	// Completion queue iteration: peek, use, then advance
+	struct io_uring_cqe *peekCqe();
+	void advanceCq();
+
+	// Number of io_uring_enter() calls so far
+	unsigned long enterCalls() const;
+
+private:
+	int _fd;
+	void *_sqRing;
+	void *_cqRing;
+	size_t _sqRingSize;
+	size_t _cqRingSize;
+	struct io_uring_sqe *_sqes;
+	size_t _sqesSize;
+
+	unsigned *_sqHead;
+	unsigned *_sqTail;
+	unsigned *_sqMask;
+	unsigned *_sqArray;
+	unsigned *_cqHead;
+	unsigned *_cqTail;
+	unsigned *_cqMask;
+	struct io_uring_cqe *_cqes;
+
+	unsigned _pending;		// SQEs queued since the last enter
+	unsigned long _enterCalls;
+
+	unsigned freeSqes() const;
+	void flush();
+	int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize);
+
+	IoUring(const IoUring &other);
+	IoUring &operator=(const IoUring &other);
+};
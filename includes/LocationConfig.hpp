@@ -2,6 +2,18 @@
 #include <string>
 #include <vector>
 
+// Idle FastCGI connections kept by default (fastcgi_pass ... keepalive=N)
+#define FASTCGI_KEEPALIVE 8
+// Idle pool workers kept ready by default (cgi_pool_size N spare=M)
+#define CGI_POOL_SPARE 1
+// Requests waiting for a cgi_max_concurrent slot before the next gets a 503
+#define CGI_QUEUE_SIZE 64
+// cgi_cache defaults: seconds a response is fresh, then served stale while refreshed
+#define CGI_CACHE_VALID 1
+#define CGI_CACHE_STALE 10
+// Seconds a cgi_cache_lock miss waits for the request running its script
+#define CGI_CACHE_LOCK_TIMEOUT 5
+
 class LocationConfig
 {
 public:
@@ -17,9 +29,26 @@ public:
 	std::string index;
 	std::string cgi_pass;
 	std::string cgi_extension;
+	std::string fastcgi_pass;	// unix:/path or host:port of a FastCGI server
+	size_t fastcgi_keepalive;	// idle connections kept open to it, per event loop
+	size_t cgi_pool_size;		// persistent cgi_pass workers per event loop, 0: fork per request
+	size_t cgi_pool_spare;		// idle workers started ahead of requests
+	std::string cgi_worker;		// the script they run, speaking the pool protocol
+	size_t cgi_max_concurrent;	// scripts forked at once, split between worker processes, 0: no limit
+	size_t cgi_queue_size;		// requests waiting for one of them to exit, split the same way
+	int cgi_timeout;		// seconds a script may run, 0: no limit
+	int cgi_rlimit_cpu;		// RLIMIT_CPU of each script in seconds, 0: inherited
+	size_t cgi_rlimit_memory;	// RLIMIT_AS of each script in bytes, 0: inherited
+	size_t cgi_cache;		// bytes of GET responses kept per worker process, 0: off
+	int cgi_cache_valid;		// seconds one is fresh, unless Cache-Control says
+	int cgi_cache_stale;		// seconds it may then go out while one request of the process refreshes it
+	bool cgi_cache_lock;		// concurrent misses for a key wait for one script
+	int cgi_cache_lock_timeout;	// seconds they wait before running their own
 	std::string upload_store;
 	std::string redirect; 
 	size_t max_body_size;
+	long static_cache;		// -1: the server's static_cache
+	bool gzip_static;		// serve file.gz when the client takes gzip
 
 	void reset();
 
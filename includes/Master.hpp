@@ -0,0 +1,51 @@
+#pragma once
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+#include <pthread.h>
+#include "ServerConfig.hpp"
+#include "GlobalConfig.hpp"
+#include "SharedZones.hpp"
+
+// A worker that fails or is killed faster than this after being forked is
+// not respawned: the master shuts down instead
+#define WORKER_MIN_LIFETIME 1
+
+class Master;
+
+// One event loop thread inside a worker
+struct LoopThread
+{
+	pthread_t tid;
+	Master *master;
+	SharedZones *zones;
+	size_t index;
+	bool failed;
+};
+
+class Master
+{
+public:
+	Master(const std::vector<ServerConfig> &servers, const GlobalConfig &global);
+	~Master();
+
+	// Fork the workers and supervise them until SIGINT/SIGTERM
+	int run();
+
+	// Run this process' event loops (worker_threads of them) until stop_flag
+	int runLoops(size_t slot);
+
+private:
+	std::vector<ServerConfig> _servers;
+	GlobalConfig _global;
+	std::vector<pid_t> _workers;
+	std::vector<long> _startedAt;	// monotonicMs() at fork
+
+	static long monotonicMs();
+	bool spawnWorker(size_t slot);
+	void runWorker(size_t slot);
+	void setAffinity(size_t index);
+	static void *loopThread(void *arg);
+	void stopWorkers();
+	int findSlot(pid_t pid) const;
+};
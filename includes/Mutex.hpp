@@ -0,0 +1,33 @@
+#pragma once
+#include <pthread.h>
+
+// Thin wrapper around pthread_mutex_t, for state shared by event loop threads
+class Mutex
+{
+public:
+	Mutex();
+	~Mutex();
+
+	void lock();
+	void unlock();
+
+private:
+	pthread_mutex_t _mutex;
+
+	Mutex(const Mutex &other);
+	Mutex &operator=(const Mutex &other);
+};
+
+// Locks the mutex for the lifetime of the object
+class ScopedLock
+{
+public:
+	explicit ScopedLock(Mutex &mutex);
+	~ScopedLock();
+
+private:
+	Mutex &_mutex;
+
+	ScopedLock(const ScopedLock &other);
+	ScopedLock &operator=(const ScopedLock &other);
+};
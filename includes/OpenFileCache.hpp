@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <map>
+#include <list>
+#include <ctime>
+#include <sys/stat.h>
+#include "FileHandle.hpp"
+#include "Mutex.hpp"
+
+/**
+ * OpenFileInfo
+ * What the filesystem said about a path: the errno of stat()/open() (0 on
+ * success), the stat data and, for a regular file asked to be opened, its
+ * open fd. Directories are never kept open.
+ */
+struct OpenFileInfo
+{
+	int error;
+	bool isDir;
+	struct stat st;
+	FileHandle file;
+
+	OpenFileInfo();
+};
+
+/**
+ * OpenFileCache
+ * open_file_cache: an LRU of OpenFileInfo by path, bounded in entries.
+ * Entries are trusted for `valid` seconds before being stat()ed again, and
+ * dropped once unused for `inactive` seconds. Failed lookups are cached
+ * only with open_file_cache_errors. Shared by the event loops of a worker
+ * process (see SharedZones): the LRU is locked, the stat()/open() calls
+ * are made outside the lock.
+ */
+class OpenFileCache
+{
+public:
+	OpenFileCache(size_t max, int inactive, int valid, bool errors);
+	~OpenFileCache();
+
+	// Fills info for path; regular files are opened too when open is set
+	void lookup(const std::string &path, time_t now, bool open, OpenFileInfo &info);
+	void remove(const std::string &path);
+
+	// Uncached lookup, for servers without open_file_cache
+	static void load(const std::string &path, bool open, OpenFileInfo &info);
+
+private:
+	struct Entry
+	{
+		OpenFileInfo info;
+		time_t validatedAt;
+		time_t usedAt;
+	};
+	typedef std::list< std::pair<std::string, Entry> > Entries;
+
+	Mutex _mutex;
+	Entries _entries;		// most recently used first
+	std::map<std::string, Entries::iterator> _index;
+	size_t _max;
+	int _inactive;
+	int _valid;
+	bool _errors;
+
+	bool cached(const std::string &path, time_t now, bool open, OpenFileInfo &info);
+	void evict(std::map<std::string, Entries::iterator>::iterator it);
+	void expire(time_t now);
+
+	OpenFileCache(const OpenFileCache &other);
+	OpenFileCache &operator=(const OpenFileCache &other);
+};
@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include "ServerConfig.hpp"
 #include "LocationConfig.hpp"
+#include "Mutex.hpp"
 
 
 struct SessionData
@@ -25,11 +26,15 @@ class Outils
         Outils();
         ~Outils();
         std::map<std::string, std::string> parseCookieString(const std::string &cookieStr);
-        std::map<std::string, SessionData> g_sessions;
         std::string generateRandomSessionID();
         std::string extractExtention(std::string path);
         std::string trim(const std::string &s);
         void printConf(const std::vector<ServerConfig> &servers);
         void storeSessionData(const std::string &sid, const std::string &ip, const std::string &userAgent);
-        SessionData *getSessionData(const std::string &sid);
+        bool getSessionData(const std::string &sid, SessionData &out);
+
+    private:
+        // Shared by every event loop thread of the process
+        static std::map<std::string, SessionData> g_sessions;
+        static Mutex g_sessionsMutex;
 };
\ No newline at end of file
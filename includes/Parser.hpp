@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ServerConfig.hpp"
+#include "GlobalConfig.hpp"
 #include <string>
 #include <vector>
 
@@ -14,9 +15,11 @@ public:
 
 	void parseConfig(const std::string &filename);
 	const std::vector<ServerConfig> &getServers() const;
+	const GlobalConfig &getGlobal() const;
 
 private:
 	std::vector<ServerConfig> servers;
+	GlobalConfig global;
 
 	std::vector<std::string> tokens;
 	size_t currentIndex;
@@ -32,10 +35,12 @@ private:
 	void checkUniqueListen();
 	void parseServerBlock(ServerConfig &srv);
 	void parseLocationBlock(ServerConfig &srv);
+	void parseGlobalDirective(const std::string &directive);
 	void parseServerDirective(ServerConfig &srv, const std::string &directive);
 	void parseLocationDirective(LocationConfig &loc, const std::string &directive);
 
 	void parseListen(ServerConfig &srv, const std::string &value);
 	size_t parseSize(const std::string &value);
+	int parseTime(const std::string &value);
 	int parseStatusCode(const std::string &value);
 };
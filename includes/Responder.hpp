@@ -12,11 +12,29 @@
 #include "HttpResponse.hpp"
 #include "ServerConfig.hpp"
 #include "Outils.hpp"
+#include "ResponseCache.hpp"
+#include "OpenFileCache.hpp"
+#include "SharedZones.hpp"
+#include "CgiProcess.hpp"
+
+// CGI output held while the client is behind; past it the script's stdout
+// is left unread until the client catches up
+#define CGI_BUFFER_SIZE (64 * 1024)
+
+// More ranges than that in one Range header: the whole file is sent
+#define MAX_RANGES 16
+
+enum RangeResult
+{
+	RANGE_IGNORE,
+	RANGE_UNSATISFIABLE,
+	RANGE_SATISFIABLE
+};
 
 class Responder
 {
 public:
-	Responder();
+	explicit Responder(SharedZones &zones);
 	~Responder();
 
 	// The main method of the class: handle the request and return the response
@@ -27,20 +45,52 @@ public:
 	HttpResponse makeErrorResponse(int code, const std::string &reason,
 											 const ServerConfig &server,
 											 const std::string &defaultMessage);
+	void compressResponse(const HttpParser &parser, const ServerConfig &server, HttpResponse &resp);
+	HttpResponse cgiResponse(CgiProcess &cgi);
+	bool cacheCgiResponse(CgiProcess &cgi, HttpResponse &resp);
 	Outils outils;
 
 private:
-	
-	static std::map<std::string, std::string> g_sessions;
 	std::string getContentTypeByExtension(const std::string &path);
 	bool isMethodAllowed(HttpMethod method, const ServerConfig &server, const LocationConfig *loc, std::string &allowHeader);
 	std::string buildFilePath(const ServerConfig &server, const LocationConfig *loc, const std::string &path);
-	bool setBodyFromFile(HttpResponse &resp, const std::string &filePath);
+	bool setBodyFromFile(HttpResponse &resp, const OpenFileInfo &info);
+	OpenFileCache *openFileCache(const ServerConfig &server);
+	void fileInfo(const ServerConfig &server, const std::string &path, bool open, OpenFileInfo &info);
+	ResponseCache *staticCache(const ServerConfig &server, const LocationConfig *loc);
+	void cacheStaticResponse(ResponseCache &cache, const std::string &key, HttpResponse &resp,
+							 const std::string &filePath, const struct stat &built, int gzipLevel);
+	ResponseCache *cgiCache(const ServerConfig &server, const LocationConfig *loc);
+	bool compressible(const ServerConfig &server, const HttpResponse &resp);
+	void markGzipped(HttpResponse &resp);
+	std::string makeETag(ino_t inode, off_t size, time_t mtime);
+	std::string httpDate(time_t t);
+	bool isNotModified(const HttpParser &parser, const std::string &etag, time_t mtime);
+	HttpResponse makeNotModified(const std::string &etag, time_t mtime);
+	bool ifRangeMatches(const HttpParser &parser, const std::string &etag, time_t mtime);
+	int parseRange(const std::string &value, off_t size, std::vector<std::pair<off_t, off_t> > &ranges);
+	void setRangeBody(HttpResponse &resp, const std::vector<std::pair<off_t, off_t> > &ranges,
+					  off_t size, const std::string &ctype);
+	bool acceptsGzip(const HttpParser &parser);
 	HttpResponse handleGet(const ServerConfig &server, const HttpParser &parser, const LocationConfig *loc, const std::string &reqPath);
 	HttpResponse handlePost(const ServerConfig &server, const HttpParser &parser, const LocationConfig *loc, const std::string &reqPath);
 	HttpResponse handleDelete(const ServerConfig &server, const LocationConfig *loc, const std::string &reqPath);
 	std::string extractFilename(const std::string &reqPath);
 	HttpResponse handleCgi(const ServerConfig &server, const HttpParser &parser, const LocationConfig *loc, const std::string &reqPath);
-	HttpResponse processCgiOutput(int pipeFd, pid_t childPid);
 	bool parseMultipartFormData(const std::string &contentType, const std::string &body, std::string &fileFieldName, std::string &filename, std::string &fileContent);
+
+	// The worker process' cache zones, and the ones this loop already
+	// looked up there, by name
+	SharedZones &_zones;
+	// static_cache zones, one per server/location that enables it
+	std::map<std::string, ResponseCache *> _staticCaches;
+	// cgi_cache zones, one per server/location that enables it
+	std::map<std::string, ResponseCache *> _cgiCaches;
+	// open_file_cache zones, one per server that enables it
+	std::map<std::string, OpenFileCache *> _openFileCaches;
+	// Numbers the multipart/byteranges boundaries
+	unsigned long _boundaries;
+
+	Responder(const Responder &other);
+	Responder &operator=(const Responder &other);
 };
\ No newline at end of file
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <map>
+#include <list>
+#include <ctime>
+#include <sys/types.h>
+#include "SharedPtr.hpp"
+#include "Mutex.hpp"
+
+// Bigger files are left to sendfile()
+#define STATIC_CACHE_MAX_FILE (1024 * 1024)
+// Bigger CGI responses are streamed, not cached
+#define CGI_CACHE_MAX_ENTRY (1024 * 1024)
+
+/**
+ * CachedResponse
+ * A static response ready to be sent: the serialized head (status line and
+ * headers, without the blank line) and body, with the stat data of the file
+ * it was built from, checked on every hit to notice when that file changes
+ * (validatedAt is when it was cached). A CGI response
+ * (cgi_cache) has no file: stored at validatedAt, it is fresh until
+ * expires, then goes out stale until staleUntil while one request
+ * refreshes it: the zone is shared by the loops of a worker process, so
+ * refreshing is set once for all of them (startRefresh).
+ */
+struct CachedResponse
+{
+	SharedBuffer head;
+	SharedBuffer body;
+	std::string path;
+	time_t mtime;
+	off_t size;
+	ino_t inode;
+	time_t validatedAt;
+	time_t expires;
+	time_t staleUntil;
+	bool refreshing;
+
+	CachedResponse();
+};
+
+/**
+ * ResponseCache
+ * LRU of CachedResponse bounded in bytes (head + body), shared by the
+ * event loops of a worker process (see SharedZones): every call locks it,
+ * and hits are handed out as copies whose buffers stay valid after the
+ * entry is evicted.
+ */
+class ResponseCache
+{
+public:
+	explicit ResponseCache(size_t capacity);
+	~ResponseCache();
+
+	// Copies the entry for key into hit
+	bool lookup(const std::string &key, time_t now, CachedResponse &hit);
+	void store(const std::string &key, const CachedResponse &entry);
+	void remove(const std::string &key);
+	bool startRefresh(const std::string &key);
+	void endRefresh(const std::string &key);
+	size_t capacity() const;
+
+private:
+	typedef std::list< std::pair<std::string, CachedResponse> > Entries;
+
+	Mutex _mutex;
+	Entries _entries;		// most recently used first
+	std::map<std::string, Entries::iterator> _index;
+	const size_t _capacity;
+	size_t _bytes;
+
+	static size_t weight(const CachedResponse &entry);
+	void evict(std::map<std::string, Entries::iterator>::iterator it);
+
+	ResponseCache(const ResponseCache &other);
+	ResponseCache &operator=(const ResponseCache &other);
+};
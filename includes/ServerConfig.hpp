@@ -14,6 +14,8 @@ public:
 
 	std::string host;
 	int port;
+	int backlog;
+	bool defer_accept;
 	std::string server_name;
 	std::string root;
 	size_t max_body_size;
@@ -21,6 +23,20 @@ public:
 	std::map<int, std::string> error_pages;
 	std::vector<std::string> methods;
 	std::vector<LocationConfig> locations;
+	int keepalive_timeout;
+	int client_header_timeout;
+	int client_body_timeout;
+	int send_timeout;
+	size_t keepalive_requests;
+	size_t static_cache;		// bytes of LRU response cache, 0 = off
+	size_t open_file_cache;		// max cached fds/stat results, 0 = off
+	int open_file_cache_inactive;	// drop entries unused for that long
+	int open_file_cache_valid;	// stat() cached entries again after that long
+	bool open_file_cache_errors;	// also cache failed lookups (ENOENT...)
+	bool gzip;			// compress responses on the fly
+	std::vector<std::string> gzip_types;	// besides text/html
+	size_t gzip_min_length;		// smaller bodies are sent as they are
+	int gzip_comp_level;
 
 	void reset();
 
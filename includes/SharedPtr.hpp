@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+/**
+ * SharedPtr
+ * Minimal reference-counted pointer (no C++11 here): the last copy deletes
+ * the object. The count is atomic so a pointer can cross threads, the
+ * object itself is not protected.
+ */
+template <typename T>
+class SharedPtr
+{
+public:
+	SharedPtr() : _ptr(NULL), _refs(NULL) {}
+
+	explicit SharedPtr(T *ptr) : _ptr(ptr), _refs(ptr ? new int(1) : NULL) {}
+
+	SharedPtr(const SharedPtr &other) : _ptr(other._ptr), _refs(other._refs)
+	{
+		if (_refs)
+			__sync_add_and_fetch(_refs, 1);
+	}
+
+	SharedPtr &operator=(const SharedPtr &other)
+	{
+		if (this != &other)
+		{
+			if (other._refs)
+				__sync_add_and_fetch(other._refs, 1);
+			reset();
+			_ptr = other._ptr;
+			_refs = other._refs;
+		}
+		return *this;
+	}
+
+	~SharedPtr()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		if (_refs && __sync_sub_and_fetch(_refs, 1) == 0)
+		{
+			delete _ptr;
+			delete _refs;
+		}
+		_ptr = NULL;
+		_refs = NULL;
+	}
+
+	T *get() const { return _ptr; }
+	T &operator*() const { return *_ptr; }
+	T *operator->() const { return _ptr; }
+
+private:
+	T *_ptr;
+	int *_refs;
+};
+
+// Immutable bytes shared between a cache entry and the responses using it
+typedef SharedPtr<const std::string> SharedBuffer;
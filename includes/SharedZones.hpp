@@ -0,0 +1,66 @@
+#pragma once
+#include <string>
+#include <map>
+#include <set>
+#include "Mutex.hpp"
+#include "ResponseCache.hpp"
+#include "OpenFileCache.hpp"
+
+/**
+ * SharedZones
+ * The cache zones of one worker process (static_cache, cgi_cache,
+ * open_file_cache), shared by all its event loop threads so a file or a
+ * script output is kept once per process, not once per loop. Zones are
+ * created on first use and live as long as the process; each zone locks
+ * itself. Separate worker processes still have their own.
+ * The cgi_max_concurrent slots of a location are counted here too, so the
+ * limit holds for the process, not for each loop. A loop whose requests
+ * wait for a slot leaves its wake eventfd: giving a slot back writes to
+ * the ones waiting, which then start their queues again.
+ * cgi_cache_lock is held here as well: one request of the process runs the
+ * script for a key, the loops of the others are woken once it is done.
+ */
+class SharedZones
+{
+public:
+	SharedZones();
+	~SharedZones();
+
+	ResponseCache *staticCache(const std::string &zone, size_t capacity);
+	ResponseCache *cgiCache(const std::string &zone, size_t capacity);
+	OpenFileCache *openFileCache(const std::string &zone, size_t max, int inactive, int valid,
+								 bool errors);
+
+	bool takeCgiSlot(const std::string &location, size_t max, bool queued, int wakeFd);
+	bool queueCgi(const std::string &location, size_t queueSize);
+	void dequeueCgi(const std::string &location);
+	void releaseCgiSlot(const std::string &location);
+	bool lockCgiCache(const std::string &key, int wakeFd);
+	void unlockCgiCache(const std::string &key);
+
+private:
+	// cgi_max_concurrent of one location, over all the loops
+	struct CgiSlots
+	{
+		size_t running;			// scripts forked, until reaped
+		size_t queued;			// requests waiting in the loops' queues
+		std::set<int> waiters;	// wake eventfds of the loops to tell about a free slot
+
+		CgiSlots() : running(0), queued(0) {}
+	};
+
+
+	Mutex _mutex;		// guards the maps and slots, not the zones
+	std::map<std::string, ResponseCache *> _staticCaches;
+	std::map<std::string, ResponseCache *> _cgiCaches;
+	std::map<std::string, OpenFileCache *> _openFileCaches;
+	std::map<std::string, CgiSlots> _cgiSlots;
+	// cgi_cache_lock: the keys whose script runs, with the wake eventfds of
+	// the loops waiting for it
+	std::map<std::string, std::set<int> > _cacheLocks;
+
+	static void wake(std::set<int> &waiters);
+
+	SharedZones(const SharedZones &other);
+	SharedZones &operator=(const SharedZones &other);
+};
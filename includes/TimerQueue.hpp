@@ -0,0 +1,55 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <queue>
+#include <ctime>
+
+struct TimerEntry
+{
+	time_t deadline;
+	int fd;
+	unsigned long generation;
+};
+
+struct TimerEntryLater
+{
+	bool operator()(const TimerEntry &a, const TimerEntry &b) const
+	{
+		return a.deadline > b.deadline;
+	}
+};
+
+/**
+ * TimerQueue
+ * One deadline per fd, kept in a min-heap with lazy deletion: cancelled or
+ * superseded entries stay in the heap and are skipped when they surface.
+ * Pushing a later deadline only updates the record, the entry already in the
+ * heap is re-pushed when it pops, so busy connections don't grow the heap.
+ * Expiring n timers costs O(n log size) whatever the number of connections.
+ */
+class TimerQueue
+{
+public:
+	TimerQueue();
+	~TimerQueue();
+
+	void schedule(int fd, time_t deadline);
+	void cancel(int fd);
+	bool popExpired(time_t now, int &fd);
+	// Milliseconds until the next deadline, capped at maxMs
+	int msUntilNext(time_t now, int maxMs);
+
+private:
+	struct Record
+	{
+		time_t deadline;	 // wanted deadline
+		time_t queued;		 // deadline of the live heap entry
+		unsigned long generation;
+	};
+
+	std::priority_queue<TimerEntry, std::vector<TimerEntry>, TimerEntryLater> _heap;
+	std::map<int, Record> _records;
+	unsigned long _generation;
+
+	void push(int fd, Record &rec, time_t deadline);
+};
@@ -5,6 +5,7 @@
 #include <string>
 #include <map>
 #include <list>
+#include <deque>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -16,39 +17,161 @@
 #include <algorithm>
 #include "LocationConfig.hpp"
 #include "Responder.hpp"
+#include "TimerQueue.hpp"
+#include "Connection.hpp"
+#include "CgiProcess.hpp"
+#include "FastCgi.hpp"
+#include "CgiPool.hpp"
 #include <ctime>
 #include <sys/epoll.h>
+#ifdef WEBSERV_IO_URING
+#include "IoUring.hpp"
+#endif
 
-#define TIMEOUT_SECONDS 30
+// Longest sleep of the event loop, so that stop_flag is seen
+#define EPOLL_TIMEOUT 1000
+// Responses queued on one connection before we stop reading its requests
+#define MAX_PIPELINED 32
+// Seconds a script past cgi_timeout gets between SIGTERM and SIGKILL
+#define CGI_KILL_DELAY 5
+// Milliseconds between waitpid() polls for a script without a pidfd
+#define CGI_REAP_INTERVAL 10
 
 class WebServ
 {
 public:
-    WebServ(const std::vector<ServerConfig> &configs);
+    WebServ(const std::vector<ServerConfig> &configs, SharedZones &zones, bool reusePort = false);
     ~WebServ();
 
     void start();
 
 private:
     std::vector<ServerConfig> _servers;
-    std::vector<int> _listenSockets;
-    std::map<int, HttpParser> _parsers;
-    std::map<int, size_t> _listenSockettoServerIndex;
-    std::map<int, size_t> _clientToServerIndex;
-    std::map<int, std::string> _writeBuffers;
-    std::map<int, time_t> _lastActivity;
+    // Cache zones shared with the other loops of this process
+    SharedZones &_zones;
+    std::vector<Listener *> _listeners;
+    // Client connections indexed by fd, recycled through _freeConnections
+    std::vector<Connection *> _connections;
+    std::vector<Connection *> _freeConnections;
+    std::vector<Connection *> _closedConnections;
+    // CGI processes done with their client, freed once reaped and idle
+    std::vector<CgiProcess *> _closedCgis;
+    // FastCGI servers by fastcgi_pass address and keepalive, with this
+    // loop's connections to them; closed connections are freed once idle
+    std::map<std::pair<std::string, size_t>, FastCgiUpstream *> _upstreams;
+    std::vector<FastCgiConnection *> _closedUpstreams;
+    // cgi_pool_size workers by cgi_pass and cgi_worker
+    std::map<std::pair<std::string, std::string>, CgiPool *> _pools;
+    // cgi_max_concurrent: the shared slots and this loop's queue by location
+    std::map<const LocationConfig *, CgiLimit> _cgiLimits;
+    // eventfd the other loops write to when a slot this loop waits for is free
+    Pollable _wake;
+    TimerQueue _timers;
+    // cgi_timeout deadlines by pid, of the scripts in _timedCgis
+    TimerQueue _cgiTimers;
+    std::map<pid_t, CgiProcess *> _timedCgis;
+    // Scripts done with their stdout but not reaped, when there is no pidfd
+    std::map<pid_t, CgiProcess *> _unreapedCgis;
+    // cgi_cache_lock (held in the SharedZones): the requests waiting for
+    // another to run the script of their key, with their deadlines, by client fd
+    TimerQueue _cacheLockTimers;
+    std::map<int, CgiProcess *> _lockedCgis;
+    time_t _now;
     std::map< std::pair<std::string,int>, std::vector<ServerConfig> > serverGroups;
-    std::map<int, std::vector<ServerConfig> > _serversForSocket;
-    std::map<int, const std::vector<ServerConfig>*> _clientToServers;
     int _epoll_fd;
+    bool _reusePort;
+    // Benchmark counters, printed on exit when the server runs with -s
+    unsigned long _wakeups;
+    unsigned long _syscalls;
+    unsigned long _requests;
+#ifdef WEBSERV_IO_URING
+    std::vector<char> _recvBuffers;   // declared first: outlives the ring using it
+    IoUring _ring;
+#endif
 
     void initSockets();
     void mainLoop();
-    void acceptNewConnection(int listen_fd);
-    void handleClientRead(int fd, Responder &responder);
-    void handleClientWrite(int fd);
-    void closeClient(int fd);
-    void checkTimeouts();
+    void printStats();
+    void acceptNewConnection(Listener &listener);
+    Connection *openConnection(int clientFd, Listener &listener);
+    void handleClientRead(Connection &conn, Responder &responder);
+    void feedParser(Connection &conn, const std::string &data);
+    void processRequests(Connection &conn, Responder &responder);
+    void queueResponse(Connection &conn, HttpResponse &resp);
+    void wakeClient(Connection &conn);
+    void handleClientWrite(Connection &conn);
+    ssize_t sendFile(int fd, const OutputSegment &segment, size_t done);
+    ssize_t spliceSource(Connection &conn, int pipe, size_t max);
+    void closeClient(Connection &conn);
+    void detachClient(Connection &conn);
+    void resetClient(Connection &conn);
+    void releaseClosedConnections();
+    bool shouldKeepAlive(const Connection &conn, const HttpParser &parser, const ServerConfig &srv);
+    void armTimer(Connection &conn);
+    void checkTimeouts(Responder &responder);
+    void cgiTimedOut(CgiProcess &cgi);
+    void cancelCgiTimeout(CgiProcess &cgi);
+    void reapCgis(Responder &responder);
+    int loopTimeout();
+    int startCgi(Connection &conn, CgiProcess *cgi, Responder &responder);
+    void failCgi(CgiProcess &cgi, int status, Responder &responder);
+    void waitCgiLock(CgiProcess &cgi);
+    void cgiLockExpired(CgiProcess &cgi, Responder &responder);
+    void cgiLockReleased(CgiProcess &cgi, Responder &responder);
+    void answerWaitingCgis(CgiProcess &holder, const HttpResponse &shared, Responder &responder);
+    void answerWaitingCgi(CgiProcess &cgi, HttpResponse resp, Responder &responder);
+    void runWaitingCgi(CgiProcess &cgi, Responder &responder);
+    void unlockCgi(CgiProcess &cgi);
+    void refreshCgi(CgiProcess *cgi);
+    int submitCgi(CgiProcess &cgi);
+    bool launchCgi(CgiProcess &cgi);
+    int admitCgi(CgiProcess &cgi);
+    void startQueuedCgis(const LocationConfig &loc, Responder &responder);
+    void releaseCgiSlot(CgiProcess &cgi);
+    void handleWake(Responder &responder);
+    bool watchCgi(CgiPipe &pipe);
+    bool watchCgiProcess(CgiProcess &cgi);
+    void handleCgiEvent(CgiPipe &pipe, Responder &responder);
+    void cgiProgress(CgiProcess &cgi, Responder &responder);
+    void cgiRefreshProgress(CgiProcess &cgi, Responder &responder);
+    void cgiRespond(CgiProcess &cgi, Responder &responder);
+    void closeCgiPipe(CgiPipe &pipe);
+    void retireCgi(CgiProcess &cgi);
+    void resumeCgiOutput(Connection &conn);
+    void resumeCgiRead(CgiProcess &reader);
+    void abortCgis(Connection &conn);
+    void abortCgi(CgiProcess &cgi);
+    void startCgiPools();
+    CgiPool &cgiPool(const std::string &interpreter, const std::string &script, size_t size,
+                     size_t spare);
+    bool submitCgiJob(CgiProcess &request);
+    void dispatchCgiJobs(CgiPool &pool);
+    void spareWorkers(CgiPool &pool);
+    CgiProcess *spawnWorker(CgiPool &pool);
+    void feedWorker(CgiProcess &worker);
+    void handleWorkerEvent(CgiPipe &pipe, Responder &responder);
+    void retireWorker(CgiProcess &worker, Responder &responder);
+    bool submitFastCgi(CgiProcess &cgi);
+    bool watchFastCgi(FastCgiConnection &fc);
+    bool sendFastCgi(FastCgiConnection &fc);
+    void resumeFastCgi(FastCgiConnection &fc);
+    void handleFastCgiEvent(FastCgiConnection &fc, Responder &responder);
+    void dropFastCgi(FastCgiConnection &fc, Responder &responder);
+    void closeFastCgi(FastCgiConnection &fc);
+#ifdef WEBSERV_IO_URING
+    void uringLoop();
+    void uringComplete(__u64 userData, int res, unsigned flags, Responder &responder);
+    void uringRecv(Connection &conn, int res, unsigned flags, Responder &responder);
+    void uringSent(Connection &conn, int res);
+    void uringAccept(Listener &listener);
+    void uringRecvArm(Connection &conn);
+    void uringSend(Connection &conn);
+    void uringClose(int fd);
+    void uringProvideBuffer(unsigned index);
+    void uringPoll(CgiPipe &pipe);
+    void uringPoll(FastCgiConnection &fc, bool write);
+    void uringPollWake();
+#endif
     const ServerConfig &chooseServer(const std::vector<ServerConfig> &serversVec, const std::string &hostName);
 };
 
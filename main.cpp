@@ -1,11 +1,13 @@
 #include "Parser.hpp"
 #include "WebServ.hpp"
+#include "Master.hpp"
 #include "Outils.hpp"
 #include <iostream>
 #include <cstdlib>
 #include <signal.h>
 
 volatile sig_atomic_t stop_flag = 0;
+bool print_stats = false;
 
 void handle_sigint(int signum) {
     (void)signum;  
@@ -19,18 +21,34 @@ int main(int argc, char *argv[])
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // sendfile() has no MSG_NOSIGNAL: a client leaving mid-body must not kill us
+    signal(SIGPIPE, SIG_IGN);
 
     Parser p;
 	//Outils outils;
     std::string configFile = "config/config.conf";
 
-    if (argc > 1)
-        configFile = argv[1];
+    // -s: benchmark mode, every event loop prints its counters on exit
+    int arg = 1;
+    if (argc > arg && std::string(argv[arg]) == "-s")
+    {
+        print_stats = true;
+        arg++;
+    }
+    if (argc > arg)
+        configFile = argv[arg];
 
     try
     {
         p.parseConfig(configFile);
-        WebServ ws(p.getServers());
+        if (p.getGlobal().getWorkerCount() > 1 || p.getGlobal().getThreadCount() > 1)
+        {
+            Master master(p.getServers(), p.getGlobal());
+            return master.run();
+        }
+        SharedZones zones;
+        WebServ ws(p.getServers(), zones);
 		//outils.printConf(p.getServers());
         ws.start();
     }
@@ -8,130 +8,161 @@
 #include <string>
 #include <sstream>
 #include <iostream>
+#include "OpenFileCache.hpp"
+#include "BodySource.hpp"
 
-struct FileEntry
-{
-	std::string name;
-	bool isDir;
-	long long size;
-	std::string mtime;
-};
+// Directory entries stat()ed per generate() call
+#define AUTOINDEX_BATCH 64
 
-struct FileEntryCompare
+/**
+ * AutoIndexSource
+ * The autoindex page, generated while it is sent: the entry names are read
+ * and sorted up front, but each entry is only stat()ed when its row is
+ * produced, a batch at a time.
+ */
+class AutoIndexSource : public GeneratorSource
 {
-	bool operator()(const FileEntry &a, const FileEntry &b) const
-	{
-		return a.name < b.name;
-	}
+public:
+	// dirPath: the full path to directory (for example "www/site1/images")
+	// reqPath: the path that user asked for (for example "/images/")
+	// cache: the server's open file cache, NULL to stat() every entry
+	AutoIndexSource(const std::string &dirPath, const std::string &reqPath,
+					OpenFileCache *cache);
+
+protected:
+	bool generate(std::string &out);
+
+private:
+	std::string _dirPath;
+	std::string _reqPath;
+	OpenFileCache *_cache;
+	bool _opened;
+	std::vector<std::string> _names;
+	size_t _next;
+	bool _started;
+
+	void appendRow(std::ostringstream &oss, const std::string &name);
 };
 
-// dirPath: the full path to directory (for example "www/site1/images")
-// reqPath: the path that user asked for (for example "/images/")
-std::string makeAutoIndexPage(const std::string &dirPath,
-										const std::string &reqPath)
+AutoIndexSource::AutoIndexSource(const std::string &dirPath, const std::string &reqPath,
+								 OpenFileCache *cache)
+	: _dirPath(dirPath), _reqPath(reqPath), _cache(cache), _opened(false), _next(0),
+	  _started(false)
 {
 	DIR *dir = opendir(dirPath.c_str());
 	if (!dir)
-	{
-		std::ostringstream oss;
-		oss << "<html><body><h1>Cannot open directory: "
-			 << dirPath << "</h1></body></html>";
-		return oss.str();
-	}
-
-	std::vector<FileEntry> entries;
+		return;
+	_opened = true;
 
 	struct dirent *entry;
 	while ((entry = readdir(dir)) != NULL)
 	{
 		std::string name = entry->d_name;
 		if (name == "." || name == "..")
-			continue; 
-		std::string fullPath = dirPath;
-		if (!fullPath.empty() &&
-			 fullPath[fullPath.size() - 1] != '/')
-		{
-			fullPath += "/";
-		}
-		fullPath += name;
-
-		struct stat st;
-		if (stat(fullPath.c_str(), &st) == 0)
-		{
-			bool isDir = S_ISDIR(st.st_mode);
-			long long sz = 0;
-			if (!isDir)
-				sz = static_cast<long long>(st.st_size);
-			char timebuf[64];
-			struct tm *lt = localtime(&st.st_mtime);
-			strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M", lt);
-			FileEntry fe;
-			fe.name = name;
-			fe.isDir = isDir;
-			fe.size = sz;
-			fe.mtime = timebuf;
-
-			entries.push_back(fe);
-		}
-		else
-		{
-			// Can log error here
-		}
+			continue;
+		_names.push_back(name);
 	}
 	closedir(dir);
 
-	std::sort(entries.begin(), entries.end(), FileEntryCompare());
+	std::sort(_names.begin(), _names.end());
+}
 
+bool AutoIndexSource::generate(std::string &out)
+{
 	std::ostringstream oss;
-	oss << "<!DOCTYPE html>\n"
-		 << "<html>\n"
-		 << "<head>\n"
-		 << "  <meta charset=\"UTF-8\"/>\n"
-		 << "  <title>Index of " << reqPath << "</title>\n"
-		 << "  <style>\n"
-		 << "    body { font-family: sans-serif; }\n"
-		 << "    table { border-collapse: collapse; }\n"
-		 << "    th, td { border: 1px solid #ccc; padding: 4px 8px; }\n"
-		 << "  </style>\n"
-		 << "</head>\n"
-		 << "<body>\n"
-		 << "  <h1>Index of " << reqPath << "</h1>\n"
-		 << "  <table>\n"
-		 << "    <tr><th>Name</th><th>Size</th><th>Last Modified</th></tr>\n";
-
-	for (size_t i = 0; i < entries.size(); i++)
+	if (!_opened)
 	{
-		const FileEntry &fe = entries[i];
-		std::string href = reqPath;
-		if (!href.empty() && href[href.size() - 1] != '/')
-			href += "/";
-		href += fe.name;
-		if (fe.isDir && !fe.name.empty() &&
-			 fe.name[fe.name.size() - 1] != '/')
-		{
-			href += "/";
-		}
-		std::string icon = fe.isDir ? "[DIR]" : "[FILE]";
-		std::string sizeStr;
-		if (fe.isDir)
-			sizeStr = "-";
-		else
-		{
-			std::ostringstream ssz;
-			ssz << fe.size;
-			sizeStr = ssz.str();
-		}
-		oss << "<tr>";
-		oss << "<td>" << icon << " "
-			 << "<a href=\"" << href << "\">"
-			 << fe.name << "</a></td>";
-		oss << "<td align=\"right\">" << sizeStr << "</td>";
-		oss << "<td>" << fe.mtime << "</td>";
-		oss << "</tr>\n";
+		oss << "<html><body><h1>Cannot open directory: "
+			 << _dirPath << "</h1></body></html>";
+		out += oss.str();
+		return false;
+	}
+
+	if (!_started)
+	{
+		_started = true;
+		oss << "<!DOCTYPE html>\n"
+			 << "<html>\n"
+			 << "<head>\n"
+			 << "  <meta charset=\"UTF-8\"/>\n"
+			 << "  <title>Index of " << _reqPath << "</title>\n"
+			 << "  <style>\n"
+			 << "    body { font-family: sans-serif; }\n"
+			 << "    table { border-collapse: collapse; }\n"
+			 << "    th, td { border: 1px solid #ccc; padding: 4px 8px; }\n"
+			 << "  </style>\n"
+			 << "</head>\n"
+			 << "<body>\n"
+			 << "  <h1>Index of " << _reqPath << "</h1>\n"
+			 << "  <table>\n"
+			 << "    <tr><th>Name</th><th>Size</th><th>Last Modified</th></tr>\n";
+		out += oss.str();
+		return true;
+	}
+
+	size_t end = std::min(_names.size(), _next + AUTOINDEX_BATCH);
+	for (; _next < end; _next++)
+		appendRow(oss, _names[_next]);
+	if (_next < _names.size())
+	{
+		out += oss.str();
+		return true;
 	}
 
 	oss << "  </table>\n"
 		 << "</body>\n</html>\n";
+	out += oss.str();
+	return false;
+}
+
+void AutoIndexSource::appendRow(std::ostringstream &oss, const std::string &name)
+{
+	std::string fullPath = _dirPath;
+	if (!fullPath.empty() &&
+		 fullPath[fullPath.size() - 1] != '/')
+	{
+		fullPath += "/";
+	}
+	fullPath += name;
+
+	OpenFileInfo info;
+	if (_cache)
+		_cache->lookup(fullPath, time(NULL), false, info);
+	else
+		OpenFileCache::load(fullPath, false, info);
+	if (info.error)
+		return; // Can log error here
 
-	return oss.str();
-}
\ No newline at end of file
+	bool isDir = info.isDir;
+	char timebuf[64];
+	struct tm lt;
+	localtime_r(&info.st.st_mtime, &lt);
+	strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M", &lt);
+
+	std::string href = _reqPath;
+	if (!href.empty() && href[href.size() - 1] != '/')
+		href += "/";
+	href += name;
+	if (isDir && !name.empty() &&
+		 name[name.size() - 1] != '/')
+	{
+		href += "/";
+	}
+	std::string icon = isDir ? "[DIR]" : "[FILE]";
+	std::string sizeStr;
+	if (isDir)
+		sizeStr = "-";
+	else
+	{
+		std::ostringstream ssz;
+		ssz << static_cast<long long>(info.st.st_size);
+		sizeStr = ssz.str();
+	}
+	oss << "<tr>";
+	oss << "<td>" << icon << " "
+		 << "<a href=\"" << href << "\">"
+		 << name << "</a></td>";
+	oss << "<td align=\"right\">" << sizeStr << "</td>";
+	oss << "<td>" << timebuf << "</td>";
+	oss << "</tr>\n";
+}
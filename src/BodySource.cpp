@@ -0,0 +1,72 @@
+#include "BodySource.hpp"
+#include <algorithm>
+#include <unistd.h>
+
+BodySource::~BodySource() {}
+
+int BodySource::splicePipe(size_t &)
+{
+	return -1;
+}
+
+void BodySource::spliced(size_t) {}
+
+MemorySource::MemorySource(const std::string &data) : _data(data), _pos(0) {}
+
+off_t MemorySource::length() const
+{
+	return _data.size();
+}
+
+ssize_t MemorySource::read(std::string &out, size_t max)
+{
+	size_t n = std::min(max, _data.size() - _pos);
+	out.append(_data, _pos, n);
+	_pos += n;
+	return n;
+}
+
+FileRangeSource::FileRangeSource(const FileHandle &file, off_t offset, off_t length)
+	: _file(file), _offset(offset), _length(length), _done(0) {}
+
+off_t FileRangeSource::length() const
+{
+	return _length;
+}
+
+ssize_t FileRangeSource::read(std::string &out, size_t max)
+{
+	size_t want = std::min(static_cast<off_t>(max), _length - _done);
+	if (want == 0)
+		return 0;
+	size_t start = out.size();
+	out.resize(start + want);
+	ssize_t n = pread(_file.fd(), &out[start], want, _offset + _done);
+	if (n <= 0)
+	{
+		// The file shrank after its length was announced
+		out.resize(start);
+		return -1;
+	}
+	out.resize(start + n);
+	_done += n;
+	return n;
+}
+
+GeneratorSource::GeneratorSource() : _done(false) {}
+
+off_t GeneratorSource::length() const
+{
+	return -1;
+}
+
+ssize_t GeneratorSource::read(std::string &out, size_t max)
+{
+	size_t start = out.size();
+	while (!_done && out.size() - start < max)
+	{
+		if (!generate(out))
+			_done = true;
+	}
+	return out.size() - start;
+}
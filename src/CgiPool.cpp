@@ -0,0 +1,58 @@
+#include "CgiPool.hpp"
+#include <cstdlib>
+
+CgiPool::CgiPool(const std::string &poolInterpreter, const std::string &poolScript,
+				 size_t poolSize, size_t poolSpare)
+	: interpreter(poolInterpreter), script(poolScript), size(poolSize), spare(poolSpare),
+	  jobs(0)
+{
+}
+
+/**
+ * spawn()
+ * Starts one more worker. It gets no request yet, only PATH in its
+ * environment; each request brings its own. NULL if the fork failed.
+ */
+CgiProcess *CgiPool::spawn()
+{
+	const char *path = std::getenv("PATH");
+	std::string pathVar = std::string("PATH=") + (path ? path : "/usr/local/bin:/usr/bin:/bin");
+	std::vector<char *> envp;
+	envp.push_back(const_cast<char *>(pathVar.c_str()));
+	envp.push_back(NULL);
+	std::vector<char *> args;
+	args.push_back(const_cast<char *>(interpreter.c_str()));
+	args.push_back(const_cast<char *>(script.c_str()));
+	args.push_back(NULL);
+
+	CgiProcess *worker = new CgiProcess();
+	worker->pool = this;
+	if (!worker->start(args, envp, ""))
+	{
+		delete worker;
+		return NULL;
+	}
+	workers.push_back(worker);
+	return worker;
+}
+
+CgiProcess *CgiPool::idleWorker() const
+{
+	for (std::list<CgiProcess *>::const_iterator it = workers.begin(); it != workers.end(); ++it)
+	{
+		if ((*it)->endMarker.empty())
+			return *it;
+	}
+	return NULL;
+}
+
+size_t CgiPool::idleWorkers() const
+{
+	size_t count = 0;
+	for (std::list<CgiProcess *>::const_iterator it = workers.begin(); it != workers.end(); ++it)
+	{
+		if ((*it)->endMarker.empty())
+			count++;
+	}
+	return count;
+}
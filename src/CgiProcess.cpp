@@ -0,0 +1,478 @@
+#include "CgiProcess.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// Bytes read from a script's stdout per read()
+#define CGI_READ_SIZE (16 * 1024)
+// Room in a script's stdout pipe: fewer wakeups, larger splice() calls
+#define CGI_PIPE_SIZE (1024 * 1024)
+
+CgiOutput::CgiOutput() : eof(false), pipe(-1), relay(false), discard(false), truncated(false) {}
+
+static void initPipe(CgiPipe &pipe, PollType type, CgiProcess *cgi)
+{
+	pipe.type = type;
+	pipe.fd = -1;
+	pipe.cgi = cgi;
+	pipe.armed = false;
+}
+
+static void closeFd(CgiPipe &pipe)
+{
+	if (pipe.fd >= 0)
+		close(pipe.fd);
+	pipe.fd = -1;
+}
+
+CgiProcess::CgiProcess()
+	: pid(-1), status(0), exited(false), inputSent(0), output(new CgiOutput()),
+	  paused(false), conn(NULL), headQueued(false), limit(NULL), timeout(0), timedOut(false),
+	  cpuLimit(0), memoryLimit(0), cache(NULL), cacheValid(0), cacheStale(0), cacheMax(0),
+	  cacheGzip(NULL), cacheGzipped(false), refresh(false), lockTimeout(0), lockUntil(0), lockHeld(false), fastcgiKeepalive(0), upstream(NULL), requestId(0),
+	  retried(false), failed(false), poolSize(0), poolSpare(0), pool(NULL), job(NULL),
+	  worker(NULL)
+{
+	initPipe(stdinPipe, POLL_CGI_IN, this);
+	initPipe(stdoutPipe, POLL_CGI_OUT, this);
+	initPipe(exitWatch, POLL_CGI_EXIT, this);
+}
+
+// Normally the child is long reaped; at shutdown it is killed and waited for
+CgiProcess::~CgiProcess()
+{
+	closeFd(stdinPipe);
+	closeFd(stdoutPipe);
+	closeFd(exitWatch);
+	output->pipe = -1;
+	if (pid > 0 && !exited)
+	{
+		::kill(-pid, SIGKILL);
+		while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+			;
+	}
+}
+
+/**
+ * start()
+ * Forks the script with its stdin and stdout (and stderr) on pipes. Our
+ * ends are non-blocking, and close-on-exec so that other children don't
+ * inherit them; the child gets blocking ones, as scripts expect. An empty
+ * body closes stdin right away: the script reads EOF. A pool worker keeps
+ * it for the requests to come. The child gets a process group of its own
+ * (set on both sides, so that it is there before either goes on) and its
+ * cgi_rlimit: past the CPU one it gets SIGXCPU, then SIGKILL a second
+ * later; past the memory one its allocations fail.
+ */
+bool CgiProcess::start(const std::vector<char *> &args, const std::vector<char *> &envp,
+					   const std::string &body)
+{
+	int pipeIn[2];
+	int pipeOut[2];
+	if (pipe2(pipeIn, O_CLOEXEC) == -1)
+		return false;
+	if (pipe2(pipeOut, O_CLOEXEC) == -1)
+	{
+		close(pipeIn[0]);
+		close(pipeIn[1]);
+		return false;
+	}
+
+	pid_t child = fork();
+	if (child < 0)
+	{
+		close(pipeIn[0]);
+		close(pipeIn[1]);
+		close(pipeOut[0]);
+		close(pipeOut[1]);
+		return false;
+	}
+	if (child == 0)
+	{
+		// Only async-signal-safe calls here: the server may run threads.
+		// The duplicates lose close-on-exec, the originals go with execve()
+		setpgid(0, 0);
+		struct rlimit rl;
+		if (cpuLimit)
+		{
+			rl.rlim_cur = cpuLimit;
+			rl.rlim_max = cpuLimit + 1;
+			setrlimit(RLIMIT_CPU, &rl);
+		}
+		if (memoryLimit)
+		{
+			rl.rlim_cur = memoryLimit;
+			rl.rlim_max = memoryLimit;
+			setrlimit(RLIMIT_AS, &rl);
+		}
+		dup2(pipeIn[0], STDIN_FILENO);
+		dup2(pipeOut[1], STDOUT_FILENO);
+		dup2(pipeOut[1], STDERR_FILENO);
+		execve(args[0], &args[0], &envp[0]);
+		_exit(1);
+	}
+
+	setpgid(child, child);
+	close(pipeIn[0]);
+	close(pipeOut[1]);
+	pid = child;
+	stdinPipe.fd = pipeIn[1];
+	stdoutPipe.fd = pipeOut[0];
+	output->pipe = stdoutPipe.fd;
+	fcntl(stdinPipe.fd, F_SETFL, O_NONBLOCK);
+	fcntl(stdoutPipe.fd, F_SETFL, O_NONBLOCK);
+	// Best effort: past the per-user pipe limit it stays at the default
+	fcntl(stdoutPipe.fd, F_SETPIPE_SZ, CGI_PIPE_SIZE);
+	// -1 before Linux 5.3: once its stdout closes, the loop polls for the exit
+	exitWatch.fd = syscall(SYS_pidfd_open, pid, 0);
+
+	input = body;
+	if (input.empty() && !pool)
+		closeFd(stdinPipe);
+	return true;
+}
+
+// cgi_pass: the event loop forks the script (launch) once it may run
+void CgiProcess::startScript(const std::string &cgiPass, const std::string &scriptPath,
+							 const LocationConfig &loc, const std::vector<std::string> &env,
+							 const std::string &body)
+{
+	interpreter = cgiPass;
+	script = scriptPath;
+	limit = loc.cgi_max_concurrent ? &loc : NULL;
+	timeout = loc.cgi_timeout;
+	cpuLimit = loc.cgi_rlimit_cpu;
+	memoryLimit = loc.cgi_rlimit_memory;
+	params = env;
+	input = body;
+}
+
+// Forks the prepared script; false if that failed (it may be tried again)
+bool CgiProcess::launch()
+{
+	std::vector<char *> envp;
+	for (size_t i = 0; i < params.size(); i++)
+		envp.push_back(const_cast<char *>(params[i].c_str()));
+	envp.push_back(NULL);
+	std::vector<char *> args;
+	args.push_back(const_cast<char *>(interpreter.c_str()));
+	args.push_back(const_cast<char *>(script.c_str()));
+	args.push_back(NULL);
+
+	std::string body;
+	body.swap(input);
+	if (!start(args, envp, body))
+	{
+		input.swap(body);
+		return false;
+	}
+	std::vector<std::string>().swap(params);
+	return true;
+}
+
+// fastcgi_pass: the event loop hands the request to a FastCgiConnection
+void CgiProcess::startFastCgi(const std::string &address, size_t keepalive,
+							  const std::vector<std::string> &env, const std::string &body)
+{
+	fastcgiPass = address;
+	fastcgiKeepalive = keepalive;
+	params = env;
+	input = body;
+}
+
+// cgi_pool_size: the event loop queues the request for a worker of the pool
+void CgiProcess::startPooled(const std::string &cgiPass, const std::string &script, size_t size,
+							 size_t spare, const std::vector<std::string> &env,
+							 const std::string &body)
+{
+	interpreter = cgiPass;
+	poolScript = script;
+	poolSize = size;
+	poolSpare = spare;
+	params = env;
+	input = body;
+}
+
+// Ends the output without a valid answer: the client gets a 502
+void CgiProcess::fail()
+{
+	failed = true;
+	exited = true;
+	output->eof = true;
+}
+
+/**
+ * assign()
+ * Worker side: queues the request on the worker's stdin (see CgiPool for
+ * the protocol) and makes it the one whose output comes next. The end
+ * marker is unique per request, a script has no reason to print it.
+ */
+void CgiProcess::assign(CgiProcess &request, unsigned long sequence)
+{
+	std::ostringstream marker;
+	marker << "CGI_POOL_END_" << pid << "_" << sequence;
+	endMarker = "\n" + marker.str() + " ";
+
+	// writeInput() drops what it sent once it is all out
+	if (input.empty())
+		inputSent = 0;
+	for (size_t i = 0; i < request.params.size(); i++)
+	{
+		// One per line: a value spanning lines would break the framing
+		if (request.params[i].find('\n') == std::string::npos)
+			input += request.params[i] + "\n";
+	}
+	input += "CGI_POOL_END=" + marker.str() + "\n\n";
+	input += request.input;
+	std::string().swap(request.input);
+
+	job = &request;
+	request.worker = this;
+}
+
+/**
+ * passOutput()
+ * Worker side: moves what the worker wrote to its request's output (or
+ * drops it, for an aborted request or an idle worker). The last bytes stay
+ * behind only while they may be the start of the end line. True once that
+ * line is in: the request is complete, with the script's exit status, and
+ * the worker idle.
+ */
+bool CgiProcess::passOutput()
+{
+	std::string &data = output->data;
+	if (endMarker.empty())
+	{
+		data.clear();
+		return false;
+	}
+	size_t end = data.find(endMarker);
+	size_t lineEnd = std::string::npos;
+	if (end != std::string::npos)
+		lineEnd = data.find('\n', end + endMarker.size());
+	size_t pass = end;
+	if (end == std::string::npos)
+	{
+		// Streamed as it comes: only a tail that may begin the marker waits
+		pass = data.size();
+		size_t from = data.size() - std::min(data.size(), endMarker.size() - 1);
+		for (size_t lf = data.find('\n', from); lf != std::string::npos;
+			 lf = data.find('\n', lf + 1))
+		{
+			if (endMarker.compare(0, data.size() - lf, data, lf, std::string::npos) == 0)
+			{
+				pass = lf;
+				break;
+			}
+		}
+	}
+	if (job)
+		job->output->data.append(data, 0, pass);
+	if (lineEnd == std::string::npos)
+	{
+		data.erase(0, pass);
+		return false;
+	}
+	if (job)
+		job->status = (std::atoi(data.c_str() + end + endMarker.size()) & 0xff) << 8;
+	data.clear();
+	endMarker.clear();
+	return true;
+}
+
+/**
+ * writeInput()
+ * Feeds the request body to the script until the pipe is full. True while
+ * some of it is left for the next POLLOUT; false once all of it went out,
+ * or the script stopped reading (EPIPE) and will not get the rest.
+ */
+bool CgiProcess::writeInput()
+{
+	while (inputSent < input.size())
+	{
+		ssize_t n = write(stdinPipe.fd, input.data() + inputSent, input.size() - inputSent);
+		if (n > 0)
+			inputSent += n;
+		else if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1 && errno == EAGAIN)
+			return true;
+		else
+			break;
+	}
+	std::string().swap(input);
+	return false;
+}
+
+/**
+ * readOutput()
+ * Appends what the script wrote to the output until the pipe is empty, or
+ * max bytes came: then it is paused, the rest stays in the pipe and the
+ * script blocks on it once that is full. True while more may come; false
+ * at EOF (or a read error, which ends the output just the same).
+ */
+bool CgiProcess::readOutput(size_t max)
+{
+	std::string &data = output->data;
+	size_t total = 0;
+	paused = false;
+	while (true)
+	{
+		if (output->discard)
+			data.clear();
+		if (total >= max)
+		{
+			paused = true;
+			return true;
+		}
+		size_t size = std::min(max - total, static_cast<size_t>(CGI_READ_SIZE));
+		size_t start = data.size();
+		data.resize(start + size);
+		ssize_t n = read(stdoutPipe.fd, &data[start], size);
+		data.resize(start + (n > 0 ? n : 0));
+		total += (n > 0 ? n : 0);
+		if (n > 0 || (n == -1 && errno == EINTR))
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			return true;
+		break;
+	}
+	output->eof = true;
+	// Without a pidfd: the script closed its output, it is likely gone
+	// already; if not, the loop tries again (WebServ::reapCgis)
+	if (exitWatch.fd < 0)
+		reap();
+	return false;
+}
+
+// True once the child exited and was reaped (status holds how)
+bool CgiProcess::reap()
+{
+	if (exited)
+		return true;
+	pid_t ret;
+	do
+		ret = waitpid(pid, &status, WNOHANG);
+	while (ret == -1 && errno == EINTR);
+	// -1: not (or no longer) our child, there is nothing to wait for
+	exited = (ret == pid || ret == -1);
+	return exited;
+}
+
+void CgiProcess::kill()
+{
+	signal(SIGKILL);
+}
+
+/**
+ * signal()
+ * Signals the script's process group. Once the script is reaped, only
+ * while its stdout is open: what it started may still hold that, and the
+ * group id can't go to another process before they are all gone.
+ */
+void CgiProcess::signal(int sig)
+{
+	if (pid > 0 && (!exited || stdoutPipe.fd >= 0))
+		::kill(-pid, sig);
+}
+
+bool CgiProcess::done() const
+{
+	return output->eof && exited;
+}
+
+bool CgiProcess::idle() const
+{
+	return !stdinPipe.armed && !stdoutPipe.armed && !exitWatch.armed;
+}
+
+// Where the body starts, past the blank line ending the script's headers
+size_t CgiProcess::bodyOffset() const
+{
+	const std::string &data = output->data;
+	size_t lf = data.find("\n\n");
+	size_t crlf = data.find("\n\r\n");
+	if (crlf != std::string::npos && (lf == std::string::npos || crlf < lf))
+		return crlf + 3;
+	return lf == std::string::npos ? lf : lf + 2;
+}
+
+CgiSource::CgiSource(const SharedPtr<CgiOutput> &output, off_t length)
+	: _output(output), _length(length), _sent(0)
+{
+}
+
+off_t CgiSource::length() const
+{
+	return _length;
+}
+
+ssize_t CgiSource::read(std::string &out, size_t max)
+{
+	std::string &data = _output->data;
+	// Past the script's Content-Length: whatever follows is dropped
+	if (_length >= 0 && _sent >= _length)
+	{
+		_output->relay = false;
+		_output->discard = true;
+		data.clear();
+		return 0;
+	}
+	if (data.empty())
+	{
+		if (!_output->eof)
+			errno = EAGAIN;
+		else if (_length >= 0 || _output->truncated)
+			errno = EIO;
+		else
+			return 0;
+		return -1;
+	}
+	if (_length >= 0)
+		max = std::min(max, static_cast<size_t>(_length - _sent));
+	size_t n = std::min(max, data.size());
+	if (n == data.size() && out.empty())
+		out.swap(data);
+	else
+	{
+		out.append(data, 0, n);
+		data.erase(0, n);
+	}
+	_sent += n;
+	return n;
+}
+
+/**
+ * splicePipe()
+ * The script's stdout, once what was read of it is out; from the first
+ * call on the loop stops reading it (relay), the rest goes straight to
+ * the socket.
+ */
+int CgiSource::splicePipe(size_t &max)
+{
+	if (_output->pipe < 0 || (_length >= 0 && _sent >= _length))
+		return -1;
+	_output->relay = true;
+	if (!_output->data.empty())
+		return -1;
+	if (_length >= 0)
+		max = std::min(max, static_cast<size_t>(_length - _sent));
+	return _output->pipe;
+}
+
+// At the end of the pipe read() takes over: it sees the end once the loop does
+void CgiSource::spliced(size_t count)
+{
+	_sent += count;
+	if (count == 0)
+	{
+		_output->relay = false;
+		_output->pipe = -1;
+	}
+}
@@ -0,0 +1,162 @@
+#include "Connection.hpp"
+#include <sstream>
+#include <cerrno>
+
+OutputSegment::OutputSegment() : fileOffset(0), fileLength(0), chunked(false), endOfResponse(false) {}
+
+size_t OutputSegment::size() const
+{
+    return file.isOpen() ? static_cast<size_t>(fileLength) : bytes().size();
+}
+
+const std::string &OutputSegment::bytes() const
+{
+    return shared.get() ? *shared : data;
+}
+
+// Gets a (possibly recycled) connection ready for a freshly accepted client
+void Connection::reset(int clientFd, const Listener &listener)
+{
+    type = POLL_CLIENT;
+    fd = clientFd;
+    parser = HttpParser();
+    servers = &listener.servers;
+    server = &listener.servers[0];
+    requests.clear();
+    output.clear();
+    outputSent = 0;
+    queuedResponses = 0;
+    keepAlive = true;
+    requestCount = 0;
+    timerPhase = TIMER_NONE;
+    cgi = NULL;
+    cgis.clear();
+    sourceWait = false;
+    recvArmed = false;
+    sendArmed = false;
+    readPaused = false;
+}
+
+bool Connection::idle() const
+{
+    return !recvArmed && !sendArmed;
+}
+
+void Connection::queueOutput(const std::string &data, bool endOfResponse)
+{
+    output.push_back(OutputSegment());
+    output.back().data = data;
+    output.back().endOfResponse = endOfResponse;
+    if (endOfResponse)
+        queuedResponses++;
+}
+
+void Connection::queueShared(const SharedBuffer &data, bool endOfResponse)
+{
+    output.push_back(OutputSegment());
+    output.back().shared = data;
+    output.back().endOfResponse = endOfResponse;
+    if (endOfResponse)
+        queuedResponses++;
+}
+
+void Connection::queueFile(const FileHandle &file, off_t offset, off_t length, bool endOfResponse)
+{
+    output.push_back(OutputSegment());
+    OutputSegment &segment = output.back();
+    segment.file = file;
+    segment.fileOffset = offset;
+    segment.fileLength = length;
+    segment.endOfResponse = endOfResponse;
+    if (endOfResponse)
+        queuedResponses++;
+}
+
+// The body source ends its response: nothing follows it in the same response
+void Connection::queueSource(const BodyStream &source, bool chunked)
+{
+    output.push_back(OutputSegment());
+    output.back().source = source;
+    output.back().chunked = chunked;
+    output.back().endOfResponse = true;
+    queuedResponses++;
+}
+
+/**
+ * pullSource()
+ * The front segment is a body source: reads its next chunk into a data
+ * segment in front of it, or, at its end, turns it into the last chunk (or
+ * drops it). Only the front source is ever pulled, so a connection holds at
+ * most one chunk of it at a time. A source with nothing ready yet fails
+ * with EAGAIN: PULL_WAIT, whoever feeds it wakes the connection up.
+ */
+PullResult Connection::pullSource()
+{
+    OutputSegment &segment = output.front();
+    std::string chunk;
+    ssize_t n = segment.source->read(chunk, OUTPUT_CHUNK_SIZE);
+    sourceWait = (n < 0 && errno == EAGAIN);
+    if (sourceWait)
+        return PULL_WAIT;
+    if (n < 0)
+        return PULL_ERROR;
+    if (n == 0)
+    {
+        segment.source.reset();
+        if (segment.chunked)
+            segment.data = "0\r\n\r\n";
+        else
+            consumeOutput(0);
+        return PULL_OK;
+    }
+
+    OutputSegment piece;
+    if (segment.chunked)
+    {
+        std::ostringstream frame;
+        frame << std::hex << chunk.size() << "\r\n";
+        piece.data = frame.str();
+        piece.data += chunk;
+        piece.data += "\r\n";
+    }
+    else
+        piece.data.swap(chunk);
+    output.push_front(piece);
+    return PULL_OK;
+}
+
+/**
+ * gatherOutput()
+ * Points iov at the in-memory segments at the front of the output, up to
+ * the first file or source segment: pipelined responses leave in one writev() without
+ * ever being concatenated. Returns the number of iovecs filled.
+ */
+size_t Connection::gatherOutput(struct iovec *iov, size_t max) const
+{
+    size_t count = 0;
+    size_t skip = outputSent;
+    for (std::deque<OutputSegment>::const_iterator it = output.begin();
+         it != output.end() && count < max && !it->file.isOpen() && !it->source.get(); ++it)
+    {
+        const std::string &bytes = it->bytes();
+        iov[count].iov_base = const_cast<char *>(bytes.data()) + skip;
+        iov[count].iov_len = bytes.size() - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+// Records that bytes more went out: O(1) per finished segment, no memmove.
+// Stops at a source, which has no size until it is pulled.
+void Connection::consumeOutput(size_t bytes)
+{
+    outputSent += bytes;
+    while (!output.empty() && !output.front().source.get() && outputSent >= output.front().size())
+    {
+        outputSent -= output.front().size();
+        if (output.front().endOfResponse)
+            queuedResponses--;
+        output.pop_front();
+    }
+}
@@ -0,0 +1,369 @@
+#include "FastCgi.hpp"
+#include "CgiProcess.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+// Bytes received from a FastCGI server per recv()
+#define FASTCGI_READ_SIZE (16 * 1024)
+
+// Name-value pair lengths: one byte below 128, else four with the top bit set
+static void appendLength(std::string &out, size_t length)
+{
+	if (length < 128)
+	{
+		out += static_cast<char>(length);
+		return;
+	}
+	out += static_cast<char>(((length >> 24) & 0x7f) | 0x80);
+	out += static_cast<char>((length >> 16) & 0xff);
+	out += static_cast<char>((length >> 8) & 0xff);
+	out += static_cast<char>(length & 0xff);
+}
+
+static void appendPair(std::string &out, const std::string &name, const std::string &value)
+{
+	appendLength(out, name.size());
+	appendLength(out, value.size());
+	out += name;
+	out += value;
+}
+
+static bool readLength(const std::string &in, size_t &pos, size_t &length)
+{
+	if (pos >= in.size())
+		return false;
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(in.data()) + pos;
+	if (!(p[0] & 0x80))
+	{
+		length = p[0];
+		pos++;
+		return true;
+	}
+	if (in.size() - pos < 4)
+		return false;
+	length = (static_cast<size_t>(p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	pos += 4;
+	return true;
+}
+
+FastCgiConnection::FastCgiConnection(FastCgiUpstream &owner)
+	: upstream(&owner), connected(false), reused(false), outSent(0), lastId(0),
+	  capacity(1), paused(false), readArmed(false), writeArmed(false)
+{
+	type = POLL_FASTCGI;
+	fd = -1;
+}
+
+FastCgiConnection::~FastCgiConnection()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+/**
+ * open()
+ * Starts a non-blocking connect() and queues an FCGI_GET_VALUES asking
+ * whether the server multiplexes: requests may follow right away, until
+ * the answer they go one at a time.
+ */
+bool FastCgiConnection::open()
+{
+	fd = socket(upstream->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return false;
+	if (connect(fd, reinterpret_cast<struct sockaddr *>(&upstream->addr), upstream->addrLen) == 0)
+		connected = true;
+	else if (errno != EINPROGRESS)
+		return false;
+
+	std::string names;
+	appendPair(names, "FCGI_MPXS_CONNS", "");
+	appendPair(names, "FCGI_MAX_REQS", "");
+	record(FCGI_GET_VALUES, 0, names);
+	return true;
+}
+
+// True once connected; false if the connect() failed
+bool FastCgiConnection::checkConnect()
+{
+	if (connected)
+		return true;
+	int error = 0;
+	socklen_t length = sizeof(error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+	{
+		errno = error;
+		return false;
+	}
+	connected = true;
+	return true;
+}
+
+bool FastCgiConnection::full() const
+{
+	return requests.size() >= capacity;
+}
+
+/**
+ * submit()
+ * Queues a whole request: FCGI_BEGIN_REQUEST, the CGI environment as
+ * FCGI_PARAMS and the body as FCGI_STDIN, each stream ended by an empty
+ * record. flush() sends it.
+ */
+void FastCgiConnection::submit(CgiProcess &cgi)
+{
+	unsigned short id;
+	do
+		id = ++lastId;
+	while (id == 0 || requests.count(id));
+	requests[id] = &cgi;
+	cgi.upstream = this;
+	cgi.requestId = id;
+
+	std::string begin(8, '\0');
+	begin[1] = FCGI_RESPONDER;
+	begin[2] = upstream->keepalive ? FCGI_KEEP_CONN : 0;
+	record(FCGI_BEGIN_REQUEST, id, begin);
+
+	std::string params;
+	for (size_t i = 0; i < cgi.params.size(); i++)
+	{
+		size_t eq = cgi.params[i].find('=');
+		appendPair(params, cgi.params[i].substr(0, eq), cgi.params[i].substr(eq + 1));
+	}
+	stream(FCGI_PARAMS, id, params);
+	stream(FCGI_STDIN, id, cgi.input);
+}
+
+// The client is gone: whatever the server still sends for it is dropped
+void FastCgiConnection::abort(CgiProcess &cgi)
+{
+	requests[cgi.requestId] = NULL;
+	record(FCGI_ABORT_REQUEST, cgi.requestId, "");
+	cgi.upstream = NULL;
+}
+
+// Writes the queued records until the socket is full; false on error
+bool FastCgiConnection::flush()
+{
+	if (!connected)
+		return true;
+	while (outSent < out.size())
+	{
+		ssize_t n = send(fd, out.data() + outSent, out.size() - outSent, MSG_NOSIGNAL);
+		if (n > 0)
+			outSent += n;
+		else if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1 && errno == EAGAIN)
+			return true;
+		else
+			return false;
+	}
+	out.clear();
+	outSent = 0;
+	return true;
+}
+
+/**
+ * receive()
+ * Reads until the socket is empty, or max bytes came: then it is paused and
+ * the rest waits in the socket, so no request's output grows past what its
+ * client can take. Handles every complete record: FCGI_STDOUT goes to its
+ * request's output, FCGI_STDERR to our log, FCGI_END_REQUEST finishes the
+ * request. The requests that got something are added to progressed. False
+ * once the server closed the connection (or broke the protocol).
+ */
+bool FastCgiConnection::receive(std::vector<CgiProcess *> &progressed, size_t max)
+{
+	bool open = true;
+	size_t total = 0;
+	paused = false;
+	while (true)
+	{
+		if (total >= max)
+		{
+			paused = true;
+			break;
+		}
+		size_t size = std::min(max - total, static_cast<size_t>(FASTCGI_READ_SIZE));
+		size_t start = in.size();
+		in.resize(start + size);
+		ssize_t n = recv(fd, &in[start], size, 0);
+		in.resize(start + (n > 0 ? n : 0));
+		total += (n > 0 ? n : 0);
+		if (n > 0 || (n == -1 && errno == EINTR))
+			continue;
+		if (n == 0 || errno != EAGAIN)
+			open = false;
+		break;
+	}
+
+	size_t pos = 0;
+	while (in.size() - pos >= FCGI_HEADER_LEN)
+	{
+		const unsigned char *header = reinterpret_cast<const unsigned char *>(in.data()) + pos;
+		if (header[0] != FCGI_VERSION_1)
+			return false;
+		unsigned short id = (header[2] << 8) | header[3];
+		size_t length = (header[4] << 8) | header[5];
+		size_t total = FCGI_HEADER_LEN + length + header[6];
+		if (in.size() - pos < total)
+			break;
+		int recordType = header[1];
+		size_t content = pos + FCGI_HEADER_LEN;
+		pos += total;
+
+		if (recordType == FCGI_STDOUT)
+		{
+			std::map<unsigned short, CgiProcess *>::iterator it = requests.find(id);
+			if (it == requests.end() || !it->second || length == 0)
+				continue;
+			it->second->output->data.append(in, content, length);
+			if (progressed.empty() || progressed.back() != it->second)
+				progressed.push_back(it->second);
+		}
+		else if (recordType == FCGI_STDERR && length > 0)
+		{
+			std::string message = in.substr(content, length);
+			while (!message.empty() && (message[message.size() - 1] == '\n'
+										|| message[message.size() - 1] == '\r'))
+				message.erase(message.size() - 1);
+			std::cerr << "FastCGI " << upstream->address << ": " << message << std::endl;
+		}
+		else if (recordType == FCGI_END_REQUEST)
+			endRequest(id, in.substr(content, length), progressed);
+		else if (recordType == FCGI_GET_VALUES_RESULT)
+			getValuesResult(in.substr(content, length));
+	}
+	in.erase(0, pos);
+	return open;
+}
+
+/**
+ * endRequest()
+ * The request is over and its id free. The application status is ignored,
+ * as the output says how it went; a protocol status other than
+ * FCGI_REQUEST_COMPLETE (overloaded, can't multiplex...) fails it.
+ */
+void FastCgiConnection::endRequest(unsigned short id, const std::string &content,
+								   std::vector<CgiProcess *> &progressed)
+{
+	std::map<unsigned short, CgiProcess *>::iterator it = requests.find(id);
+	if (it == requests.end())
+		return;
+	CgiProcess *cgi = it->second;
+	requests.erase(it);
+	reused = true;
+	if (!cgi)
+		return;
+
+	cgi->upstream = NULL;
+	cgi->output->eof = true;
+	cgi->exited = true;
+	if (content.size() < 5 || content[4] != FCGI_REQUEST_COMPLETE)
+		cgi->failed = true;
+	if (progressed.empty() || progressed.back() != cgi)
+		progressed.push_back(cgi);
+}
+
+// FCGI_MPXS_CONNS=1: up to FCGI_MAX_REQS requests may share the connection
+void FastCgiConnection::getValuesResult(const std::string &content)
+{
+	std::map<std::string, std::string> values;
+	size_t pos = 0;
+	size_t nameLength;
+	size_t valueLength;
+	while (readLength(content, pos, nameLength) && readLength(content, pos, valueLength)
+		   && content.size() - pos >= nameLength + valueLength)
+	{
+		values[content.substr(pos, nameLength)] = content.substr(pos + nameLength, valueLength);
+		pos += nameLength + valueLength;
+	}
+	if (values["FCGI_MPXS_CONNS"] != "1")
+		return;
+	size_t maxReqs = static_cast<size_t>(std::atol(values["FCGI_MAX_REQS"].c_str()));
+	capacity = (maxReqs == 0 || maxReqs > FASTCGI_MAX_MPX) ? FASTCGI_MAX_MPX : maxReqs;
+}
+
+bool FastCgiConnection::idle() const
+{
+	return !readArmed && !writeArmed;
+}
+
+void FastCgiConnection::record(int type, unsigned short id, const std::string &content)
+{
+	char header[FCGI_HEADER_LEN] = {
+		FCGI_VERSION_1, static_cast<char>(type),
+		static_cast<char>(id >> 8), static_cast<char>(id & 0xff),
+		static_cast<char>(content.size() >> 8), static_cast<char>(content.size() & 0xff),
+		0, 0
+	};
+	out.append(header, FCGI_HEADER_LEN);
+	out += content;
+}
+
+// A stream's data in records of at most FCGI_MAX_CONTENT bytes, then its end
+void FastCgiConnection::stream(int type, unsigned short id, const std::string &data)
+{
+	for (size_t pos = 0; pos < data.size(); pos += FCGI_MAX_CONTENT)
+		record(type, id, data.substr(pos, FCGI_MAX_CONTENT));
+	record(type, id, "");
+}
+
+FastCgiUpstream::FastCgiUpstream(const std::string &passAddress, size_t keepaliveCount)
+	: address(passAddress), addrLen(0), keepalive(keepaliveCount)
+{
+	std::memset(&addr, 0, sizeof(addr));
+}
+
+/**
+ * resolve()
+ * unix:/path, or an IPv4 host:port ("localhost" meaning 127.0.0.1). Names
+ * are not looked up: that would block the event loop.
+ */
+bool FastCgiUpstream::resolve()
+{
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		struct sockaddr_un *un = reinterpret_cast<struct sockaddr_un *>(&addr);
+		std::string path = address.substr(5);
+		if (path.size() >= sizeof(un->sun_path))
+			return false;
+		un->sun_family = AF_UNIX;
+		std::memcpy(un->sun_path, path.c_str(), path.size() + 1);
+		addrLen = sizeof(struct sockaddr_un);
+		return true;
+	}
+
+	size_t colon = address.rfind(':');
+	std::string host = address.substr(0, colon);
+	if (host == "localhost")
+		host = "127.0.0.1";
+	struct sockaddr_in *in4 = reinterpret_cast<struct sockaddr_in *>(&addr);
+	in4->sin_family = AF_INET;
+	in4->sin_port = htons(std::atoi(address.c_str() + colon + 1));
+	if (inet_pton(AF_INET, host.c_str(), &in4->sin_addr) != 1)
+		return false;
+	addrLen = sizeof(struct sockaddr_in);
+	return true;
+}
+
+size_t FastCgiUpstream::idleConnections() const
+{
+	size_t count = 0;
+	for (std::list<FastCgiConnection *>::const_iterator it = connections.begin();
+		 it != connections.end(); ++it)
+	{
+		if ((*it)->requests.empty())
+			count++;
+	}
+	return count;
+}
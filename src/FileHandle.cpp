@@ -0,0 +1,57 @@
+#include "FileHandle.hpp"
+#include <unistd.h>
+#include <cstddef>
+
+FileHandle::FileHandle() : _fd(-1), _refs(NULL) {}
+
+FileHandle::FileHandle(int fd) : _fd(fd), _refs(NULL)
+{
+	if (_fd >= 0)
+		_refs = new int(1);
+}
+
+FileHandle::FileHandle(const FileHandle &other) : _fd(other._fd), _refs(other._refs)
+{
+	if (_refs)
+		__sync_add_and_fetch(_refs, 1);
+}
+
+FileHandle &FileHandle::operator=(const FileHandle &other)
+{
+	if (this != &other)
+	{
+		if (other._refs)
+			__sync_add_and_fetch(other._refs, 1);
+		reset();
+		_fd = other._fd;
+		_refs = other._refs;
+	}
+	return *this;
+}
+
+FileHandle::~FileHandle()
+{
+	reset();
+}
+
+int FileHandle::fd() const
+{
+	return _fd;
+}
+
+bool FileHandle::isOpen() const
+{
+	return _fd >= 0;
+}
+
+// Drops this reference, closing the fd if it was the last one
+void FileHandle::reset()
+{
+	if (_refs && __sync_sub_and_fetch(_refs, 1) == 0)
+	{
+		close(_fd);
+		delete _refs;
+	}
+	_fd = -1;
+	_refs = NULL;
+}
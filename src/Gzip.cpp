@@ -0,0 +1,88 @@
+#include "Gzip.hpp"
+#include <cstring>
+#include <cerrno>
+
+// windowBits 15 + 16: a gzip header and trailer instead of zlib's
+#define GZIP_WINDOW_BITS (15 + 16)
+#define GZIP_MEM_LEVEL 8
+
+bool gzipString(const std::string &in, std::string &out, int level)
+{
+	z_stream zs;
+	std::memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL,
+					 Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	out.resize(deflateBound(&zs, in.size()));
+	zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+	zs.avail_in = in.size();
+	zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+	zs.avail_out = out.size();
+	int ret = deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+	return ret == Z_STREAM_END;
+}
+
+GzipSource::GzipSource(const BodyStream &input, int level)
+	: _input(input), _finished(false), _buffered(false)
+{
+	std::memset(&_zs, 0, sizeof(_zs));
+	_ready = deflateInit2(&_zs, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL,
+						  Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+GzipSource::~GzipSource()
+{
+	if (_ready)
+		deflateEnd(&_zs);
+}
+
+off_t GzipSource::length() const
+{
+	return -1;
+}
+
+/**
+ * read()
+ * Pulls the input max bytes at a time until deflate() gives some output
+ * (it buffers small inputs), flushing with Z_FINISH at the input's end.
+ * When the input has nothing yet (EAGAIN), what deflate() holds is
+ * flushed out first, so a slow producer's output is not held back.
+ */
+ssize_t GzipSource::read(std::string &out, size_t max)
+{
+	if (!_ready)
+		return -1;
+	size_t start = out.size();
+	while (!_finished && out.size() == start)
+	{
+		std::string plain;
+		ssize_t n = _input->read(plain, max);
+		int flush = (n == 0) ? Z_FINISH : Z_NO_FLUSH;
+		if (n < 0 && errno == EAGAIN && _buffered)
+			flush = Z_SYNC_FLUSH;
+		else if (n < 0)
+			return -1;
+		_buffered = (flush == Z_NO_FLUSH);
+
+		_zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(plain.data()));
+		_zs.avail_in = plain.size();
+		do
+		{
+			size_t used = out.size();
+			size_t room = max > 4096 ? max : 4096;
+			out.resize(used + room);
+			_zs.next_out = reinterpret_cast<Bytef *>(&out[used]);
+			_zs.avail_out = room;
+			int ret = deflate(&_zs, flush);
+			out.resize(used + room - _zs.avail_out);
+			if (ret == Z_STREAM_END)
+				_finished = true;
+			else if (ret != Z_OK && ret != Z_BUF_ERROR)
+				return -1;
+		} while (_zs.avail_out == 0 || (flush == Z_FINISH && !_finished));
+	}
+	return out.size() - start;
+}
@@ -1,9 +1,11 @@
 #include "HttpResponse.hpp"
 #include <sstream>
-#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 HttpResponse::HttpResponse()
-	 : _statusCode(200), _reasonPhrase("OK")
+	 : _statusCode(200), _reasonPhrase("OK"), _fileOffset(0), _fileLength(0), _cgi(NULL)
 {
 	// Default 200 OK
 }
@@ -21,36 +23,218 @@ void HttpResponse::setHeader(const std::string &key, const std::string &value)
 	_headers[key] = value;
 }
 
+// "" when the header isn't set
+std::string HttpResponse::getHeader(const std::string &key) const
+{
+	std::map<std::string, std::string>::const_iterator it = _headers.find(key);
+	return it == _headers.end() ? std::string() : it->second;
+}
+
+void HttpResponse::removeHeader(const std::string &key)
+{
+	_headers.erase(key);
+}
+
+int HttpResponse::getStatus() const
+{
+	return _statusCode;
+}
+
+/**
+ * setBodyFromFile()
+ * Opens the file and keeps its fd as the body: nothing is read here, the
+ * write path sends it with sendfile() once the headers are out.
+ */
 bool HttpResponse::setBodyFromFile(const std::string &filePath)
 {
-	std::ifstream ifs(filePath.c_str(), std::ios::binary);
-	if (!ifs.is_open())
+	int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
 	{
 		// Error opening file
 		return false;
 	}
-	// Read file into string
-	std::ostringstream oss;
-	oss << ifs.rdbuf();
-	_body = oss.str();
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return false;
+	}
+	setBodyFromFile(FileHandle(fd), 0, st.st_size);
+	return true;
+}
+
+/**
+ * setBodyFromFile()
+ * Same with a file already open (e.g. from the open file cache): the body
+ * is its [offset, offset + length) slice.
+ */
+void HttpResponse::setBodyFromFile(const FileHandle &file, off_t offset, off_t length)
+{
+	_file = file;
+	_fileOffset = offset;
+	_fileLength = length;
+	_body.clear();
+	_parts.clear();
+	_source.reset();
 
 	// Auto set Content-Length
 	std::ostringstream cl;
-	cl << _body.size();
+	cl << _fileLength;
 	_headers["Content-Length"] = cl.str();
+}
 
-	return true;
+/**
+ * setBodyParts()
+ * A body made of in-memory pieces and slices of one file, in order
+ * (multipart/byteranges). The file slices are sent with sendfile() too.
+ */
+void HttpResponse::setBodyParts(const FileHandle &file, const std::vector<BodyPart> &parts)
+{
+	_file = file;
+	_fileOffset = 0;
+	_fileLength = 0;
+	_body.clear();
+	_parts = parts;
+	_source.reset();
+
+	off_t total = 0;
+	for (size_t i = 0; i < _parts.size(); i++)
+		total += _parts[i].fileLength > 0 ? _parts[i].fileLength : (off_t)_parts[i].data.size();
+	std::ostringstream cl;
+	cl << total;
+	_headers["Content-Length"] = cl.str();
+}
+
+/**
+ * setBodySource()
+ * A body pulled while it is sent. With a known length it gets a
+ * Content-Length, otherwise it goes out chunked.
+ */
+void HttpResponse::setBodySource(const BodyStream &source)
+{
+	_source = source;
+	_body.clear();
+	_file.reset();
+	_fileLength = 0;
+	_parts.clear();
+
+	off_t length = source->length();
+	if (length >= 0)
+	{
+		std::ostringstream cl;
+		cl << length;
+		_headers["Content-Length"] = cl.str();
+		_headers.erase("Transfer-Encoding");
+	}
+	else
+	{
+		_headers.erase("Content-Length");
+		_headers["Transfer-Encoding"] = "chunked";
+	}
+}
+
+// For clients without chunked encoding: the body ends with the connection
+void HttpResponse::setCloseDelimited()
+{
+	_headers.erase("Transfer-Encoding");
 }
 
 void HttpResponse::setBody(const std::string &body)
 {
 	_body = body;
+	_file.reset();
+	_fileLength = 0;
+	_parts.clear();
+	_source.reset();
 	// Auto set Content-Length
 	std::ostringstream oss;
 	oss << _body.size();
 	_headers["Content-Length"] = oss.str();
 }
 
+const std::string &HttpResponse::getBody() const
+{
+	return _body;
+}
+
+/**
+ * setShared()
+ * Makes the response a pre-serialized one (a cache hit): head and body are
+ * sent as they are, whatever was set before is dropped.
+ */
+void HttpResponse::setShared(const SharedBuffer &head, const SharedBuffer &body)
+{
+	_sharedHead = head;
+	_sharedBody = body;
+	_headers.clear();
+	_body.clear();
+	_file.reset();
+	_fileLength = 0;
+	_parts.clear();
+	_source.reset();
+}
+
+bool HttpResponse::isShared() const
+{
+	return _sharedHead.get() != NULL;
+}
+
+const SharedBuffer &HttpResponse::getSharedHead() const
+{
+	return _sharedHead;
+}
+
+const SharedBuffer &HttpResponse::getSharedBody() const
+{
+	return _sharedBody;
+}
+
+bool HttpResponse::hasFileBody() const
+{
+	return _file.isOpen();
+}
+
+const FileHandle &HttpResponse::getFile() const
+{
+	return _file;
+}
+
+off_t HttpResponse::getFileOffset() const
+{
+	return _fileOffset;
+}
+
+off_t HttpResponse::getFileLength() const
+{
+	return _fileLength;
+}
+
+const std::vector<BodyPart> &HttpResponse::getBodyParts() const
+{
+	return _parts;
+}
+
+const BodyStream &HttpResponse::getBodySource() const
+{
+	return _source;
+}
+
+bool HttpResponse::isChunked() const
+{
+	std::map<std::string, std::string>::const_iterator it = _headers.find("Transfer-Encoding");
+	return it != _headers.end() && it->second == "chunked";
+}
+
+void HttpResponse::setCgi(CgiProcess *cgi)
+{
+	_cgi = cgi;
+}
+
+CgiProcess *HttpResponse::getCgi() const
+{
+	return _cgi;
+}
+
 std::string HttpResponse::statusLine() const
 {
 	// "HTTP/1.1 200 OK"
@@ -59,15 +243,38 @@ std::string HttpResponse::statusLine() const
 	return oss.str();
 }
 
-std::string HttpResponse::toString() const
+// Status line and headers, up to the blank line: what goes out before the body
+std::string HttpResponse::headString() const
+{
+	return headerBlock() + "\r\n";
+}
+
+/**
+ * headerBlock()
+ * Status line and header lines, without the blank line ending them, so more
+ * headers can follow. For a shared response only the headers added on top
+ * of the shared head.
+ */
+std::string HttpResponse::headerBlock() const
 {
-	// 1) Status line
 	std::ostringstream oss;
+	if (_sharedHead.get())
+	{
+		for (std::map<std::string, std::string>::const_iterator it = _headers.begin();
+			  it != _headers.end(); ++it)
+			oss << it->first << ": " << it->second << "\r\n";
+		return oss.str();
+	}
+
+	// 1) Status line
 	oss << statusLine();
 
 	// 2) Headers
-	// If content-length not set, calculate it from body
-	if (_headers.find("Content-Length") == _headers.end())
+	// If content-length not set, calculate it from body (1xx, 204 and 304
+	// never have one, nor a streamed body without a known length)
+	bool noBody = _statusCode < 200 || _statusCode == 204 || _statusCode == 304
+				  || _source.get();
+	if (!noBody && _headers.find("Content-Length") == _headers.end())
 	{
 		std::ostringstream tmp;
 		tmp << _body.size();
@@ -79,11 +286,12 @@ std::string HttpResponse::toString() const
 		oss << it->first << ": " << it->second << "\r\n";
 	}
 
-	// 3) End of headers
-	oss << "\r\n";
-
-	// 4) Body
-	oss << _body;
-
 	return oss.str();
-}
\ No newline at end of file
+}
+
+std::string HttpResponse::toString() const
+{
+	if (_sharedHead.get())
+		return *_sharedHead + headString() + *_sharedBody;
+	return headString() + _body;
+}
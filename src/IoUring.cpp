@@ -0,0 +1,161 @@
+#include "IoUring.hpp"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+IoUring::IoUring()
+	: _fd(-1), _sqRing(MAP_FAILED), _cqRing(MAP_FAILED), _sqRingSize(0), _cqRingSize(0),
+	  _sqes(NULL), _sqesSize(0), _sqHead(NULL), _sqTail(NULL), _sqMask(NULL), _sqArray(NULL),
+	  _cqHead(NULL), _cqTail(NULL), _cqMask(NULL), _cqes(NULL), _pending(0), _enterCalls(0)
+{
+}
+
+IoUring::~IoUring()
+{
+	if (_sqes)
+		munmap(_sqes, _sqesSize);
+	if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+		munmap(_cqRing, _cqRingSize);
+	if (_sqRing != MAP_FAILED)
+		munmap(_sqRing, _sqRingSize);
+	if (_fd >= 0)
+		close(_fd);
+}
+
+void IoUring::init(unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (_fd < 0)
+		throw std::runtime_error(std::string("io_uring_setup failed: ") + strerror(errno));
+	if (!(params.features & IORING_FEAT_EXT_ARG))
+		throw std::runtime_error("io_uring: kernel lacks IORING_FEAT_EXT_ARG (needs 5.11+)");
+
+	_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	// Since 5.4 both rings share one mapping
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (_cqRingSize > _sqRingSize)
+			_sqRingSize = _cqRingSize;
+		_cqRingSize = _sqRingSize;
+	}
+
+	_sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				   _fd, IORING_OFF_SQ_RING);
+	if (_sqRing == MAP_FAILED)
+		throw std::runtime_error("io_uring: cannot map the submission ring");
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		_cqRing = _sqRing;
+	else
+	{
+		_cqRing = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					   _fd, IORING_OFF_CQ_RING);
+		if (_cqRing == MAP_FAILED)
+			throw std::runtime_error("io_uring: cannot map the completion ring");
+	}
+	_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					  _fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		throw std::runtime_error("io_uring: cannot map the submission entries");
+	_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+	char *sq = static_cast<char *>(_sqRing);
+	char *cq = static_cast<char *>(_cqRing);
+	_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	_sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	_cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+int IoUring::enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize)
+{
+	_enterCalls++;
+	return syscall(__NR_io_uring_enter, _fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+unsigned IoUring::freeSqes() const
+{
+	unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+	return *_sqMask + 1 - (*_sqTail - head);
+}
+
+void IoUring::flush()
+{
+	// Ring full: let the kernel consume what we have so far
+	enter(_pending, 0, 0, NULL, 0);
+	_pending = 0;
+}
+
+void IoUring::reserve(unsigned count)
+{
+	if (freeSqes() < count)
+		flush();
+}
+
+struct io_uring_sqe *IoUring::getSqe()
+{
+	if (freeSqes() == 0)
+	{
+		flush();
+		if (freeSqes() == 0)
+			throw std::runtime_error(std::string("io_uring: cannot submit: ") + strerror(errno));
+	}
+	unsigned tail = *_sqTail;
+	unsigned index = tail & *_sqMask;
+	struct io_uring_sqe *sqe = &_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	_sqArray[index] = index;
+	__atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+	_pending++;
+	return sqe;
+}
+
+int IoUring::submitAndWait(int waitMs)
+{
+	struct __kernel_timespec ts;
+	ts.tv_sec = waitMs / 1000;
+	ts.tv_nsec = (waitMs % 1000) * 1000000L;
+
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<unsigned long>(&ts);
+
+	int ret = enter(_pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (ret >= 0)
+		_pending -= (static_cast<unsigned>(ret) < _pending) ? ret : _pending;
+	if (ret < 0 && errno == ETIME)
+	{
+		// The submissions went through, only the wait timed out
+		_pending = 0;
+		return 0;
+	}
+	return ret;
+}
+
+struct io_uring_cqe *IoUring::peekCqe()
+{
+	unsigned head = *_cqHead;
+	if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &_cqes[head & *_cqMask];
+}
+
+void IoUring::advanceCq()
+{
+	__atomic_store_n(_cqHead, *_cqHead + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long IoUring::enterCalls() const
+{
+	return _enterCalls;
+}
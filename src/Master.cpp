@@ -0,0 +1,269 @@
+#include "Master.hpp"
+#include "WebServ.hpp"
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+extern volatile sig_atomic_t stop_flag;
+
+/**
+ * Master()
+ * The loops of a worker share the cgi_max_concurrent slots of a location,
+ * separate processes can't: each one gets its share of them and of the
+ * queue (rounded up, at least one slot).
+ */
+Master::Master(const std::vector<ServerConfig> &servers, const GlobalConfig &global)
+	: _servers(servers), _global(global)
+{
+	size_t count = _global.getWorkerCount();
+	for (size_t i = 0; i < _servers.size() && count > 1; i++)
+	{
+		std::vector<LocationConfig> &locations = _servers[i].locations;
+		for (size_t j = 0; j < locations.size(); j++)
+		{
+			LocationConfig &loc = locations[j];
+			if (!loc.cgi_max_concurrent)
+				continue;
+			loc.cgi_max_concurrent = (loc.cgi_max_concurrent + count - 1) / count;
+			loc.cgi_queue_size = (loc.cgi_queue_size + count - 1) / count;
+		}
+	}
+}
+
+Master::~Master() {}
+
+/**
+ * run()
+ * Forks worker_processes workers, each with its own epoll instance and its
+ * own SO_REUSEPORT listen sockets, then waits for them. A worker that dies
+ * is respawned in the same slot; on SIGINT/SIGTERM the signal is forwarded
+ * and the master waits for every worker to finish its loop.
+ * With a single worker there is nothing to supervise: run the loops here.
+ */
+int Master::run()
+{
+	int count = _global.getWorkerCount();
+	if (count == 1)
+		return runLoops(0);
+
+	_workers.assign(count, -1);
+	_startedAt.assign(count, 0);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!spawnWorker(i))
+		{
+			stopWorkers();
+			return EXIT_FAILURE;
+		}
+	}
+	std::cout << "Master " << getpid() << " started " << count << " workers" << std::endl;
+
+	int result = EXIT_SUCCESS;
+	while (!stop_flag)
+	{
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		int slot = findSlot(pid);
+		if (slot < 0 || stop_flag)
+			continue;
+		_workers[slot] = -1;
+
+		// A worker that can't even start (bind error, crash while setting
+		// up...) will not do better next time
+		bool failedAtStart = (monotonicMs() - _startedAt[slot] < WORKER_MIN_LIFETIME * 1000L)
+			&& ((WIFEXITED(status) && WEXITSTATUS(status) != 0) || WIFSIGNALED(status));
+		if (failedAtStart)
+		{
+			std::cerr << "Worker " << pid << " failed at startup, shutting down" << std::endl;
+			result = EXIT_FAILURE;
+			break;
+		}
+		std::cerr << "Worker " << pid << " exited, respawning" << std::endl;
+		if (!spawnWorker(slot))
+		{
+			result = EXIT_FAILURE;
+			break;
+		}
+	}
+	stopWorkers();
+	return result;
+}
+
+// Milliseconds on a clock that settimeofday() can't move
+long Master::monotonicMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+bool Master::spawnWorker(size_t slot)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		std::cerr << "fork worker failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+	if (pid == 0)
+		runWorker(slot);
+	_workers[slot] = pid;
+	_startedAt[slot] = monotonicMs();
+	return true;
+}
+
+// Child side: never returns to the caller
+void Master::runWorker(size_t slot)
+{
+	exit(runLoops(slot));
+}
+
+/**
+ * runLoops()
+ * Runs worker_threads copies of WebServ::mainLoop in this process. Every
+ * thread owns its epoll fd, its SO_REUSEPORT listen sockets and its
+ * connection tables; they only share the (read-only) configuration and the
+ * process-wide caches. If one loop can't start, the whole process stops.
+ */
+int Master::runLoops(size_t slot)
+{
+	int threads = _global.getThreadCount();
+	bool reusePort = (_global.getWorkerCount() > 1 || threads > 1);
+	SharedZones zones;
+
+	if (threads == 1)
+	{
+		setAffinity(slot);
+		try
+		{
+			WebServ ws(_servers, zones, reusePort);
+			ws.start();
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "Worker " << getpid() << ": " << e.what() << "\n";
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	std::vector<LoopThread> loops(threads);
+	int started = 0;
+	for (int i = 0; i < threads; i++)
+	{
+		loops[i].master = this;
+		loops[i].zones = &zones;
+		loops[i].index = slot * threads + i;
+		loops[i].failed = false;
+		if (pthread_create(&loops[i].tid, NULL, &Master::loopThread, &loops[i]) != 0)
+		{
+			std::cerr << "pthread_create failed" << std::endl;
+			loops[i].failed = true;
+			stop_flag = 1;
+			break;
+		}
+		started++;
+	}
+
+	int result = EXIT_SUCCESS;
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(loops[i].tid, NULL);
+		if (loops[i].failed)
+			result = EXIT_FAILURE;
+	}
+	if (started < threads)
+		result = EXIT_FAILURE;
+	return result;
+}
+
+void *Master::loopThread(void *arg)
+{
+	LoopThread *loop = static_cast<LoopThread *>(arg);
+	loop->master->setAffinity(loop->index);
+	try
+	{
+		WebServ ws(loop->master->_servers, *loop->zones, true);
+		ws.start();
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Worker " << getpid() << " thread " << loop->index << ": " << e.what() << "\n";
+		loop->failed = true;
+		stop_flag = 1;
+	}
+	return NULL;
+}
+
+/**
+ * setAffinity()
+ * Pins the calling thread. worker_cpu_affinity auto puts event loop N on
+ * CPU N (modulo the CPU count), explicit bitmasks are read right to left:
+ * "0100" means CPU 2.
+ */
+void Master::setAffinity(size_t index)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	if (_global.cpu_affinity_auto)
+	{
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu <= 0)
+			return;
+		CPU_SET(index % ncpu, &set);
+	}
+	else if (!_global.cpu_affinity_masks.empty())
+	{
+		const std::string &mask = _global.cpu_affinity_masks[index % _global.cpu_affinity_masks.size()];
+		for (size_t i = 0; i < mask.size(); i++)
+		{
+			if (mask[mask.size() - 1 - i] == '1')
+				CPU_SET(i, &set);
+		}
+	}
+	else
+		return;
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		std::cerr << "sched_setaffinity failed: " << strerror(errno) << std::endl;
+}
+
+void Master::stopWorkers()
+{
+	for (size_t i = 0; i < _workers.size(); i++)
+	{
+		if (_workers[i] > 0)
+			kill(_workers[i], SIGINT);
+	}
+	for (size_t i = 0; i < _workers.size(); i++)
+	{
+		if (_workers[i] > 0)
+		{
+			while (waitpid(_workers[i], NULL, 0) == -1 && errno == EINTR)
+				;
+			_workers[i] = -1;
+		}
+	}
+}
+
+int Master::findSlot(pid_t pid) const
+{
+	for (size_t i = 0; i < _workers.size(); i++)
+	{
+		if (_workers[i] == pid)
+			return static_cast<int>(i);
+	}
+	return -1;
+}
@@ -0,0 +1,140 @@
+#include "OpenFileCache.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+
+OpenFileInfo::OpenFileInfo() : error(0), isDir(false)
+{
+	std::memset(&st, 0, sizeof(st));
+}
+
+OpenFileCache::OpenFileCache(size_t max, int inactive, int valid, bool errors)
+	: _max(max), _inactive(inactive), _valid(valid), _errors(errors) {}
+
+OpenFileCache::~OpenFileCache() {}
+
+/**
+ * load()
+ * One stat(), plus open() and fstat() for a regular file when open is set.
+ * The fstat() keeps st in step with the fd if the file was just replaced.
+ */
+void OpenFileCache::load(const std::string &path, bool open, OpenFileInfo &info)
+{
+	info = OpenFileInfo();
+	if (stat(path.c_str(), &info.st) == -1)
+	{
+		info.error = errno;
+		return;
+	}
+	info.isDir = S_ISDIR(info.st.st_mode);
+	if (!open || !S_ISREG(info.st.st_mode))
+		return;
+
+	// O_NONBLOCK: a FIFO swapped in after the stat() must not block the loop
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (fd == -1)
+	{
+		info.error = errno;
+		return;
+	}
+	info.file = FileHandle(fd);
+	if (fstat(fd, &info.st) == -1 || !S_ISREG(info.st.st_mode))
+	{
+		info.isDir = S_ISDIR(info.st.st_mode);
+		info.file.reset();
+	}
+}
+
+/**
+ * lookup()
+ * A hit within `valid` seconds costs no syscall at all. After that the path
+ * is stat()ed again and the entry's fd kept only if the path still names
+ * the same unchanged file. The fd of a cached regular file is opened on the
+ * first lookup that asks for it. Two loops missing the same path at once
+ * both load it; the last one to finish is kept.
+ */
+void OpenFileCache::lookup(const std::string &path, time_t now, bool open, OpenFileInfo &info)
+{
+	if (cached(path, now, open, info))
+		return;
+
+	// info holds the stale entry, if any
+	OpenFileInfo fresh;
+	load(path, false, fresh);
+	const struct stat &old = info.st;
+	if (!fresh.error && !info.error && info.file.isOpen() && fresh.st.st_ino == old.st_ino
+		&& fresh.st.st_dev == old.st_dev && fresh.st.st_size == old.st_size
+		&& fresh.st.st_mtime == old.st_mtime)
+		fresh.file = info.file;
+	if (open && !fresh.error && S_ISREG(fresh.st.st_mode) && !fresh.file.isOpen())
+		load(path, true, fresh);
+	info = fresh;
+
+	ScopedLock lock(_mutex);
+	std::map<std::string, Entries::iterator>::iterator it = _index.find(path);
+	if ((fresh.error && !_errors) || _max == 0)
+	{
+		if (it != _index.end())
+			evict(it);
+		return;
+	}
+	if (it == _index.end())
+	{
+		while (!_entries.empty() && _index.size() >= _max)
+			evict(_index.find(_entries.back().first));
+		_entries.push_front(std::make_pair(path, Entry()));
+		it = _index.insert(std::make_pair(path, _entries.begin())).first;
+	}
+	else
+		_entries.splice(_entries.begin(), _entries, it->second);
+	Entry &entry = it->second->second;
+	entry.info = fresh;
+	entry.validatedAt = now;
+	entry.usedAt = now;
+}
+
+// Copies a still valid entry into info; a stale one is copied too but
+// reported as a miss
+bool OpenFileCache::cached(const std::string &path, time_t now, bool open, OpenFileInfo &info)
+{
+	ScopedLock lock(_mutex);
+	expire(now);
+
+	std::map<std::string, Entries::iterator>::iterator it = _index.find(path);
+	if (it == _index.end())
+	{
+		info = OpenFileInfo();
+		return false;
+	}
+	Entry &entry = it->second->second;
+	info = entry.info;
+	if (now - entry.validatedAt >= _valid)
+		return false;
+	if (open && !entry.info.error && S_ISREG(entry.info.st.st_mode) && !entry.info.file.isOpen())
+		return false;
+	entry.usedAt = now;
+	_entries.splice(_entries.begin(), _entries, it->second);
+	return true;
+}
+
+void OpenFileCache::remove(const std::string &path)
+{
+	ScopedLock lock(_mutex);
+	std::map<std::string, Entries::iterator>::iterator it = _index.find(path);
+	if (it != _index.end())
+		evict(it);
+}
+
+// Unused entries sit at the back of the LRU
+void OpenFileCache::expire(time_t now)
+{
+	while (!_entries.empty() && now - _entries.back().second.usedAt >= _inactive)
+		evict(_index.find(_entries.back().first));
+}
+
+// Responses already queued keep their own FileHandle, the fd outlives this
+void OpenFileCache::evict(std::map<std::string, Entries::iterator>::iterator it)
+{
+	_entries.erase(it->second);
+	_index.erase(it);
+}
@@ -13,6 +13,9 @@
 Outils::Outils() {};
 Outils::~Outils() {};
 
+std::map<std::string, SessionData> Outils::g_sessions;
+Mutex Outils::g_sessionsMutex;
+
 std::map<std::string, std::string> Outils::parseCookieString(const std::string &cookieStr)
 {
     std::map<std::string, std::string> result;
@@ -63,6 +66,8 @@ std::map<std::string, std::string> Outils::parseCookieString(const std::string &
 
 std::string Outils::generateRandomSessionID()
 {
+    // rand() keeps hidden state, don't let two threads step on it
+    ScopedLock lock(g_sessionsMutex);
     char buf[16];
     for (int i = 0; i < 8; i++)
     {
@@ -106,10 +111,31 @@ void Outils::printConf(const std::vector<ServerConfig> &servers)
 	{
 		const ServerConfig &srv = servers[i];
 		std::cout << "Server " << i << ": " << srv.host << ":" << srv.port << "\n";
+		std::cout << "  backlog: " << srv.backlog << (srv.defer_accept ? " deferred" : "") << "\n";
 		std::cout << "  server_name: " << srv.server_name << "\n";
 		std::cout << "  root: " << srv.root << "\n";
 		std::cout << "  max_body_size: " << srv.max_body_size << "\n";
 		std::cout << "  autoindex: " << (srv.autoindex ? "on" : "off") << "\n";
+		std::cout << "  keepalive_timeout: " << srv.keepalive_timeout << "\n";
+		std::cout << "  keepalive_requests: " << srv.keepalive_requests << "\n";
+		std::cout << "  client_header_timeout: " << srv.client_header_timeout << "\n";
+		std::cout << "  client_body_timeout: " << srv.client_body_timeout << "\n";
+		std::cout << "  send_timeout: " << srv.send_timeout << "\n";
+		std::cout << "  static_cache: " << srv.static_cache << "\n";
+		if (srv.open_file_cache)
+			std::cout << "  open_file_cache: max=" << srv.open_file_cache
+					  << " inactive=" << srv.open_file_cache_inactive
+					  << " valid=" << srv.open_file_cache_valid
+					  << " errors=" << (srv.open_file_cache_errors ? "on" : "off") << "\n";
+
+		if (srv.gzip)
+		{
+			std::cout << "  gzip: level " << srv.gzip_comp_level << ", min_length "
+					  << srv.gzip_min_length << ", types: text/html";
+			for (size_t j = 0; j < srv.gzip_types.size(); j++)
+				std::cout << " " << srv.gzip_types[j];
+			std::cout << "\n";
+		}
 
 		std::cout << "  error_pages:\n";
 		for (std::map<int, std::string>::const_iterator it = srv.error_pages.begin(); it != srv.error_pages.end(); ++it)
@@ -140,7 +166,31 @@ void Outils::printConf(const std::vector<ServerConfig> &servers)
 			std::cout << "    autoindex: " << (loc.autoindex ? "on" : "off") << "\n";
 			std::cout << "    cgi_pass: " << loc.cgi_pass << "\n";
 			std::cout << "    cgi_extension: " << loc.cgi_extension << "\n";
+			if (!loc.fastcgi_pass.empty())
+				std::cout << "    fastcgi_pass: " << loc.fastcgi_pass
+						  << " keepalive=" << loc.fastcgi_keepalive << "\n";
+			if (loc.cgi_pool_size)
+				std::cout << "    cgi_pool_size: " << loc.cgi_pool_size
+						  << " spare=" << loc.cgi_pool_spare
+						  << " worker=" << loc.cgi_worker << "\n";
+			if (loc.cgi_max_concurrent)
+				std::cout << "    cgi_max_concurrent: " << loc.cgi_max_concurrent
+						  << " queue=" << loc.cgi_queue_size << "\n";
+			if (loc.cgi_timeout)
+				std::cout << "    cgi_timeout: " << loc.cgi_timeout << "\n";
+			if (loc.cgi_rlimit_cpu || loc.cgi_rlimit_memory)
+				std::cout << "    cgi_rlimit: cpu=" << loc.cgi_rlimit_cpu
+						  << " memory=" << loc.cgi_rlimit_memory << "\n";
+			if (loc.cgi_cache)
+				std::cout << "    cgi_cache: " << loc.cgi_cache << " valid=" << loc.cgi_cache_valid
+						  << " stale=" << loc.cgi_cache_stale << "\n";
+			if (loc.cgi_cache_lock)
+				std::cout << "    cgi_cache_lock: timeout=" << loc.cgi_cache_lock_timeout << "\n";
 			std::cout << "    max_body_size: " << loc.max_body_size << "\n";
+			if (loc.static_cache >= 0)
+				std::cout << "    static_cache: " << loc.static_cache << "\n";
+			if (loc.gzip_static)
+				std::cout << "    gzip_static: on\n";
             std::cout << "    redirect: " << loc.redirect << "\n";
 		}
 	}
@@ -148,6 +198,7 @@ void Outils::printConf(const std::vector<ServerConfig> &servers)
 
 void Outils::storeSessionData(const std::string &sid, const std::string &ip, const std::string &userAgent)
 {
+    ScopedLock lock(g_sessionsMutex);
     SessionData &data = g_sessions[sid];
 
     data.ip = ip;
@@ -155,10 +206,13 @@ void Outils::storeSessionData(const std::string &sid, const std::string &ip, con
     data.lastVisit = time(NULL);
 }
 
-SessionData *Outils::getSessionData(const std::string &sid)
+// Copies the session out: another thread may update the entry right after we unlock
+bool Outils::getSessionData(const std::string &sid, SessionData &out)
 {
+    ScopedLock lock(g_sessionsMutex);
     std::map<std::string, SessionData>::iterator it = g_sessions.find(sid);
     if (it == g_sessions.end())
-        return NULL;
-    return &it->second;
+        return false;
+    out = it->second;
+    return true;
 }
\ No newline at end of file
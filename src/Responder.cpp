@@ -1,4 +1,5 @@
 #include "Responder.hpp"
+#include "Gzip.hpp"
 #include "AutoIndex.cpp"
 #include <sstream>
 #include <fstream>
@@ -8,6 +9,8 @@
 #include <fcntl.h>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
+#include <iomanip>
 #include <sys/wait.h>
 #include <sstream>
 #include <string>
@@ -15,11 +18,12 @@
 #include <cctype>
 #include <iostream>
 
-Responder::Responder() {
+Responder::Responder(SharedZones &zones) : _zones(zones), _boundaries(0) {
     Outils outils;
 };
-Responder::~Responder() {};
-std::map<std::string, std::string> Responder::g_sessions;
+Responder::~Responder()
+{
+};
 
 /**
  * handleRequest()
@@ -55,13 +59,13 @@ HttpResponse Responder::handleRequest(const HttpParser &parser, const ServerConf
     {
         // Have a session cookie - (In real life and project - check if it's valid)
         sid = cookies["session_id"];
-        const SessionData* sd = outils.getSessionData(sid);
-        if (sd)
+        SessionData sd;
+        if (outils.getSessionData(sid, sd))
         {
             // Console log
-            // std::cout << "[Session] Welcome back! Last IP: " << sd->ip
-            //           << ", last visit: " << ctime(&(sd->lastVisit)) 
-            //           << ", userAgent: " << sd->userAgent << std::endl;
+            // std::cout << "[Session] Welcome back! Last IP: " << sd.ip
+            //           << ", last visit: " << ctime(&(sd.lastVisit)) 
+            //           << ", userAgent: " << sd.userAgent << std::endl;
         }
         else
         {
@@ -242,6 +246,10 @@ std::string Responder::getContentTypeByExtension(const std::string &path)
 		return "image/png";
 	if (ext == ".gif")
 		return "image/gif";
+	if (ext == ".svg")
+		return "image/svg+xml";
+	if (ext == ".ttf")
+		return "font/ttf";
 	return "application/octet-stream";
 }
 
@@ -342,20 +350,220 @@ std::string Responder::buildFilePath(const ServerConfig &server, const LocationC
 
 /**
  * setBodyFromFile()
- * Attempts to read the entire file into resp.body.
- * Returns false if file not found or not readable.
+ * Makes the open file the response body (sent later with sendfile()).
+ * Returns false if the lookup didn't end with an open regular file.
  */
-bool Responder::setBodyFromFile(HttpResponse &resp, const std::string &filePath)
+bool Responder::setBodyFromFile(HttpResponse &resp, const OpenFileInfo &info)
 {
-	std::ifstream ifs(filePath.c_str(), std::ios::binary);
-	if (!ifs.is_open())
+	if (info.error || !info.file.isOpen())
 		return false;
-	std::ostringstream oss;
-	oss << ifs.rdbuf();
-	resp.setBody(oss.str());
+	resp.setBodyFromFile(info.file, 0, info.st.st_size);
 	return true;
 }
 
+/**
+ * openFileCache()
+ * The server's open file cache, created on first use and shared with the
+ * other loops of the process. NULL when disabled.
+ */
+OpenFileCache *Responder::openFileCache(const ServerConfig &server)
+{
+	if (server.open_file_cache == 0)
+		return NULL;
+
+	std::ostringstream zone;
+	zone << server.host << ":" << server.port << "/" << server.server_name;
+	OpenFileCache *&cache = _openFileCaches[zone.str()];
+	if (!cache)
+		cache = _zones.openFileCache(zone.str(), server.open_file_cache,
+									 server.open_file_cache_inactive,
+									 server.open_file_cache_valid, server.open_file_cache_errors);
+	return cache;
+}
+
+/**
+ * fileInfo()
+ * stat() (and open() if asked) of a path, through the server's open file
+ * cache when it has one. Every filesystem lookup of the Responder goes here.
+ */
+void Responder::fileInfo(const ServerConfig &server, const std::string &path, bool open,
+						 OpenFileInfo &info)
+{
+	OpenFileCache *cache = openFileCache(server);
+	if (cache)
+		cache->lookup(path, time(NULL), open, info);
+	else
+		OpenFileCache::load(path, open, info);
+}
+
+/**
+ * staticCache()
+ * The response cache of the location (or of the server when the location
+ * doesn't set static_cache), created on first use. NULL when disabled.
+ * Zones are per virtual host and location, each with its own byte budget,
+ * and shared by the event loops of the worker process.
+ */
+ResponseCache *Responder::staticCache(const ServerConfig &server, const LocationConfig *loc)
+{
+	size_t capacity = server.static_cache;
+	if (loc && loc->static_cache >= 0)
+		capacity = loc->static_cache;
+	if (capacity == 0)
+		return NULL;
+
+	std::ostringstream zone;
+	zone << server.host << ":" << server.port << "/" << server.server_name;
+	if (loc && loc->static_cache >= 0)
+		zone << "/" << loc->path;
+	ResponseCache *&cache = _staticCaches[zone.str()];
+	if (!cache)
+		cache = _zones.staticCache(zone.str(), capacity);
+	return cache;
+}
+
+/**
+ * cacheStaticResponse()
+ * Reads a small static file once and stores its serialized head and body,
+ * gzip-compressed first when gzipLevel is set, so a compressed variant
+ * costs one compression per file version. The response itself then goes
+ * out from the cached buffers too.
+ */
+void Responder::cacheStaticResponse(ResponseCache &cache, const std::string &key, HttpResponse &resp,
+									 const std::string &filePath, const struct stat &built,
+									 int gzipLevel)
+{
+	// The head was built from the stat data in built: a file changed since
+	// would be cached with the wrong length
+	struct stat st;
+	if (!resp.hasFileBody() || fstat(resp.getFile().fd(), &st) == -1 || st.st_size != built.st_size
+		|| st.st_mtime != built.st_mtime || st.st_ino != built.st_ino)
+		return;
+	size_t size = st.st_size;
+	if (size > STATIC_CACHE_MAX_FILE || size > cache.capacity() / 4)
+		return;
+
+	std::string *body = new std::string(size, '\0');
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t n = pread(resp.getFile().fd(), &(*body)[done], size - done, done);
+		if (n <= 0)
+		{
+			delete body;
+			return;
+		}
+		done += n;
+	}
+
+	if (gzipLevel > 0)
+	{
+		std::string *gz = new std::string;
+		if (!gzipString(*body, *gz, gzipLevel))
+		{
+			delete gz;
+			delete body;
+			return;
+		}
+		delete body;
+		body = gz;
+		std::ostringstream cl;
+		cl << body->size();
+		resp.setHeader("Content-Length", cl.str());
+		markGzipped(resp);
+	}
+
+	CachedResponse entry;
+	entry.head = SharedBuffer(new std::string(resp.headerBlock()));
+	entry.body = SharedBuffer(body);
+	entry.path = filePath;
+	entry.mtime = st.st_mtime;
+	entry.size = st.st_size;
+	entry.inode = st.st_ino;
+	entry.validatedAt = time(NULL);
+	cache.store(key, entry);
+	resp.setShared(entry.head, entry.body);
+}
+
+/**
+ * compressible()
+ * Whether gzip applies to the response: a full 2xx body or an error page,
+ * of one of the gzip_types (text/html always), not encoded yet and not
+ * known to be shorter than gzip_min_length.
+ */
+bool Responder::compressible(const ServerConfig &server, const HttpResponse &resp)
+{
+	int status = resp.getStatus();
+	if (status < 200 || status == 204 || status == 206 || (status >= 300 && status < 400))
+		return false;
+	if (!resp.getHeader("Content-Encoding").empty() || !resp.getBodyParts().empty())
+		return false;
+
+	std::string length = resp.getHeader("Content-Length");
+	if (!length.empty())
+	{
+		size_t bytes = std::strtoul(length.c_str(), NULL, 10);
+		if (bytes == 0 || bytes < server.gzip_min_length)
+			return false;
+	}
+
+	std::string type = resp.getHeader("Content-Type");
+	type = outils.trim(type.substr(0, type.find(';')));
+	std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+	if (type == "text/html")
+		return true;
+	for (size_t i = 0; i < server.gzip_types.size(); i++)
+	{
+		if (server.gzip_types[i] == type || server.gzip_types[i] == "*")
+			return true;
+	}
+	return false;
+}
+
+// Content-Encoding, and the ETag weakened: the bytes differ from the file's
+void Responder::markGzipped(HttpResponse &resp)
+{
+	resp.setHeader("Content-Encoding", "gzip");
+	std::string etag = resp.getHeader("ETag");
+	if (!etag.empty() && etag.compare(0, 2, "W/") != 0)
+		resp.setHeader("ETag", "W/" + etag);
+}
+
+/**
+ * compressResponse()
+ * gzip on the fly, for whatever the handlers produced: in-memory bodies are
+ * compressed at once (keeping a Content-Length), files and streamed bodies
+ * through a GzipSource as they are sent, chunked.
+ */
+void Responder::compressResponse(const HttpParser &parser, const ServerConfig &server,
+								 HttpResponse &resp)
+{
+	if (!server.gzip || resp.isShared() || !compressible(server, resp))
+		return;
+	resp.setHeader("Vary", "Accept-Encoding");
+	if (!acceptsGzip(parser))
+		return;
+
+	BodyStream input;
+	if (!resp.getBody().empty())
+	{
+		std::string gz;
+		if (!gzipString(resp.getBody(), gz, server.gzip_comp_level))
+			return;
+		resp.setBody(gz);
+		markGzipped(resp);
+		return;
+	}
+	if (resp.getBodySource().get())
+		input = resp.getBodySource();
+	else if (resp.hasFileBody() && resp.getFileLength() > 0)
+		input = BodyStream(new FileRangeSource(resp.getFile(), resp.getFileOffset(),
+											   resp.getFileLength()));
+	else
+		return;
+	resp.setBodySource(BodyStream(new GzipSource(input, server.gzip_comp_level)));
+	markGzipped(resp);
+}
+
 /**
  * extractFilename()
  * Utility method to get the file component from a path (e.g. "/upload/foo.txt" => "foo.txt").
@@ -389,14 +597,10 @@ HttpResponse Responder::makeErrorResponse(int code,
 	{
 		// Attempt to open server.root + that error_page path
 		std::string errorFilePath = server.root + it->second;
-		std::ifstream ifs(errorFilePath.c_str());
-		if (ifs.is_open())
-		{
-			std::ostringstream oss;
-			oss << ifs.rdbuf();
-			resp.setBody(oss.str());
+		OpenFileInfo info;
+		fileInfo(server, errorFilePath, true, info);
+		if (setBodyFromFile(resp, info))
 			return resp;
-		}
 	}
 
 	// Otherwise, build a default HTML error page
@@ -416,6 +620,235 @@ HttpResponse Responder::makeErrorResponse(int code,
 //         MAIN HANDLERS: GET, POST, DELETE (plus potential CGI check)
 //======================================================================
 
+/**
+ * makeETag()
+ * Strong validator of a file version: inode, size and mtime, in hex.
+ */
+std::string Responder::makeETag(ino_t inode, off_t size, time_t mtime)
+{
+	std::ostringstream oss;
+	oss << std::hex << "\"" << inode << "-" << size << "-" << mtime << "\"";
+	return oss.str();
+}
+
+/**
+ * httpDate()
+ * IMF-fixdate, as in Last-Modified: "Sun, 06 Nov 1994 08:49:37 GMT".
+ */
+std::string Responder::httpDate(time_t t)
+{
+	struct tm tm;
+	char buf[64];
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return buf;
+}
+
+/**
+ * isNotModified()
+ * If-None-Match (weak comparison, "*" matches anything) wins over
+ * If-Modified-Since, which is ignored when it can't be parsed.
+ */
+bool Responder::isNotModified(const HttpParser &parser, const std::string &etag, time_t mtime)
+{
+	std::string inm = parser.getHeader("If-None-Match");
+	if (!inm.empty())
+	{
+		std::istringstream list(inm);
+		std::string tag;
+		while (std::getline(list, tag, ','))
+		{
+			tag = outils.trim(tag);
+			if (tag.compare(0, 2, "W/") == 0)
+				tag.erase(0, 2);
+			if (tag == "*" || tag == etag)
+				return true;
+		}
+		return false;
+	}
+
+	std::string ims = parser.getHeader("If-Modified-Since");
+	if (ims.empty())
+		return false;
+	struct tm tm;
+	std::memset(&tm, 0, sizeof(tm));
+	if (!strptime(ims.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return false;
+	// A date in the future is invalid (RFC 9110 13.1.3), not a match
+	time_t since = timegm(&tm);
+	return mtime <= since && since <= time(NULL);
+}
+
+/**
+ * makeNotModified()
+ * 304 with the validators and no body (nor Content-Length).
+ */
+HttpResponse Responder::makeNotModified(const std::string &etag, time_t mtime)
+{
+	HttpResponse resp;
+	resp.setStatus(304, "Not Modified");
+	resp.setHeader("ETag", etag);
+	resp.setHeader("Last-Modified", httpDate(mtime));
+	return resp;
+}
+
+/**
+ * ifRangeMatches()
+ * No If-Range, or one naming the current version: an entity tag (strong
+ * comparison) or exactly the Last-Modified date. Otherwise the whole file
+ * is sent.
+ */
+bool Responder::ifRangeMatches(const HttpParser &parser, const std::string &etag, time_t mtime)
+{
+	std::string ifRange = outils.trim(parser.getHeader("If-Range"));
+	if (ifRange.empty())
+		return true;
+	if (ifRange[0] == '"' || ifRange.compare(0, 2, "W/") == 0)
+		return ifRange == etag;
+	return ifRange == httpDate(mtime);
+}
+
+/**
+ * parseRange()
+ * "bytes=0-99, 200-, -50" into inclusive [first, last] ranges clamped to
+ * the file size. RANGE_IGNORE for anything malformed (or too many ranges),
+ * in which case the whole file is sent; RANGE_UNSATISFIABLE when no range
+ * overlaps the file.
+ */
+int Responder::parseRange(const std::string &value, off_t size,
+						  std::vector<std::pair<off_t, off_t> > &ranges)
+{
+	std::string spec = outils.trim(value);
+	if (spec.compare(0, 6, "bytes=") != 0)
+		return RANGE_IGNORE;
+
+	std::istringstream list(spec.substr(6));
+	std::string item;
+	size_t count = 0;
+	while (std::getline(list, item, ','))
+	{
+		item = outils.trim(item);
+		size_t dash = item.find('-');
+		if (dash == std::string::npos || ++count > MAX_RANGES)
+			return RANGE_IGNORE;
+		std::string a = item.substr(0, dash);
+		std::string b = item.substr(dash + 1);
+		if (a.find_first_not_of("0123456789") != std::string::npos
+			|| b.find_first_not_of("0123456789") != std::string::npos
+			|| (a.empty() && b.empty()) || a.size() > 18 || b.size() > 18)
+			return RANGE_IGNORE;
+
+		off_t first, last;
+		if (a.empty())
+		{
+			// Suffix: the last b bytes
+			off_t suffix = std::atoll(b.c_str());
+			if (suffix == 0 || size == 0)
+				continue;
+			first = suffix >= size ? 0 : size - suffix;
+			last = size - 1;
+		}
+		else
+		{
+			first = std::atoll(a.c_str());
+			last = b.empty() ? first : std::atoll(b.c_str());
+			if (last < first)
+				return RANGE_IGNORE;
+			if (b.empty())
+				last = size - 1;
+			if (first >= size)
+				continue;
+			if (last >= size)
+				last = size - 1;
+		}
+		ranges.push_back(std::make_pair(first, last));
+	}
+	if (count == 0)
+		return RANGE_IGNORE;
+	return ranges.empty() ? RANGE_UNSATISFIABLE : RANGE_SATISFIABLE;
+}
+
+/**
+ * setRangeBody()
+ * Turns the full-file response into a 206: one range is a slice of the
+ * file, several make a multipart/byteranges body whose part headers are
+ * built here and whose ranges are still sent from the file.
+ */
+void Responder::setRangeBody(HttpResponse &resp, const std::vector<std::pair<off_t, off_t> > &ranges,
+							 off_t size, const std::string &ctype)
+{
+	resp.setStatus(206, "Partial Content");
+	FileHandle file = resp.getFile();
+	if (ranges.size() == 1)
+	{
+		std::ostringstream cr;
+		cr << "bytes " << ranges[0].first << "-" << ranges[0].second << "/" << size;
+		resp.setHeader("Content-Range", cr.str());
+		resp.setBodyFromFile(file, ranges[0].first, ranges[0].second - ranges[0].first + 1);
+		return;
+	}
+
+	std::ostringstream boundary;
+	boundary << std::setw(20) << std::setfill('0') << ++_boundaries;
+	std::vector<BodyPart> parts;
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		std::ostringstream head;
+		head << "\r\n--" << boundary.str() << "\r\n"
+			 << "Content-Type: " << ctype << "\r\n"
+			 << "Content-Range: bytes " << ranges[i].first << "-" << ranges[i].second
+			 << "/" << size << "\r\n\r\n";
+		BodyPart part;
+		part.data = head.str();
+		part.fileOffset = 0;
+		part.fileLength = 0;
+		parts.push_back(part);
+		part.data.clear();
+		part.fileOffset = ranges[i].first;
+		part.fileLength = ranges[i].second - ranges[i].first + 1;
+		parts.push_back(part);
+	}
+	BodyPart tail;
+	tail.data = "\r\n--" + boundary.str() + "--\r\n";
+	tail.fileOffset = 0;
+	tail.fileLength = 0;
+	parts.push_back(tail);
+
+	resp.setHeader("Content-Type", "multipart/byteranges; boundary=" + boundary.str());
+	resp.setBodyParts(file, parts);
+}
+
+/**
+ * acceptsGzip()
+ * Whether Accept-Encoding lists gzip (or x-gzip, or else *) with a
+ * non-zero q.
+ */
+bool Responder::acceptsGzip(const HttpParser &parser)
+{
+	std::istringstream list(parser.getHeader("Accept-Encoding"));
+	std::string item;
+	bool star = false;
+	while (std::getline(list, item, ','))
+	{
+		std::string coding = item;
+		std::string q;
+		size_t semi = item.find(';');
+		if (semi != std::string::npos)
+		{
+			coding = item.substr(0, semi);
+			q = outils.trim(item.substr(semi + 1));
+		}
+		coding = outils.trim(coding);
+		std::transform(coding.begin(), coding.end(), coding.begin(), ::tolower);
+		bool allowed = !(q.compare(0, 2, "q=") == 0 && std::atof(q.c_str() + 2) <= 0);
+		if (coding == "gzip" || coding == "x-gzip")
+			return allowed;
+		if (coding == "*")
+			star = allowed;
+	}
+	return star;
+}
+
 /**
  * handleGet()
  *  - if it's a directory and we have loc->index, try that index file
@@ -431,7 +864,7 @@ HttpResponse Responder::handleGet(const ServerConfig &server, const HttpParser &
 	HttpResponse resp;
 
 	// (Optionally) check if this is a CGI request:
-	if (loc && !loc->cgi_pass.empty())
+	if (loc && (!loc->cgi_pass.empty() || !loc->fastcgi_pass.empty()))
 	{
 		return handleCgi(server, parser, loc, reqPath);
 	}
@@ -439,59 +872,155 @@ HttpResponse Responder::handleGet(const ServerConfig &server, const HttpParser &
 	// Otherwise, proceed as static file or autoindex
 	std::string realFilePath = buildFilePath(server, loc, reqPath);
 
+	// gzip_static and gzip: the response depends on Accept-Encoding, and the
+	// variants are cached apart
+	bool gzipStatic = loc && loc->gzip_static;
+	bool takesGzip = (gzipStatic || server.gzip) && acceptsGzip(parser);
+	bool wantsGzip = gzipStatic && takesGzip;
+
+	// A cache hit costs one stat() of the file, so an edit shows on the next
+	// request (ranges are cut from the file)
+	ResponseCache *cache = staticCache(server, loc);
+	std::string cacheKey = realFilePath;
+	if (takesGzip)
+		cacheKey += std::string(1, '\0') + "gzip";
+	CachedResponse hit;
+	if (cache && parser.getHeader("Range").empty() && cache->lookup(cacheKey, time(NULL), hit))
+	{
+		struct stat st;
+		if (stat(hit.path.c_str(), &st) != 0 || st.st_mtime != hit.mtime
+			|| st.st_size != hit.size || st.st_ino != hit.inode)
+		{
+			// Forget the old version in the open file cache too
+			cache->remove(cacheKey);
+			if (OpenFileCache *files = openFileCache(server))
+				files->remove(hit.path);
+		}
+		else
+		{
+			std::string etag = makeETag(hit.inode, hit.size, hit.mtime);
+			if (isNotModified(parser, etag, hit.mtime))
+			{
+				resp = makeNotModified(etag, hit.mtime);
+				if (gzipStatic || server.gzip)
+					resp.setHeader("Vary", "Accept-Encoding");
+				return resp;
+			}
+			resp.setShared(hit.head, hit.body);
+			return resp;
+		}
+	}
 
-	struct stat st;
-	if (stat(realFilePath.c_str(), &st) == 0)
+	OpenFileInfo info;
+	fileInfo(server, realFilePath, true, info);
+	if (info.error == EACCES)
+		return makeErrorResponse(403, "Forbidden", server, "Cannot read file\n");
+	if (info.error)
+		return makeErrorResponse(404, "Not Found", server, "File Not Found\n");
+
+	// Directory => check index or autoindex
+	if (info.isDir)
 	{
-		// Directory => check index or autoindex
-		if (S_ISDIR(st.st_mode))
+		if (loc && !loc->index.empty())
+		{
+			// e.g. "index.html"
+			if (realFilePath[realFilePath.size() - 1] != '/')
+				realFilePath += "/";
+			realFilePath += loc->index;
+
+			fileInfo(server, realFilePath, true, info);
+			if (info.error || info.isDir)
+			{
+				// Index not found or is a dir
+				return makeErrorResponse(404, "Not found", server, "Directory listing is forbidden\n");
+			}
+		}
+		else
 		{
-			if (loc && !loc->index.empty())
+			// No index => autoindex?
+			if (!server.autoindex && !(loc && loc->autoindex))
 			{
-				// e.g. "index.html"
-				if (realFilePath[realFilePath.size() - 1] != '/')
-					realFilePath += "/";
-				realFilePath += loc->index;
-
-				struct stat st2;
-				if (stat(realFilePath.c_str(), &st2) != 0 || S_ISDIR(st2.st_mode))
-				{
-					// Index not found or is a dir
-					return makeErrorResponse(404, "Not found", server, "Directory listing is forbidden\n");
-				}
+				return makeErrorResponse(403, "Forbidden", server, "Directory listing is forbidden\n");
 			}
 			else
 			{
-				// No index => autoindex?
-				if (!server.autoindex && !(loc && loc->autoindex))
-				{
-					return makeErrorResponse(403, "Forbidden", server, "Directory listing is forbidden\n");
-				}
-				else
-				{
-					// Generate autoindex page
-					std::string html = makeAutoIndexPage(realFilePath, reqPath);
-					HttpResponse resp;
-					resp.setStatus(200, "OK");
-					resp.setHeader("Content-Type", "text/html");
-					resp.setBody(html);
-					return resp;
-				}
+				// Generate autoindex page, row by row while it is sent
+				HttpResponse resp;
+				resp.setStatus(200, "OK");
+				resp.setHeader("Content-Type", "text/html");
+				resp.setBodySource(BodyStream(new AutoIndexSource(realFilePath, reqPath,
+																  openFileCache(server))));
+				return resp;
 			}
 		}
+	}
+
+	// Precompressed sibling: sent as is, with the type of the original
+	std::string servedPath = realFilePath;
+	bool gzipped = false;
+	if (wantsGzip)
+	{
+		OpenFileInfo gz;
+		fileInfo(server, realFilePath + ".gz", true, gz);
+		if (!gz.error && gz.file.isOpen())
+		{
+			info = gz;
+			servedPath += ".gz";
+			gzipped = true;
+		}
+	}
 
-		// Serve static file
-		if (!setBodyFromFile(resp, realFilePath))
-			return makeErrorResponse(403, "Forbidden", server, "Cannot read file\n");
+	// Serve static file
+	if (!setBodyFromFile(resp, info))
+		return makeErrorResponse(403, "Forbidden", server, "Cannot read file\n");
 
-		resp.setStatus(200, "OK");
-		std::string ctype = getContentTypeByExtension(realFilePath);
-		resp.setHeader("Content-Type", ctype);
+	std::string etag = makeETag(info.st.st_ino, info.st.st_size, info.st.st_mtime);
+	if (isNotModified(parser, etag, info.st.st_mtime))
+	{
+		resp = makeNotModified(etag, info.st.st_mtime);
+		if (gzipStatic)
+			resp.setHeader("Vary", "Accept-Encoding");
+		return resp;
 	}
-	else
+
+	resp.setStatus(200, "OK");
+	resp.setHeader("ETag", etag);
+	resp.setHeader("Last-Modified", httpDate(info.st.st_mtime));
+	resp.setHeader("Accept-Ranges", "bytes");
+	std::string ctype = getContentTypeByExtension(realFilePath);
+	resp.setHeader("Content-Type", ctype);
+	if (gzipped)
+		resp.setHeader("Content-Encoding", "gzip");
+	if (gzipStatic)
+		resp.setHeader("Vary", "Accept-Encoding");
+
+	std::string range = parser.getHeader("Range");
+	if (!range.empty() && ifRangeMatches(parser, etag, info.st.st_mtime))
 	{
-		return makeErrorResponse(404, "Not Found", server, "File Not Found\n");
+		std::vector<std::pair<off_t, off_t> > ranges;
+		int parsed = parseRange(range, info.st.st_size, ranges);
+		if (parsed == RANGE_UNSATISFIABLE)
+		{
+			std::ostringstream cr;
+			cr << "bytes */" << info.st.st_size;
+			HttpResponse err = makeErrorResponse(416, "Range Not Satisfiable", server,
+												 "Requested range not satisfiable\n");
+			err.setHeader("Content-Range", cr.str());
+			return err;
+		}
+		if (parsed == RANGE_SATISFIABLE)
+		{
+			setRangeBody(resp, ranges, info.st.st_size, ctype);
+			return resp;
+		}
 	}
+	// Compressed on the fly: cached compressed, or else compressed while sent
+	bool compress = server.gzip && compressible(server, resp);
+	if (compress)
+		resp.setHeader("Vary", "Accept-Encoding");
+	if (cache)
+		cacheStaticResponse(*cache, cacheKey, resp, servedPath, info.st,
+							compress && takesGzip ? server.gzip_comp_level : 0);
 	return resp;
 }
 
@@ -505,7 +1034,7 @@ HttpResponse Responder::handleGet(const ServerConfig &server, const HttpParser &
 HttpResponse Responder::handlePost(const ServerConfig &server, const HttpParser &parser, const LocationConfig *loc, const std::string &reqPath)
 {
     // Если есть CGI-передача, вызываем её:
-    if (loc && !loc->cgi_pass.empty())
+    if (loc && (!loc->cgi_pass.empty() || !loc->fastcgi_pass.empty()))
     {
         return handleCgi(server, parser, loc, reqPath);
     }
@@ -579,6 +1108,8 @@ HttpResponse Responder::handlePost(const ServerConfig &server, const HttpParser
     }
     ofs << fileData;
     ofs.close();
+    if (OpenFileCache *cache = openFileCache(server))
+        cache->remove(fullUpload);
 
     resp.setStatus(201, "Created");
     resp.setHeader("Content-Type", "text/plain");
@@ -591,10 +1122,11 @@ HttpResponse Responder::handleDelete(const ServerConfig &server, const LocationC
 	HttpResponse resp;
 	std::string realFilePath = buildFilePath(server, loc, reqPath);
 
-	struct stat st;
-	if (stat(realFilePath.c_str(), &st) == 0)
+	OpenFileInfo info;
+	fileInfo(server, realFilePath, false, info);
+	if (info.error == 0)
 	{
-		if (S_ISDIR(st.st_mode))
+		if (info.isDir)
 		{
 			resp.setStatus(403, "Forbidden");
 			resp.setBody("Cannot delete a directory\n");
@@ -605,6 +1137,8 @@ HttpResponse Responder::handleDelete(const ServerConfig &server, const LocationC
 			// OK
 			resp.setStatus(200, "OK");
 			resp.setBody("File deleted\n");
+			if (OpenFileCache *cache = openFileCache(server))
+				cache->remove(realFilePath);
 		}
 		else
 		{
@@ -622,15 +1156,21 @@ HttpResponse Responder::handleDelete(const ServerConfig &server, const LocationC
 
 /**
  * handleCgi()
- * Launches an external CGI script, passing the HTTP request data via environment variables
- * and (if POST) via stdin. Reads the script's stdout, then forms an HttpResponse.
+ * Prepares an external CGI script, passing the HTTP request data via environment variables
+ * and (if POST) via stdin. Nothing is forked or read here: the event loop starts the
+ * script, runs it to completion and cgiResponse() forms the HttpResponse from its output.
+ * With cgi_cache a GET may be answered from the cache instead (credentials and cookies
+ * other than session_id bypass it); the script's complete response is stored there (cacheCgiResponse).
  *
  * Requirements:
- *  - loc->cgi_pass contains path to the interpreter (e.g. "/usr/bin/python")
+ *  - loc->cgi_pass contains path to the interpreter (e.g. "/usr/bin/python"),
+ *    or loc->fastcgi_pass the address of a FastCGI server to send the request to;
+ *    with loc->cgi_pool_size, a persistent worker of the interpreter runs it
  *  - scriptPath is the actual path to the .py or .php file on disk.
  *  - We set basic environment variables: REQUEST_METHOD, CONTENT_LENGTH, QUERY_STRING, etc.
  *
- * Returns: HttpResponse with the CGI output, or an error (500, etc.)
+ * Returns: a pending HttpResponse holding the CgiProcess, a cached one (holding the
+ * CgiProcess refreshing it, if it is stale), or an error (500, etc.)
  */
 
 HttpResponse Responder::handleCgi(const ServerConfig &server, 
@@ -645,20 +1185,55 @@ HttpResponse Responder::handleCgi(const ServerConfig &server,
         return makeErrorResponse(405, "Method Not Allowed", server, "Method Not Allowed for CGI\n");
     }
     
+    // 0) cgi_cache: a fresh hit needs no script at all. An expired one still
+    //    goes out, and the first request to get it runs the script again in
+    //    the background (refresh) to replace it; the others don't wait for that.
+    //    Our own session_id cookie is on nearly every request: only other
+    //    cookies make the response the client's own
+    ResponseCache *cache = NULL;
+    std::string cacheKey;
+    HttpResponse stale;
+    bool refresh = false;
+    std::map<std::string, std::string> cookies = outils.parseCookieString(parser.getHeader("Cookie"));
+    cookies.erase("session_id");
+    if (method == HTTP_METHOD_GET && parser.getHeader("Authorization").empty() && cookies.empty())
+        cache = cgiCache(server, loc);
+    if (cache) {
+        std::ostringstream key;
+        key << "GET" << '\0' << server.host << ":" << server.port << "/" << server.server_name
+            << '\0' << reqPath << "?" << parser.getQuery();
+        // gzip: the compressed and plain variants are cached apart
+        if (server.gzip && acceptsGzip(parser))
+            key << '\0' << "gzip";
+        cacheKey = key.str();
+        time_t now = time(NULL);
+        CachedResponse hit;
+        if (cache->lookup(cacheKey, now, hit)) {
+            std::ostringstream age;
+            age << now - hit.validatedAt;
+            stale.setShared(hit.head, hit.body);
+            stale.setHeader("Age", age.str());
+            if (now < hit.expires || !cache->startRefresh(cacheKey))
+                return stale;
+            refresh = true;
+        }
+    }
+
     // 1) Build full path to the script
     std::string scriptPath = buildFilePath(server, loc, reqPath);
 
-    // 2) Choise CGI interpreter based on extension
-    std::string cgiInterpreter;
-    size_t dotPos = scriptPath.rfind('.');
-    if (dotPos == std::string::npos) {
-        return makeErrorResponse(403, "Forbidden", server, "No CGI extension found\n");
-    }
-    std::string ext = scriptPath.substr(dotPos);
-    if (loc->cgi_extension == ext) {
-        cgiInterpreter = loc->cgi_pass;
-    } else {
-        return makeErrorResponse(403, "Forbidden", server, "Unsupported CGI extension\n");
+    // 2) Choise CGI interpreter based on extension (a FastCGI server has its
+    //    own, and takes any script unless cgi_extension narrows it down)
+    std::string cgiInterpreter = loc->cgi_pass;
+    bool fastcgi = !loc->fastcgi_pass.empty();
+    if (!fastcgi || !loc->cgi_extension.empty()) {
+        size_t dotPos = scriptPath.rfind('.');
+        if (dotPos == std::string::npos) {
+            return makeErrorResponse(403, "Forbidden", server, "No CGI extension found\n");
+        }
+        if (loc->cgi_extension != scriptPath.substr(dotPos)) {
+            return makeErrorResponse(403, "Forbidden", server, "Unsupported CGI extension\n");
+        }
     }
 
     // 3) Create environment variables
@@ -684,122 +1259,182 @@ HttpResponse Responder::handleCgi(const ServerConfig &server,
     }
     envVec.push_back("SERVER_PROTOCOL=" + parser.getVersion());
     envVec.push_back("SCRIPT_FILENAME=" + scriptPath);
+    envVec.push_back("SCRIPT_NAME=" + reqPath);
+    envVec.push_back("REQUEST_URI=" + reqPath
+                     + (parser.getQuery().empty() ? "" : "?" + parser.getQuery()));
     envVec.push_back("QUERY_STRING=" + parser.getQuery());
     envVec.push_back("GATEWAY_INTERFACE=CGI/1.1");
     envVec.push_back("REDIRECT_STATUS=200");
 
-    // 4) Convert envVec to char* array
-    std::vector<char *> envp;
-    for (size_t i = 0; i < envVec.size(); i++) {
-        envp.push_back(const_cast<char *>(envVec[i].c_str()));
-    }
-    envp.push_back(NULL);
-
-    // 5) Form the argument list for execve
-    std::vector<char *> args;
-    args.push_back(const_cast<char *>(cgiInterpreter.c_str()));
-    args.push_back(const_cast<char *>(scriptPath.c_str()));
-    args.push_back(NULL);
-
-    // 6) Create pipes for communication with the CGI script
-    int pipeOut[2];
-    if (pipe(pipeOut) == -1) {
-        return makeErrorResponse(500, "Internal Server Error", server, "Failed to create pipeOut\n");
-    }
-    bool hasBody = !parser.getBody().empty();
-    int pipeIn[2];
-    if (hasBody) {
-        if (pipe(pipeIn) == -1) {
-            close(pipeOut[0]);
-            close(pipeOut[1]);
-            return makeErrorResponse(500, "Internal Server Error", server, "Failed to create pipeIn\n");
+    // 4) The event loop forks the script, once cgi_max_concurrent lets it;
+    //    FastCGI, or a pool worker (cgi_pool_size with a cgi_worker): it hands
+    //    the request over instead
+    CgiProcess *cgi = new CgiProcess();
+    bool pooled = loc->cgi_pool_size > 0 && !loc->cgi_worker.empty();
+    if (fastcgi)
+        cgi->startFastCgi(loc->fastcgi_pass, loc->fastcgi_keepalive, envVec, parser.getBody());
+    else if (pooled)
+        cgi->startPooled(cgiInterpreter, loc->cgi_worker, loc->cgi_pool_size,
+                         loc->cgi_pool_spare, envVec, parser.getBody());
+    else
+        cgi->startScript(cgiInterpreter, scriptPath, *loc, envVec, parser.getBody());
+    if (cache) {
+        cgi->cache = cache;
+        cgi->cacheKey = cacheKey;
+        cgi->cacheValid = loc->cgi_cache_valid;
+        cgi->cacheStale = loc->cgi_cache_stale;
+        cgi->cacheMax = std::min(static_cast<size_t>(CGI_CACHE_MAX_ENTRY), cache->capacity() / 4);
+        if (server.gzip) {
+            cgi->cacheGzip = &server;
+            cgi->cacheGzipped = acceptsGzip(parser);
         }
+        cgi->refresh = refresh;
+        if (loc->cgi_cache_lock)
+            cgi->lockTimeout = loc->cgi_cache_lock_timeout;
     }
+    HttpResponse response = stale;
+    response.setCgi(cgi);
+    return response;
+}
 
-    // 7) Fork
-    pid_t pid = fork();
-    if (pid < 0) {
-        close(pipeOut[0]);
-        close(pipeOut[1]);
-        if (hasBody) {
-            close(pipeIn[0]);
-            close(pipeIn[1]);
-        }
-        return makeErrorResponse(500, "Internal Server Error", server, "Fork failed\n");
-    }
-    else if (pid == 0) {
-        // Child process - set up pipes and run the script
-        dup2(pipeOut[1], STDOUT_FILENO);
-        dup2(pipeOut[1], STDERR_FILENO);
-        close(pipeOut[0]);
-        close(pipeOut[1]);
-
-        if (hasBody) {
-            dup2(pipeIn[0], STDIN_FILENO);
-            close(pipeIn[1]);
-            close(pipeIn[0]);
-        }
+/**
+ * cgiCache()
+ * The cgi_cache zone of the location, created on first use. NULL when
+ * disabled.
+ */
+ResponseCache *Responder::cgiCache(const ServerConfig &server, const LocationConfig *loc)
+{
+    if (loc->cgi_cache == 0)
+        return NULL;
+    std::ostringstream zone;
+    zone << server.host << ":" << server.port << "/" << server.server_name << "/" << loc->path;
+    ResponseCache *&cache = _cgiCaches[zone.str()];
+    if (!cache)
+        cache = _zones.cgiCache(zone.str(), loc->cgi_cache);
+    return cache;
+}
+
+// Seconds of a Cache-Control directive such as max-age=60, fallback without it
+static int cacheControlSeconds(const std::string &control, const std::string &name, int fallback)
+{
+    size_t pos = 0;
+    while ((pos = control.find(name, pos)) != std::string::npos) {
+        if (pos == 0 || control[pos - 1] == ',' || control[pos - 1] == ' ')
+            break;
+        pos += name.size();
+    }
+    if (pos == std::string::npos || !isdigit(static_cast<unsigned char>(control.c_str()[pos + name.size()])))
+        return fallback;
+    return std::atoi(control.c_str() + pos + name.size());
+}
 
-        // Run the script
-        execve(args[0], &args[0], &envp[0]);
-        // If execve returns, it failed
-        _exit(1);
-    }
-    else {
-        // Parent process - close unused pipe ends
-        close(pipeOut[1]);  
-        if (hasBody) {
-            close(pipeIn[0]);
-            write(pipeIn[1], parser.getBody().c_str(), parser.getBody().size());
-            close(pipeIn[1]);
+/**
+ * cacheCgiResponse()
+ * cgi_cache: stores a complete script response, which then goes out from
+ * the cached buffers too. Only a 200, 301 or 302 without Set-Cookie is
+ * kept, and not if its Cache-Control says no-store, no-cache or private;
+ * its s-maxage (else max-age) replaces valid=, its stale-while-revalidate
+ * stale=. Under gzip it is stored compressed for a client that takes gzip,
+ * with Vary either way. False if it was not stored.
+ */
+bool Responder::cacheCgiResponse(CgiProcess &cgi, HttpResponse &resp)
+{
+    int status = resp.getStatus();
+    if ((status != 200 && status != 301 && status != 302) || resp.getBodySource().get()
+        || !resp.getHeader("Set-Cookie").empty() || resp.getBody().size() > cgi.cacheMax)
+        return false;
+    std::string control = resp.getHeader("Cache-Control");
+    std::transform(control.begin(), control.end(), control.begin(), ::tolower);
+    if (control.find("no-store") != std::string::npos || control.find("no-cache") != std::string::npos
+        || control.find("private") != std::string::npos)
+        return false;
+    int valid = cacheControlSeconds(control, "s-maxage=",
+                                    cacheControlSeconds(control, "max-age=", cgi.cacheValid));
+    int stale = cacheControlSeconds(control, "stale-while-revalidate=", cgi.cacheStale);
+    if (valid <= 0)
+        return false;
+
+    // gzip: stored as the variant the client takes, compressed once
+    if (cgi.cacheGzip && compressible(*cgi.cacheGzip, resp)) {
+        resp.setHeader("Vary", "Accept-Encoding");
+        if (cgi.cacheGzipped) {
+            std::string gz;
+            if (!gzipString(resp.getBody(), gz, cgi.cacheGzip->gzip_comp_level))
+                return false;
+            resp.setBody(gz);
+            markGzipped(resp);
         }
-        // Function to read the output of the CGI script (if our script acctually writes something)
-        HttpResponse response = processCgiOutput(pipeOut[0], pid);
-        return response;
     }
 
-    return makeErrorResponse(500, "Internal Server Error", server, "Unknown CGI error\n");
+    time_t now = time(NULL);
+    CachedResponse entry;
+    entry.head = SharedBuffer(new std::string(resp.headerBlock()));
+    entry.body = SharedBuffer(new std::string(resp.getBody()));
+    entry.validatedAt = now;
+    entry.expires = now + valid;
+    entry.staleUntil = entry.expires + stale;
+    cgi.cache->store(cgi.cacheKey, entry);
+    resp.setShared(entry.head, entry.body);
+    return true;
 }
 
-
-HttpResponse Responder::processCgiOutput(int pipeFd, pid_t childPid)
+/**
+ * cgiResponse()
+ * Turns what the script wrote into the response, on top of what the request
+ * handler already set (cgi.response). Called once the script is done, or
+ * as soon as its headers are in: then the body is the rest of its output,
+ * streamed as it comes - with the script's Content-Length if it gave one,
+ * chunked otherwise. A streamed response is on its way before the exit
+ * status is known, a failing script can no longer turn it into a 500.
+ */
+HttpResponse Responder::cgiResponse(CgiProcess &cgi)
 {
-    // 1. Read the output of the CGI script
-    std::ostringstream cgiOutput;
-    char buf[1024];
-    ssize_t bytesRead;
-    while ((bytesRead = read(pipeFd, buf, sizeof(buf))) > 0) {
-        cgiOutput.write(buf, bytesRead);
+    HttpResponse resp = cgi.response;
+    resp.setCgi(NULL);
+    std::string &output = cgi.output->data;
+    bool complete = cgi.done();
+
+    // 0. The script ran past cgi_timeout before its headers were in.
+    if (cgi.timedOut && !cgi.headQueued) {
+        resp.setStatus(504, "Gateway Timeout");
+        resp.setHeader("Content-Type", "text/html");
+        resp.setBody("<html><body><h1>504 Gateway Timeout</h1></body></html>");
+        return resp;
     }
-    close(pipeFd);
 
-    // 2. Wait for the child process to finish
-    int status;
-    waitpid(childPid, &status, 0);
-    std::string output = cgiOutput.str();
+    // The FastCGI server could not be reached, or gave up on the request.
+    if (cgi.failed && !cgi.headQueued) {
+        resp.setStatus(502, "Bad Gateway");
+        resp.setHeader("Content-Type", "text/html");
+        resp.setBody("<html><body><h1>502 Bad Gateway</h1></body></html>");
+        return resp;
+    }
 
-    // If process exited abnormally, return 500 with the output as the body.
-    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-        HttpResponse err;
-        err.setStatus(500, "Internal Server Error");
-        err.setHeader("Content-Type", "text/html");
+    // 1. If process exited abnormally (or was killed, e.g. past its cgi_rlimit),
+    // return 500 with the output as the body.
+    // A streamed response is already on its way when the script exits.
+    if (complete && (!WIFEXITED(cgi.status) || WEXITSTATUS(cgi.status) != 0)) {
+        resp.setStatus(500, "Internal Server Error");
+        resp.setHeader("Content-Type", "text/html");
         std::ostringstream errBody;
         errBody << "<html><body><h1>CGI Execution Error</h1>"
                 << "<pre>" << output << "</pre></body></html>";
-        err.setBody(errBody.str());
+        resp.setBody(errBody.str());
         // Set Content-Length
         std::ostringstream oss;
         oss << errBody.str().size();
-        err.setHeader("Content-Length", oss.str());
-        return err;
+        resp.setHeader("Content-Length", oss.str());
+        return resp;
     }
 
-    // 3. Parsing the output of the CGI script as an HTTP response message.
+    // 2. Parsing the output of the CGI script as an HTTP response message.
     // So ussualy we have headers and body devide by empty line
-    std::istringstream iss(output);
+    size_t bodyStart = cgi.bodyOffset();
+    if (bodyStart == std::string::npos)
+        bodyStart = output.size();
+    std::istringstream iss(output.substr(0, bodyStart));
     std::string line;
     std::map<std::string, std::string> headers;
-    std::string body;
 
     while (std::getline(iss, line)) {
         // if the string is ended with '\r' we remove it
@@ -823,16 +1458,22 @@ HttpResponse Responder::processCgiOutput(int pipeFd, pid_t childPid)
     }
 
     // The rest of the output is the body
-    std::ostringstream bodyStream;
-    bodyStream << iss.rdbuf();
-    body = bodyStream.str();
-
-    // 4. Erase Content-Length if it's present in the headers
-    if (headers.find("Content-Length") != headers.end())
+    output.erase(0, bodyStart);
+
+    // 3. Erase Content-Length if it's present in the headers: a streamed
+    // body keeps it if it is a valid one, a complete one gets the real size
+    off_t length = -1;
+    if (headers.find("Content-Length") != headers.end()) {
+        const std::string &value = headers["Content-Length"];
+        char *end = NULL;
+        errno = 0;
+        long parsed = std::strtol(value.c_str(), &end, 10);
+        if (isdigit(static_cast<unsigned char>(value.c_str()[0])) && *end == '\0' && errno == 0)
+            length = parsed;
         headers.erase("Content-Length");
+    }
 
-    // 5. Form the HttpResponse object
-    HttpResponse resp;
+    // 4. Form the HttpResponse object
     int statusCode = 200;
     std::string reasonPhrase = "OK";
 
@@ -853,7 +1494,13 @@ HttpResponse Responder::processCgiOutput(int pipeFd, pid_t childPid)
         resp.setHeader(it->first, it->second);
     }
 
-    // Set body
+    // Set body: the rest of the output comes from the script as it writes it
+    if (!complete) {
+        resp.setBodySource(BodyStream(new CgiSource(cgi.output, length)));
+        return resp;
+    }
+    std::string body;
+    body.swap(output);
     resp.setBody(body);
 
     // Set Content-Length with the real body size
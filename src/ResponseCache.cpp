@@ -0,0 +1,97 @@
+#include "ResponseCache.hpp"
+
+CachedResponse::CachedResponse()
+	: mtime(0), size(0), inode(0), validatedAt(0), expires(0), staleUntil(0), refreshing(false)
+{
+}
+
+ResponseCache::ResponseCache(size_t capacity) : _capacity(capacity), _bytes(0) {}
+
+ResponseCache::~ResponseCache() {}
+
+size_t ResponseCache::weight(const CachedResponse &entry)
+{
+	return entry.head->size() + entry.body->size();
+}
+
+/**
+ * lookup()
+ * Copies the entry out; a static one is returned as is, the caller checks
+ * its file. A CGI response is dropped once it is too stale to go out; a
+ * merely expired one is still returned.
+ */
+bool ResponseCache::lookup(const std::string &key, time_t now, CachedResponse &hit)
+{
+	ScopedLock lock(_mutex);
+	std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+	if (it == _index.end())
+		return false;
+
+	CachedResponse &entry = it->second->second;
+	if (entry.path.empty() && now >= entry.staleUntil)
+	{
+		evict(it);
+		return false;
+	}
+	_entries.splice(_entries.begin(), _entries, it->second);
+	hit = entry;
+	return true;
+}
+
+void ResponseCache::store(const std::string &key, const CachedResponse &entry)
+{
+	size_t size = weight(entry);
+	if (size > _capacity)
+		return;
+	ScopedLock lock(_mutex);
+	std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+	if (it != _index.end())
+		evict(it);
+	while (_bytes + size > _capacity && !_entries.empty())
+		evict(_index.find(_entries.back().first));
+
+	_entries.push_front(std::make_pair(key, entry));
+	_index[key] = _entries.begin();
+	_bytes += size;
+}
+
+void ResponseCache::remove(const std::string &key)
+{
+	ScopedLock lock(_mutex);
+	std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+	if (it != _index.end())
+		evict(it);
+}
+
+// True for the one request that gets to refresh an expired entry
+bool ResponseCache::startRefresh(const std::string &key)
+{
+	ScopedLock lock(_mutex);
+	std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+	if (it == _index.end() || it->second->second.refreshing)
+		return false;
+	it->second->second.refreshing = true;
+	return true;
+}
+
+// The refresh failed (or gave nothing to cache): the next request tries again
+void ResponseCache::endRefresh(const std::string &key)
+{
+	ScopedLock lock(_mutex);
+	std::map<std::string, Entries::iterator>::iterator it = _index.find(key);
+	if (it != _index.end())
+		it->second->second.refreshing = false;
+}
+
+size_t ResponseCache::capacity() const
+{
+	return _capacity;
+}
+
+// Responses already queued keep their buffers alive until they are sent
+void ResponseCache::evict(std::map<std::string, Entries::iterator>::iterator it)
+{
+	_bytes -= weight(it->second->second);
+	_entries.erase(it->second);
+	_index.erase(it);
+}
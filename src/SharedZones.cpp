@@ -0,0 +1,136 @@
+#include "SharedZones.hpp"
+#include <stdint.h>
+#include <unistd.h>
+
+SharedZones::SharedZones() {}
+
+SharedZones::~SharedZones()
+{
+	for (std::map<std::string, ResponseCache *>::iterator it = _staticCaches.begin();
+		 it != _staticCaches.end(); ++it)
+		delete it->second;
+	for (std::map<std::string, ResponseCache *>::iterator it = _cgiCaches.begin();
+		 it != _cgiCaches.end(); ++it)
+		delete it->second;
+	for (std::map<std::string, OpenFileCache *>::iterator it = _openFileCaches.begin();
+		 it != _openFileCaches.end(); ++it)
+		delete it->second;
+}
+
+ResponseCache *SharedZones::staticCache(const std::string &zone, size_t capacity)
+{
+	ScopedLock lock(_mutex);
+	ResponseCache *&cache = _staticCaches[zone];
+	if (!cache)
+		cache = new ResponseCache(capacity);
+	return cache;
+}
+
+ResponseCache *SharedZones::cgiCache(const std::string &zone, size_t capacity)
+{
+	ScopedLock lock(_mutex);
+	ResponseCache *&cache = _cgiCaches[zone];
+	if (!cache)
+		cache = new ResponseCache(capacity);
+	return cache;
+}
+
+OpenFileCache *SharedZones::openFileCache(const std::string &zone, size_t max, int inactive,
+										  int valid, bool errors)
+{
+	ScopedLock lock(_mutex);
+	OpenFileCache *&cache = _openFileCaches[zone];
+	if (!cache)
+		cache = new OpenFileCache(max, inactive, valid, errors);
+	return cache;
+}
+
+/**
+ * takeCgiSlot()
+ * Takes one of the location's max slots if one is free. A new request
+ * (not queued) only gets it when no request waits in any loop; a queued
+ * one leaves the queue count with it. Otherwise wakeFd (if any) is told
+ * when a slot is given back.
+ */
+bool SharedZones::takeCgiSlot(const std::string &location, size_t max, bool queued, int wakeFd)
+{
+	ScopedLock lock(_mutex);
+	CgiSlots &slots = _cgiSlots[location];
+	if (slots.running < max && (queued || slots.queued == 0))
+	{
+		slots.running++;
+		if (queued)
+			slots.queued--;
+		return true;
+	}
+	if (wakeFd >= 0)
+		slots.waiters.insert(wakeFd);
+	return false;
+}
+
+// A request waits for a slot, unless queueSize of them already do
+bool SharedZones::queueCgi(const std::string &location, size_t queueSize)
+{
+	ScopedLock lock(_mutex);
+	CgiSlots &slots = _cgiSlots[location];
+	if (slots.queued >= queueSize)
+		return false;
+	slots.queued++;
+	return true;
+}
+
+// A queued request went away before it got a slot
+void SharedZones::dequeueCgi(const std::string &location)
+{
+	ScopedLock lock(_mutex);
+	_cgiSlots[location].queued--;
+}
+
+// A script was reaped (or could not be forked): the loops waiting are woken
+void SharedZones::releaseCgiSlot(const std::string &location)
+{
+	ScopedLock lock(_mutex);
+	CgiSlots &slots = _cgiSlots[location];
+	slots.running--;
+	wake(slots.waiters);
+}
+
+/**
+ * lockCgiCache()
+ * cgi_cache_lock: true if the caller is to run the script for the key,
+ * holding its lock until unlockCgiCache(). Else another request already
+ * does; wakeFd is told when it is done.
+ */
+bool SharedZones::lockCgiCache(const std::string &key, int wakeFd)
+{
+	ScopedLock lock(_mutex);
+	std::map<std::string, std::set<int> >::iterator it = _cacheLocks.find(key);
+	if (it == _cacheLocks.end())
+	{
+		_cacheLocks[key];
+		return true;
+	}
+	it->second.insert(wakeFd);
+	return false;
+}
+
+// The response for the key is cached (or will not be): the waiting loops are woken
+void SharedZones::unlockCgiCache(const std::string &key)
+{
+	ScopedLock lock(_mutex);
+	std::map<std::string, std::set<int> >::iterator it = _cacheLocks.find(key);
+	if (it == _cacheLocks.end())
+		return;
+	wake(it->second);
+	_cacheLocks.erase(it);
+}
+
+// Called under the lock; a write can only fail when the counter is full,
+// that loop is woken anyway
+void SharedZones::wake(std::set<int> &waiters)
+{
+	uint64_t one = 1;
+	for (std::set<int>::iterator it = waiters.begin(); it != waiters.end(); ++it)
+		write(*it, &one, sizeof(one));
+	waiters.clear();
+}
@@ -0,0 +1,87 @@
+#include "TimerQueue.hpp"
+
+TimerQueue::TimerQueue() : _generation(0) {}
+
+TimerQueue::~TimerQueue() {}
+
+void TimerQueue::push(int fd, Record &rec, time_t deadline)
+{
+	TimerEntry entry;
+	entry.deadline = deadline;
+	entry.fd = fd;
+	entry.generation = ++_generation;
+	rec.deadline = deadline;
+	rec.queued = deadline;
+	rec.generation = entry.generation;
+	_heap.push(entry);
+}
+
+void TimerQueue::schedule(int fd, time_t deadline)
+{
+	std::map<int, Record>::iterator it = _records.find(fd);
+	if (it == _records.end())
+	{
+		Record &rec = _records[fd];
+		push(fd, rec, deadline);
+		return;
+	}
+	// The live entry fires first anyway - it will be re-queued at the new deadline
+	if (it->second.queued <= deadline)
+		it->second.deadline = deadline;
+	else
+		push(fd, it->second, deadline);
+}
+
+void TimerQueue::cancel(int fd)
+{
+	_records.erase(fd);
+}
+
+/**
+ * popExpired()
+ * Returns (through fd) one connection whose deadline has passed, skipping
+ * stale heap entries. Returns false once nothing else is due.
+ */
+bool TimerQueue::popExpired(time_t now, int &fd)
+{
+	while (!_heap.empty() && _heap.top().deadline <= now)
+	{
+		TimerEntry entry = _heap.top();
+		_heap.pop();
+
+		std::map<int, Record>::iterator it = _records.find(entry.fd);
+		if (it == _records.end() || it->second.generation != entry.generation)
+			continue; // cancelled or superseded
+		if (it->second.deadline > now)
+		{
+			// Pushed back since this entry was queued
+			push(entry.fd, it->second, it->second.deadline);
+			continue;
+		}
+		fd = entry.fd;
+		_records.erase(it);
+		return true;
+	}
+	return false;
+}
+
+int TimerQueue::msUntilNext(time_t now, int maxMs)
+{
+	// Drop stale entries so they don't wake the loop for nothing
+	while (!_heap.empty())
+	{
+		const TimerEntry &top = _heap.top();
+		std::map<int, Record>::iterator it = _records.find(top.fd);
+		if (it != _records.end() && it->second.generation == top.generation)
+			break;
+		_heap.pop();
+	}
+	if (_heap.empty())
+		return maxMs;
+	time_t left = _heap.top().deadline - now;
+	if (left <= 0)
+		return 0;
+	if (left >= maxMs / 1000)
+		return maxMs;
+	return static_cast<int>(left * 1000);
+}
@@ -3,15 +3,25 @@
 #include "HttpResponse.hpp"
 #include "Responder.hpp"
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <cerrno>
 #include <cstring>
 #include <signal.h>
+#include <sstream>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <fcntl.h>
 
 
 extern volatile sig_atomic_t stop_flag;
+extern bool print_stats;
 
 #define MAX_EVENTS 1000
-#define EPOLL_TIMEOUT 1000
+// How long the kernel holds a deferred connection waiting for its first bytes
+#define TCP_DEFER_ACCEPT_SECONDS 10
 
 
 std::string extractHostWithoutPort(const std::string &host)
@@ -26,16 +36,90 @@ std::string extractHostWithoutPort(const std::string &host)
 
 WebServ::~WebServ()
 {
-    for (std::vector<int>::iterator it = _listenSockets.begin(); it != _listenSockets.end(); ++it)
+    for (size_t i = 0; i < _listeners.size(); i++)
     {
-        close(*it);
+        close(_listeners[i]->fd);
+        delete _listeners[i];
     }
-    close(_epoll_fd);
+    for (size_t i = 0; i < _connections.size(); i++)
+    {
+        if (_connections[i])
+        {
+            close(_connections[i]->fd);
+            for (size_t j = 0; j < _connections[i]->cgis.size(); j++)
+                delete _connections[i]->cgis[j];
+            delete _connections[i];
+        }
+    }
+    releaseClosedConnections();
+    // Still running: killed and waited for by their destructor
+    for (size_t i = 0; i < _closedCgis.size(); i++)
+        delete _closedCgis[i];
+    for (std::map<std::pair<std::string, size_t>, FastCgiUpstream *>::iterator it
+             = _upstreams.begin(); it != _upstreams.end(); ++it)
+    {
+        std::list<FastCgiConnection *> &connections = it->second->connections;
+        for (std::list<FastCgiConnection *>::iterator c = connections.begin();
+             c != connections.end(); ++c)
+            delete *c;
+        delete it->second;
+    }
+    for (size_t i = 0; i < _closedUpstreams.size(); i++)
+        delete _closedUpstreams[i];
+    for (std::map<std::pair<std::string, std::string>, CgiPool *>::iterator it = _pools.begin();
+         it != _pools.end(); ++it)
+    {
+        std::list<CgiProcess *> &workers = it->second->workers;
+        for (std::list<CgiProcess *>::iterator w = workers.begin(); w != workers.end(); ++w)
+            delete *w;
+        delete it->second;
+    }
+    // Still referenced by io_uring operations, which die with the ring
+    for (size_t i = 0; i < _closedConnections.size(); i++)
+        delete _closedConnections[i];
+    for (size_t i = 0; i < _freeConnections.size(); i++)
+        delete _freeConnections[i];
+    if (_wake.fd != -1)
+        close(_wake.fd);
+    if (_epoll_fd != -1)
+        close(_epoll_fd);
 }
 
 void WebServ::start()
 {
+#ifdef WEBSERV_IO_URING
+    uringLoop();
+#else
     mainLoop();
+#endif
+    if (print_stats)
+        printStats();
+}
+
+/**
+ * printStats()
+ * Benchmark mode summary of this event loop: how often it woke up, how
+ * many system calls it needed for the requests it answered and the CPU
+ * time it used (its scripts' not included).
+ */
+void WebServ::printStats()
+{
+#ifdef WEBSERV_IO_URING
+    const char *backend = "io_uring";
+    _syscalls += _ring.enterCalls();
+#else
+    const char *backend = "epoll";
+#endif
+    std::ostringstream out;
+    out << "stats " << getpid() << ": backend=" << backend << " wakeups=" << _wakeups
+        << " syscalls=" << _syscalls << " requests=" << _requests;
+    if (_requests)
+        out << " syscalls/request=" << static_cast<double>(_syscalls) / _requests;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        out << " cpu=" << usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                          + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6 << "s";
+    std::cerr << out.str() << std::endl;
 }
 
 const ServerConfig &WebServ::chooseServer(const std::vector<ServerConfig> &serversVec, 
@@ -56,7 +140,8 @@ const ServerConfig &WebServ::chooseServer(const std::vector<ServerConfig> &serve
     return serversVec[0];
 }
 
-WebServ::WebServ(const std::vector<ServerConfig> &configs)
+WebServ::WebServ(const std::vector<ServerConfig> &configs, SharedZones &zones, bool reusePort)
+    : _zones(zones), _now(time(NULL)), _epoll_fd(-1), _reusePort(reusePort), _wakeups(0), _syscalls(0), _requests(0)
 {
     for (size_t i = 0; i < configs.size(); i++)
     {
@@ -65,14 +150,28 @@ WebServ::WebServ(const std::vector<ServerConfig> &configs)
         std::pair<std::string,int> key = std::make_pair(host, port);
         serverGroups[key].push_back(configs[i]);
     }
+    _wake.type = POLL_WAKE;
+    _wake.fd = -1;
     initSockets();
 }
 
 void WebServ::initSockets()
 {
+#ifndef WEBSERV_IO_URING
     _epoll_fd = epoll_create1(0);
     if (_epoll_fd == -1)
         throw std::runtime_error("epoll_create1 failed");
+#endif
+    _wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wake.fd == -1)
+        throw std::runtime_error("eventfd failed");
+#ifndef WEBSERV_IO_URING
+    struct epoll_event wakeEvent;
+    wakeEvent.events = EPOLLIN;
+    wakeEvent.data.ptr = &_wake;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake.fd, &wakeEvent) == -1)
+        throw std::runtime_error("epoll_ctl eventfd failed");
+#endif
 
     // Check all servers and create listen sockets for each unique host:port pair
     for (std::map< std::pair<std::string,int>, std::vector<ServerConfig> >::iterator it = serverGroups.begin();
@@ -81,7 +180,16 @@ void WebServ::initSockets()
         std::string host = it->first.first;
         int port = it->first.second;
 
-        int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        // Servers sharing the socket share its options: keep the most generous
+        int backlog = 0;
+        bool deferAccept = false;
+        for (size_t i = 0; i < it->second.size(); i++)
+        {
+            backlog = std::max(backlog, it->second[i].backlog);
+            deferAccept = deferAccept || it->second[i].defer_accept;
+        }
+
+        int listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if (listenSocket == -1)
             throw std::runtime_error("Error creating socket");
 
@@ -92,7 +200,22 @@ void WebServ::initSockets()
             throw std::runtime_error("Error setting socket options");
         }
 
-        fcntl(listenSocket, F_SETFL, O_NONBLOCK);
+        // Each worker process binds its own socket to the same address,
+        // the kernel then balances incoming connections between them
+        if (_reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        {
+            close(listenSocket);
+            throw std::runtime_error("Error setting SO_REUSEPORT");
+        }
+
+        // Only wake us up once the client has actually sent something
+        int deferSeconds = TCP_DEFER_ACCEPT_SECONDS;
+        if (deferAccept && setsockopt(listenSocket, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                      &deferSeconds, sizeof(deferSeconds)) < 0)
+        {
+            close(listenSocket);
+            throw std::runtime_error("Error setting TCP_DEFER_ACCEPT");
+        }
 
         struct sockaddr_in addr;
         memset(&addr, 0, sizeof(addr));
@@ -106,237 +229,1881 @@ void WebServ::initSockets()
             throw std::runtime_error("Error binding socket");
         }
 
-        if (listen(listenSocket, 32) < 0)
+        if (listen(listenSocket, backlog) < 0)
         {
             close(listenSocket);
             throw std::runtime_error("Error listening on socket");
         }
 
+        Listener *listener = new Listener();
+        listener->type = POLL_LISTENER;
+        listener->fd = listenSocket;
+        listener->servers = it->second;
+
+        // Every loop names a location's cgi_max_concurrent slots the same way
+        for (size_t i = 0; i < listener->servers.size(); i++)
+        {
+            const std::vector<LocationConfig> &locations = listener->servers[i].locations;
+            for (size_t j = 0; j < locations.size(); j++)
+            {
+                if (!locations[j].cgi_max_concurrent)
+                    continue;
+                std::ostringstream slots;
+                slots << host << ":" << port << "/" << i << "/" << j;
+                _cgiLimits[&locations[j]].slots = slots.str();
+            }
+        }
+
+#ifndef WEBSERV_IO_URING
         struct epoll_event event;
         event.events = EPOLLIN;
-        event.data.fd = listenSocket;
+        event.data.ptr = listener;
         if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, listenSocket, &event) == -1)
         {
             close(listenSocket);
+            delete listener;
             throw std::runtime_error("epoll_ctl listen failed");
         }
+#endif
 
-        _listenSockets.push_back(listenSocket);
-        _serversForSocket[listenSocket] = it->second;
+        _listeners.push_back(listener);
     }
 }
 
 void WebServ::mainLoop()
 {
-    Responder responder;
+    Responder responder(_zones);
     struct epoll_event events[MAX_EVENTS];
 
+    startCgiPools();
+
     // Main loop of the server - wait for events and handle them
     while (!stop_flag)
     {
-        int num_events = epoll_wait(_epoll_fd, events, MAX_EVENTS, EPOLL_TIMEOUT);
+        // Sleep until the next connection deadline, but wake up regularly for stop_flag
+        int timeout = loopTimeout();
+        int num_events = epoll_wait(_epoll_fd, events, MAX_EVENTS, timeout);
+        _wakeups++;
+        _syscalls++;
+        // The clock is read once per iteration, every handler below uses _now
+        _now = time(NULL);
         if (num_events == -1 && errno != EINTR)
         {
             std::cerr << "epoll_wait error: " << strerror(errno) << std::endl;
             continue;
         }
 
-        checkTimeouts();
+        checkTimeouts(responder);
 
         for (int i = 0; i < num_events; ++i)
         {
-            int fd = events[i].data.fd;
+            Pollable *source = static_cast<Pollable *>(events[i].data.ptr);
             uint32_t event_mask = events[i].events;
 
-            // Check if the event is on a listen socket or a client socket
-            bool isListenSocket = false;
-            for (std::vector<int>::iterator it = _listenSockets.begin(); it != _listenSockets.end(); ++it)
+            if (source->type == POLL_LISTENER)
             {
-                if (*it == fd)
-                {
-                    isListenSocket = true;
-                    break;
-                }
+                acceptNewConnection(*static_cast<Listener *>(source));
+                continue;
             }
-            if (isListenSocket)
+            if (source->type == POLL_FASTCGI)
             {
-                acceptNewConnection(fd);
+                handleFastCgiEvent(*static_cast<FastCgiConnection *>(source), responder);
+                continue;
             }
-            else
+            if (source->type == POLL_WAKE)
             {
-                if (event_mask & EPOLLIN)
-                {
-                    handleClientRead(fd, responder);
-                }
-                if (event_mask & EPOLLOUT)
-                {
-                    handleClientWrite(fd);
-                }
-                if (event_mask & (EPOLLERR | EPOLLHUP))
-                {
-                    closeClient(fd);
-                }
+                handleWake(responder);
+                continue;
             }
+            if (source->type != POLL_CLIENT)
+            {
+                handleCgiEvent(*static_cast<CgiPipe *>(source), responder);
+                continue;
+            }
+
+            Connection &conn = *static_cast<Connection *>(source);
+            // Closed by an earlier event of this batch
+            if (conn.fd < 0)
+                continue;
+            if (event_mask & EPOLLIN)
+                handleClientRead(conn, responder);
+            if (conn.fd >= 0 && (event_mask & EPOLLOUT))
+                handleClientWrite(conn);
+            if (conn.fd >= 0 && (event_mask & (EPOLLERR | EPOLLHUP)))
+                closeClient(conn);
         }
+        releaseClosedConnections();
     }
 }
 
-void WebServ::handleClientRead(int fd, Responder &responder)
+void WebServ::handleClientRead(Connection &conn, Responder &responder)
 {
     char buffer[4096];
-    ssize_t bytes_read;
+    bool eof = false;
+    bool failed = false;
 
-    while ((bytes_read = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+    // While the last accepted request asked to close, ignore anything else the client sends
+    while (conn.keepAlive)
     {
-        _lastActivity[fd] = time(NULL);
+        ssize_t bytes_read = recv(conn.fd, buffer, sizeof(buffer), 0);
+        _syscalls++;
+        if (bytes_read == 0)
+            eof = true;
+        else if (bytes_read < 0)
+            failed = (errno != EAGAIN);
+        if (bytes_read <= 0)
+            break;
+        feedParser(conn, std::string(buffer, bytes_read));
+        processRequests(conn, responder);
 
-        HttpParser &parser = _parsers[fd];
-        _parsers[fd].appendData(std::string(buffer, bytes_read));
+        // Enough pipelined responses waiting (or requests held back by a
+        // CGI) - let the client read them first, the rest stays in the
+        // socket until we go back to EPOLLIN
+        if (conn.queuedResponses + conn.requests.size() >= MAX_PIPELINED)
+            break;
+    }
+
+    if (eof)
+    {
+        // Client half-closed after sending its requests: answer them (a
+        // running script's too), then close
+        conn.keepAlive = false;
+        failed = !conn.cgi && conn.requests.empty() && conn.output.empty();
+    }
+    if (failed)
+    {
+        closeClient(conn);
+        return;
+    }
+
+    armTimer(conn);
+    if (!conn.output.empty())
+    {
+        struct epoll_event event;
+        event.events = EPOLLOUT | EPOLLET;
+        event.data.ptr = &conn;
+        epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+        _syscalls++;
+    }
+}
+
+/**
+ * feedParser()
+ * Pushes received bytes into the connection's parser. Every request completed
+ * by these bytes is moved to the request queue, and what follows it seeds a
+ * fresh parser, so several pipelined requests can come out of one recv().
+ */
+void WebServ::feedParser(Connection &conn, const std::string &data)
+{
+    std::string chunk = data;
+
+    while (conn.keepAlive)
+    {
+        HttpParser &parser = conn.parser;
+        parser.appendData(chunk);
 
         if (parser.headersComplete() && !parser.serverSelected())
         {
             std::string hostHeader = parser.getHeader("Host");
             std::string hostOnly = extractHostWithoutPort(hostHeader);
-            const std::vector<ServerConfig> &sv = *(_clientToServers[fd]);
-            const ServerConfig &chosen = chooseServer(sv, hostOnly);
+            const ServerConfig &chosen = chooseServer(*conn.servers, hostOnly);
             parser.setChosenServer(chosen);
             parser.setServerSelected(true);
+            conn.server = &chosen;
+        }
+
+        if (parser.hasError())
+        {
+            // The rest of a malformed request can't be trusted - close after the error
+            PendingRequest req;
+            req.parser = parser;
+            req.keepAlive = false;
+            req.number = ++conn.requestCount;
+            conn.requests.push_back(req);
+            conn.keepAlive = false;
+            return;
         }
 
+        if (!parser.isComplete())
+            return;
+
+        const ServerConfig *srv = parser.getChosenServer();
+        PendingRequest req;
+        req.parser = parser;
+        req.number = ++conn.requestCount;
+        req.keepAlive = shouldKeepAlive(conn, parser, *srv);
+        conn.keepAlive = req.keepAlive;
+        conn.requests.push_back(req);
+
+        chunk = parser.takeRemainder();
+        parser = HttpParser();
+        if (chunk.empty())
+            return;
+    }
+}
+
+// What a request gets when its script can't be started (startCgi's status)
+static HttpResponse cgiErrorResponse(Responder &responder, int status, const ServerConfig &srv)
+{
+    if (status == 503)
+        return responder.makeErrorResponse(503, "Service Unavailable", srv,
+            "Service Unavailable\n");
+    if (status == 502)
+        return responder.makeErrorResponse(502, "Bad Gateway", srv, "Bad Gateway\n");
+    return responder.makeErrorResponse(500, "Internal Server Error", srv,
+        "Internal Server Error\n");
+}
+
+/**
+ * processRequests()
+ * Answers the queued requests in arrival order. A request answered by a CGI
+ * script stops the loop: the requests behind it wait until the script's
+ * response is queued (cgiRespond), so responses never overtake each other.
+ */
+void WebServ::processRequests(Connection &conn, Responder &responder)
+{
+    while (!conn.requests.empty() && !conn.cgi)
+    {
+        PendingRequest &req = conn.requests.front();
+        const HttpParser &parser = req.parser;
+        const ServerConfig *srv = parser.serverIsChosen() ? parser.getChosenServer() : NULL;
+        ServerConfig dummy; // temporary object
+        HttpResponse resp;
+
         if (parser.hasError())
         {
-            const ServerConfig *srv = parser.serverIsChosen() ? parser.getChosenServer() : NULL;
-            HttpResponse resp;
             if (parser.getErrorCode() == ERR_413)
+                resp = responder.makeErrorResponse(413, "Payload Too Large", srv ? *srv : dummy,
+                    "Request Entity Too Large\n");
+            else
+                resp = responder.makeErrorResponse(400, "Bad Request", srv ? *srv : dummy,
+                    "Bad Request\n");
+        }
+        else
+        {
+            resp = responder.handleRequest(parser, *srv);
+            if (resp.getCgi() && resp.getCgi()->refresh)
+            {
+                // A stale cache hit goes out, its script runs in the background
+                refreshCgi(resp.getCgi());
+                resp.setCgi(NULL);
+            }
+            else if (resp.getCgi())
             {
-                if (srv)
-                    resp = responder.makeErrorResponse(413, "Payload Too Large", *srv,
-                        "Request Entity Too Large\n");
-                else {
-                    ServerConfig dummy; // temporary object
-                    resp = responder.makeErrorResponse(413, "Payload Too Large", dummy,
-                        "Request Entity Too Large\n");
+                CgiProcess *cgi = resp.getCgi();
+                cgi->response = resp;
+                if (cgi->cache)
+                {
+                    // The session cookie is this client's, not the cached response's
+                    cgi->sessionCookie = resp.getHeader("Set-Cookie");
+                    cgi->response.removeHeader("Set-Cookie");
+                }
+                if (cgi->lockTimeout && !_zones.lockCgiCache(cgi->cacheKey, _wake.fd))
+                {
+                    // Another request already runs the script for this key
+                    cgi->conn = &conn;
+                    conn.cgi = cgi;
+                    conn.cgis.push_back(cgi);
+                    cgi->lockUntil = _now + cgi->lockTimeout;
+                    waitCgiLock(*cgi);
+                    return;
                 }
+                cgi->lockHeld = cgi->lockTimeout != 0;
+                int status = startCgi(conn, cgi, responder);
+                if (!status)
+                    return;
+                resp = cgiErrorResponse(responder, status, *srv);
             }
+            responder.compressResponse(parser, *srv, resp);
+        }
+        queueResponse(conn, resp);
+    }
+}
+
+/**
+ * queueResponse()
+ * Appends the response to the request at the front of the queue to the
+ * connection's output, and drops that request: the head, then the body
+ * (string, file range or body source) as separate segments. Cached
+ * responses share their buffers with the cache.
+ */
+void WebServ::queueResponse(Connection &conn, HttpResponse &resp)
+{
+    PendingRequest &req = conn.requests.front();
+    const HttpParser &parser = req.parser;
+    const ServerConfig *srv = parser.serverIsChosen() ? parser.getChosenServer() : NULL;
+
+    // Chunks are HTTP/1.1: older clients get a streamed body delimited
+    // by the close, and nothing pipelined after it can be answered
+    bool closeDelimited = resp.isChunked() && parser.getVersion() != "HTTP/1.1";
+    if (closeDelimited)
+    {
+        resp.setCloseDelimited();
+        req.keepAlive = false;
+        conn.keepAlive = false;
+    }
+
+    if (req.keepAlive)
+    {
+        std::ostringstream ka;
+        ka << "timeout=" << srv->keepalive_timeout << ", max="
+           << (srv->keepalive_requests - req.number);
+        resp.setHeader("Connection", "keep-alive");
+        resp.setHeader("Keep-Alive", ka.str());
+    }
+    else
+        resp.setHeader("Connection", "close");
+
+    if (resp.isShared())
+    {
+        // Cache hit: the cached head and body are queued, not copied
+        bool body = !resp.getSharedBody()->empty();
+        conn.queueShared(resp.getSharedHead(), false);
+        conn.queueOutput(resp.headString(), !body);
+        if (body)
+            conn.queueShared(resp.getSharedBody(), true);
+    }
+    else if (resp.getBodySource().get())
+    {
+        // Streamed body: pulled from its source as the socket drains
+        conn.queueOutput(resp.headString(), false);
+        conn.queueSource(resp.getBodySource(), resp.isChunked());
+    }
+    else if (!resp.getBodyParts().empty())
+    {
+        // multipart/byteranges: part headers from memory, ranges from the file
+        const std::vector<BodyPart> &parts = resp.getBodyParts();
+        conn.queueOutput(resp.headString(), false);
+        for (size_t i = 0; i < parts.size(); i++)
+        {
+            bool last = (i + 1 == parts.size());
+            if (parts[i].fileLength > 0)
+                conn.queueFile(resp.getFile(), parts[i].fileOffset, parts[i].fileLength, last);
             else
+                conn.queueOutput(parts[i].data, last);
+        }
+    }
+    else
+    {
+        bool fileBody = resp.hasFileBody() && resp.getFileLength() > 0;
+        bool memoryBody = !resp.getBody().empty();
+        conn.queueOutput(resp.headString(), !fileBody && !memoryBody);
+        if (fileBody)
+            conn.queueFile(resp.getFile(), resp.getFileOffset(), resp.getFileLength(), true);
+        else if (memoryBody)
+            conn.queueOutput(resp.getBody(), true);
+    }
+    conn.requests.pop_front();
+    _requests++;
+    if (closeDelimited)
+        conn.requests.clear();
+}
+
+/**
+ * wakeClient()
+ * Output was queued (or a waiting body source fed) outside of the client's
+ * own events: get the connection writing again.
+ */
+void WebServ::wakeClient(Connection &conn)
+{
+#ifdef WEBSERV_IO_URING
+    uringSend(conn);
+#else
+    // Edge-triggered: re-registering reports a writable socket once more
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLET;
+    event.data.ptr = &conn;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+    _syscalls++;
+#endif
+}
+
+/**
+ * handleClientWrite()
+ * Edge-triggered: keeps writing until the output is empty or the socket is
+ * full. In-memory segments leave together through writev(), file ranges
+ * through sendfile(), a script's stdout through splice(); other body
+ * sources are pulled a chunk at a time as they reach the front, a source
+ * with nothing yet (CGI) leaving the connection waiting for wakeClient().
+ * Progress is only an offset into the front segment.
+ */
+void WebServ::handleClientWrite(Connection &conn)
+{
+    ssize_t sent = 0;
+
+    while (!conn.output.empty())
+    {
+        OutputSegment &front = conn.output.front();
+        size_t max = OUTPUT_SPLICE_SIZE;
+        int pipe = -1;
+        if (front.source.get() && !front.chunked)
+            pipe = front.source->splicePipe(max);
+        if (pipe >= 0)
+        {
+            sent = spliceSource(conn, pipe, max);
+            if (sent < 0)
+                break;
+            continue;
+        }
+        if (front.source.get())
+        {
+            PullResult pulled = conn.pullSource();
+            if (pulled == PULL_ERROR)
             {
-                if (srv)
-                    resp = responder.makeErrorResponse(400, "Bad Request", *srv,
-                        "Bad Request\n");
-                else {
-                    ServerConfig dummy;
-                    resp = responder.makeErrorResponse(400, "Bad Request", dummy,
-                        "Bad Request\n");
-                }
+                closeClient(conn);
+                return;
+            }
+            if (pulled == PULL_WAIT)
+                break;
+            continue;
+        }
+        if (conn.output.front().file.isOpen())
+            sent = sendFile(conn.fd, conn.output.front(), conn.outputSent);
+        else
+        {
+            struct iovec iov[OUTPUT_IOV_MAX];
+            size_t count = conn.gatherOutput(iov, OUTPUT_IOV_MAX);
+            sent = writev(conn.fd, iov, count);
+            _syscalls++;
+        }
+        if (sent <= 0)
+            break;
+        conn.consumeOutput(sent);
+    }
+    resumeCgiOutput(conn);
+
+    if (conn.output.empty() && conn.cgi)
+    {
+        // Everything before the CGI response is out, it comes later
+        armTimer(conn);
+    }
+    else if (conn.output.empty())
+    {
+        if (conn.keepAlive)
+            resetClient(conn);
+        else
+            closeClient(conn);
+    }
+    else if (!conn.sourceWait && sent == -1 && errno != EAGAIN)
+    {
+        closeClient(conn);
+    }
+    else
+    {
+        // Made progress - the send timeout restarts
+        armTimer(conn);
+    }
+}
+
+/**
+ * sendFile()
+ * Sends the rest of a file segment, the first done bytes being already out,
+ * with sendfile(): the kernel copies from the page cache to the socket, the
+ * file is never read here.
+ */
+ssize_t WebServ::sendFile(int fd, const OutputSegment &segment, size_t done)
+{
+    off_t offset = segment.fileOffset + done;
+    ssize_t sent = sendfile(fd, segment.file.fd(), &offset, segment.fileLength - done);
+    _syscalls++;
+    if (sent == 0)
+    {
+        // The file shrank after its Content-Length went out: can't complete it
+        errno = EIO;
+        return -1;
+    }
+    return sent;
+}
+
+/**
+ * spliceSource()
+ * The front body source is a script's stdout: splice() moves what the pipe
+ * holds to the socket inside the kernel. An empty pipe fails with EAGAIN
+ * like a full socket, but sets sourceWait: the script's next output wakes
+ * the connection. 0 once the script closed its stdout.
+ */
+ssize_t WebServ::spliceSource(Connection &conn, int pipe, size_t max)
+{
+    ssize_t sent = splice(pipe, NULL, conn.fd, NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    _syscalls++;
+    conn.sourceWait = false;
+    if (sent >= 0)
+        conn.output.front().source->spliced(sent);
+    else if (errno == EAGAIN)
+    {
+        int queued = 0;
+        ioctl(pipe, FIONREAD, &queued);
+        _syscalls++;
+        conn.sourceWait = (queued == 0);
+#ifndef WEBSERV_IO_URING
+        // Or the script wrote in between: a socket with room reports it again
+        if (!conn.sourceWait)
+            wakeClient(conn);
+#endif
+        errno = EAGAIN;
+    }
+    return sent;
+}
+
+/**
+ * closeClient()
+ * The Connection object itself is only recycled once the current epoll batch
+ * is over (releaseClosedConnections), other events may still point to it.
+ */
+void WebServ::closeClient(Connection &conn)
+{
+#ifdef WEBSERV_IO_URING
+    uringClose(conn.fd);
+#else
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, conn.fd, NULL);
+    close(conn.fd);
+    _syscalls += 2;
+#endif
+    detachClient(conn);
+}
+
+// Forgets a connection whose socket is closed or about to be
+void WebServ::detachClient(Connection &conn)
+{
+    abortCgis(conn);
+    _timers.cancel(conn.fd);
+    _connections[conn.fd] = NULL;
+    conn.fd = -1;
+    _closedConnections.push_back(&conn);
+}
+
+void WebServ::releaseClosedConnections()
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < _closedConnections.size(); i++)
+    {
+        Connection *conn = _closedConnections[i];
+        // The kernel may still read a response buffer or post a completion
+        if (!conn->idle())
+        {
+            _closedConnections[kept++] = conn;
+            continue;
+        }
+        // Drop buffered data now rather than when the object is reused
+        conn->requests.clear();
+        conn->output.clear();
+        conn->parser = HttpParser();
+        _freeConnections.push_back(conn);
+    }
+    _closedConnections.resize(kept);
+
+    kept = 0;
+    for (size_t i = 0; i < _closedCgis.size(); i++)
+    {
+        CgiProcess *cgi = _closedCgis[i];
+        // Not reaped yet (its pidfd will tell), a poll still in flight, or
+        // a cache refresh still running
+        if (!cgi->idle() || cgi->refresh || (!cgi->exited && cgi->exitWatch.fd >= 0))
+        {
+            _closedCgis[kept++] = cgi;
+            continue;
+        }
+        // Without a pidfd it is reaped right here; its slot is taken again
+        // by the next request for the location
+        releaseCgiSlot(*cgi);
+        cancelCgiTimeout(*cgi);
+        _unreapedCgis.erase(cgi->pid);
+        delete cgi;
+    }
+    _closedCgis.resize(kept);
+
+    kept = 0;
+    for (size_t i = 0; i < _closedUpstreams.size(); i++)
+    {
+        if (!_closedUpstreams[i]->idle())
+            _closedUpstreams[kept++] = _closedUpstreams[i];
+        else
+            delete _closedUpstreams[i];
+    }
+    _closedUpstreams.resize(kept);
+}
+
+/**
+ * resetClient()
+ * Prepares a persistent connection for its next request once the queued
+ * responses have been fully sent: idle keep-alive timer and back to waiting
+ * for input. The parser already holds any bytes of the next request.
+ */
+void WebServ::resetClient(Connection &conn)
+{
+    armTimer(conn);
+
+#ifdef WEBSERV_IO_URING
+    // The multishot recv stays armed, unless pipelining paused it
+    if (conn.readPaused)
+    {
+        conn.readPaused = false;
+        if (!conn.recvArmed)
+            uringRecvArm(conn);
+    }
+#else
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &conn;
+    _syscalls++;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn.fd, &event) == -1)
+        closeClient(conn);
+#endif
+}
+
+/**
+ * shouldKeepAlive()
+ * HTTP/1.1 connections persist unless the client sends "Connection: close",
+ * HTTP/1.0 ones only when it asks for "Connection: keep-alive".
+ * The server's keepalive_timeout / keepalive_requests can turn it off;
+ * the request numbered keepalive_requests is the last one on a connection.
+ */
+bool WebServ::shouldKeepAlive(const Connection &conn, const HttpParser &parser, const ServerConfig &srv)
+{
+    if (srv.keepalive_timeout <= 0 || srv.keepalive_requests == 0)
+        return false;
+    if (conn.requestCount >= srv.keepalive_requests)
+        return false;
+
+    std::string header = parser.getHeader("Connection");
+    std::transform(header.begin(), header.end(), header.begin(), ::tolower);
+    if (header.find("close") != std::string::npos)
+        return false;
+    if (parser.getVersion() == "HTTP/1.0")
+        return header.find("keep-alive") != std::string::npos;
+    return true;
+}
+
+/**
+ * acceptNewConnection()
+ * Drains the listen backlog in one go: accept4() until EAGAIN, the client
+ * socket already non-blocking and close-on-exec (CGI children must not
+ * inherit it).
+ */
+void WebServ::acceptNewConnection(Listener &listener)
+{
+    while (true)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept4(listener.fd, (struct sockaddr *)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        _syscalls++;
+
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                std::cerr << "accept error: " << strerror(errno) << std::endl;
             }
-            _writeBuffers[fd] = resp.toString();
-            struct epoll_event event;
-            event.events = EPOLLOUT | EPOLLET;
-            event.data.fd = fd;
-            epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &event);
             return;
         }
 
-        if (parser.isComplete())
+        Connection *conn = openConnection(client_fd, listener);
+
+        // Регистрируем клиентский сокет в epoll
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET; // Режим edge-triggered
+        event.data.ptr = conn;
+        _syscalls++;
+        if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1)
         {
-            const ServerConfig *srv = parser.getChosenServer();
-            HttpResponse resp = responder.handleRequest(_parsers[fd], *srv);
-            resp.setHeader("Connection", "close");
-            _writeBuffers[fd] = resp.toString();
+            std::cerr << "epoll_ctl client failed" << std::endl;
+            closeClient(*conn);
+        }
+    }
+}
+
+// Takes a (possibly recycled) Connection for a freshly accepted socket
+Connection *WebServ::openConnection(int clientFd, Listener &listener)
+{
+    Connection *conn;
+    if (_freeConnections.empty())
+        conn = new Connection();
+    else
+    {
+        conn = _freeConnections.back();
+        _freeConnections.pop_back();
+    }
+    conn->reset(clientFd, listener);
+
+    if (static_cast<size_t>(clientFd) >= _connections.size())
+        _connections.resize(clientFd + 1, NULL);
+    _connections[clientFd] = conn;
+    armTimer(*conn);
+    return conn;
+}
+
+/**
+ * armTimer()
+ * (Re)schedules the connection deadline for the phase it is in:
+ *  - client_header_timeout from the first byte of a request until its headers
+ *    are complete (further reads don't extend it)
+ *  - client_body_timeout between two reads of the body
+ *  - send_timeout between two writes while output is queued, or while a
+ *    CGI script has not answered yet
+ *  - keepalive_timeout while an idle persistent connection waits
+ */
+void WebServ::armTimer(Connection &conn)
+{
+    const ServerConfig &srv = *conn.server;
+    TimerPhase phase;
+    int seconds;
+
+    if (!conn.output.empty() || conn.cgi)
+    {
+        phase = TIMER_SEND;
+        seconds = srv.send_timeout;
+    }
+    else if (conn.parser.headersComplete())
+    {
+        phase = TIMER_BODY;
+        seconds = srv.client_body_timeout;
+    }
+    else if (conn.parser.hasStarted() || conn.requestCount == 0)
+    {
+        if (conn.timerPhase == TIMER_HEADER)
+            return;
+        phase = TIMER_HEADER;
+        seconds = srv.client_header_timeout;
+    }
+    else
+    {
+        phase = TIMER_KEEPALIVE;
+        seconds = srv.keepalive_timeout;
+    }
+    conn.timerPhase = phase;
+    _timers.schedule(conn.fd, _now + seconds);
+}
+
+// Milliseconds the loop may sleep: until the next deadline, at most EPOLL_TIMEOUT
+int WebServ::loopTimeout()
+{
+    int timeout = _cgiTimers.msUntilNext(_now, _timers.msUntilNext(_now, EPOLL_TIMEOUT));
+    timeout = _cacheLockTimers.msUntilNext(_now, timeout);
+    if (!_unreapedCgis.empty())
+        timeout = std::min(timeout, CGI_REAP_INTERVAL);
+    return timeout;
+}
+
+void WebServ::checkTimeouts(Responder &responder)
+{
+    int fd;
+    while (_timers.popExpired(_now, fd))
+    {
+        if (static_cast<size_t>(fd) < _connections.size() && _connections[fd])
+            closeClient(*_connections[fd]);
+    }
+    int pid;
+    while (_cgiTimers.popExpired(_now, pid))
+    {
+        std::map<pid_t, CgiProcess *>::iterator it = _timedCgis.find(pid);
+        if (it != _timedCgis.end())
+            cgiTimedOut(*it->second);
+    }
+    while (_cacheLockTimers.popExpired(_now, fd))
+    {
+        std::map<int, CgiProcess *>::iterator it = _lockedCgis.find(fd);
+        if (it != _lockedCgis.end())
+            cgiLockExpired(*it->second, responder);
+    }
+    reapCgis(responder);
+}
+
+/**
+ * reapCgis()
+ * Without a pidfd, a script that closed its stdout is polled for with
+ * waitpid(WNOHANG) on every iteration until it exits; then it moves on
+ * like handleCgiEvent() does after a pidfd event.
+ */
+void WebServ::reapCgis(Responder &responder)
+{
+    std::vector<CgiProcess *> unreaped;
+    for (std::map<pid_t, CgiProcess *>::iterator it = _unreapedCgis.begin();
+         it != _unreapedCgis.end(); ++it)
+        unreaped.push_back(it->second);
+    for (size_t i = 0; i < unreaped.size(); i++)
+    {
+        CgiProcess &cgi = *unreaped[i];
+        if (!cgi.reap())
+            continue;
+        _unreapedCgis.erase(cgi.pid);
+        cancelCgiTimeout(cgi);
+        cgiProgress(cgi, responder);
+        if (cgi.limit)
+        {
+            const LocationConfig &loc = *cgi.limit;
+            releaseCgiSlot(cgi);
+            startQueuedCgis(loc, responder);
+        }
+    }
+}
+
+/**
+ * cgiTimedOut()
+ * cgi_timeout: the script, and whatever it started, gets SIGTERM, then
+ * SIGKILL CGI_KILL_DELAY seconds later if it is still there. Its exit
+ * makes the response a 504; one already on its way ends with an error
+ * instead of passing for complete.
+ */
+void WebServ::cgiTimedOut(CgiProcess &cgi)
+{
+    if (cgi.timedOut)
+    {
+        cgi.signal(SIGKILL);
+        _timedCgis.erase(cgi.pid);
+        return;
+    }
+    std::cerr << "cgi " << cgi.script << ": still running after " << cgi.timeout
+              << "s, terminated" << std::endl;
+    cgi.timedOut = true;
+    if (!cgi.output->eof)
+        cgi.output->truncated = true;
+    cgi.signal(SIGTERM);
+    _cgiTimers.schedule(cgi.pid, _now + CGI_KILL_DELAY);
+}
+
+// The script is over (or its object about to go): no signal for its pid
+void WebServ::cancelCgiTimeout(CgiProcess &cgi)
+{
+    std::map<pid_t, CgiProcess *>::iterator it = _timedCgis.find(cgi.pid);
+    // The pid may already run another script, whose timer this is
+    if (it == _timedCgis.end() || it->second != &cgi)
+        return;
+    _timedCgis.erase(it);
+    _cgiTimers.cancel(cgi.pid);
+}
+/**
+ * startCgi()
+ * The request handler prepared a script: it is forked, and its stdin,
+ * stdout and pidfd join the event loop, tied to the connection, whose next
+ * responses now wait for it. 0 once on its way, else the status to answer
+ * with (submitCgi); the CgiProcess is then gone.
+ */
+int WebServ::startCgi(Connection &conn, CgiProcess *cgi, Responder &responder)
+{
+    int status = submitCgi(*cgi);
+    if (status)
+    {
+        unlockCgi(*cgi);
+        delete cgi;
+        return status;
+    }
+    cgi->conn = &conn;
+    conn.cgi = cgi;
+    conn.cgis.push_back(cgi);
+    // Queued while slots are free: one was given back without a pidfd, or
+    // the requests queued ahead in other loops took theirs since
+    if (cgi->limit && cgi->pid < 0)
+        startQueuedCgis(*cgi->limit, responder);
+    return 0;
+}
+
+/**
+ * refreshCgi()
+ * cgi_cache: a stale entry went out, the script runs again for no client
+ * to replace it. Until it is done it stays with the closed scripts.
+ */
+void WebServ::refreshCgi(CgiProcess *cgi)
+{
+    if (submitCgi(*cgi))
+    {
+        cgi->cache->endRefresh(cgi->cacheKey);
+        delete cgi;
+        return;
+    }
+    _closedCgis.push_back(cgi);
+}
+
+/**
+ * submitCgi()
+ * Forks the script, or lets it wait for a slot under cgi_max_concurrent. A
+ * fastcgi_pass request is sent to its server instead, and a cgi_pool_size
+ * one queued for a pool worker. 0 if that went well, else the status to
+ * answer with: 503 when the cgi_max_concurrent queue is full, 502 when
+ * the FastCGI server can't be used, 500 otherwise.
+ */
+int WebServ::submitCgi(CgiProcess &cgi)
+{
+    if (!cgi.fastcgiPass.empty())
+        return submitFastCgi(cgi) ? 0 : 502;
+    if (!cgi.poolScript.empty())
+        return submitCgiJob(cgi) ? 0 : 500;
+    if (cgi.limit)
+        return admitCgi(cgi);
+    return launchCgi(cgi) ? 0 : 500;
+}
+
+// Forks a prepared script and watches it, with its cgi_timeout; false if it can't
+bool WebServ::launchCgi(CgiProcess &cgi)
+{
+    if (!cgi.launch())
+    {
+        std::cerr << "cgi " << cgi.script << ": fork failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (!watchCgiProcess(cgi))
+        return false;
+    if (cgi.timeout > 0)
+    {
+        _timedCgis[cgi.pid] = &cgi;
+        _cgiTimers.schedule(cgi.pid, _now + cgi.timeout);
+    }
+    return true;
+}
+
+/**
+ * admitCgi()
+ * cgi_max_concurrent: the script is forked if its location has a slot free
+ * and no request waits for one, in any loop of the process; otherwise it
+ * queues behind them, unless cgi_queue_size of them already wait (503).
+ * 500 if it can't be forked.
+ */
+int WebServ::admitCgi(CgiProcess &cgi)
+{
+    const LocationConfig &loc = *cgi.limit;
+    CgiLimit &limit = _cgiLimits[&loc];
+    if (limit.queue.empty() && _zones.takeCgiSlot(limit.slots, loc.cgi_max_concurrent, false,
+                                                  _wake.fd))
+    {
+        if (launchCgi(cgi))
+            return 0;
+        _zones.releaseCgiSlot(limit.slots);
+        return 500;
+    }
+    if (!_zones.queueCgi(limit.slots, loc.cgi_queue_size))
+        return 503;
+    limit.queue.push_back(&cgi);
+    return 0;
+}
 
-            struct epoll_event event;
-            event.events = EPOLLOUT | EPOLLET;
-            event.data.fd = fd;
-            epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &event);
+/**
+ * startQueuedCgis()
+ * Forks the requests waiting for the location's slots, oldest first, while
+ * some are free. One that can't be forked gets the 500 it would have got
+ * without waiting (a cache refresh is dropped). Once none is free, the
+ * loop is woken (handleWake) when one is given back.
+ */
+void WebServ::startQueuedCgis(const LocationConfig &loc, Responder &responder)
+{
+    CgiLimit &limit = _cgiLimits[&loc];
+    while (!limit.queue.empty()
+           && _zones.takeCgiSlot(limit.slots, loc.cgi_max_concurrent, true, _wake.fd))
+    {
+        CgiProcess *cgi = limit.queue.front();
+        limit.queue.pop_front();
+        if (launchCgi(*cgi))
+            continue;
+        _zones.releaseCgiSlot(limit.slots);
+        if (!cgi->conn)
+        {
+            // A cache refresh: the next request for it tries again
+            cgi->cache->endRefresh(cgi->cacheKey);
+            cgi->refresh = false;
+            continue;
         }
+        failCgi(*cgi, 500, responder);
     }
+}
 
-    if (bytes_read == 0 || (bytes_read == -1 && errno != EAGAIN))
+/**
+ * handleWake()
+ * A cgi_max_concurrent slot this loop waits for was given back, or a
+ * cgi_cache_lock released: the queues get their turn, and the requests
+ * waiting for a lock look again (cgiLockReleased).
+ */
+void WebServ::handleWake(Responder &responder)
+{
+    uint64_t count;
+    _syscalls++;
+    if (read(_wake.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        std::cerr << "eventfd read failed: " << strerror(errno) << std::endl;
+    for (std::map<const LocationConfig *, CgiLimit>::iterator it = _cgiLimits.begin();
+         it != _cgiLimits.end(); ++it)
     {
-        closeClient(fd);
+        if (!it->second.queue.empty())
+            startQueuedCgis(*it->first, responder);
     }
+    // Answering one lets its connection start the next request
+    std::vector<std::pair<int, CgiProcess *> > locked(_lockedCgis.begin(), _lockedCgis.end());
+    for (size_t i = 0; i < locked.size(); i++)
+    {
+        std::map<int, CgiProcess *>::iterator it = _lockedCgis.find(locked[i].first);
+        if (it != _lockedCgis.end() && it->second == locked[i].second)
+            cgiLockReleased(*it->second, responder);
+    }
+}
+
+/**
+ * failCgi()
+ * A script that was waiting (for a cgi_max_concurrent slot or under
+ * cgi_cache_lock) can't be started after all: its request gets the error
+ * status instead, and the ones behind it their turn.
+ */
+void WebServ::failCgi(CgiProcess &cgi, int status, Responder &responder)
+{
+    Connection &conn = *cgi.conn;
+    conn.cgis.erase(std::find(conn.cgis.begin(), conn.cgis.end(), &cgi));
+    conn.cgi = NULL;
+    unlockCgi(cgi);
+    delete &cgi;
+    const HttpParser &parser = conn.requests.front().parser;
+    const ServerConfig &srv = *parser.getChosenServer();
+    HttpResponse resp = cgiErrorResponse(responder, status, srv);
+    responder.compressResponse(parser, srv, resp);
+    queueResponse(conn, resp);
+    processRequests(conn, responder);
+    armTimer(conn);
+    wakeClient(conn);
+}
+
+/**
+ * waitCgiLock()
+ * cgi_cache_lock: the miss waits for the request running the script for
+ * its key (in this loop or another), until lockUntil. The loop is woken
+ * when that one is done (cgiLockReleased).
+ */
+void WebServ::waitCgiLock(CgiProcess &cgi)
+{
+    _lockedCgis[cgi.conn->fd] = &cgi;
+    _cacheLockTimers.schedule(cgi.conn->fd, cgi.lockUntil);
 }
 
-void WebServ::handleClientWrite(int fd)
+/**
+ * cgiLockExpired()
+ * A waiting request got past cgi_cache_lock_timeout: it runs the script
+ * itself, the lock staying with the other one.
+ */
+void WebServ::cgiLockExpired(CgiProcess &cgi, Responder &responder)
 {
-    std::string &buffer = _writeBuffers[fd];
-    ssize_t sent = send(fd, buffer.c_str(), buffer.size(), MSG_NOSIGNAL);
+    _lockedCgis.erase(cgi.conn->fd);
+    runWaitingCgi(cgi, responder);
+}
 
-    if (sent > 0)
+/**
+ * cgiLockReleased()
+ * The loop was woken, maybe because the lock of the request's key is
+ * free. The response is cached: it gets that. It is not (the request
+ * holding the lock went away, or its response can't be cached): the
+ * request takes the lock and runs the script, unless another one was
+ * faster; then it waits for that one.
+ */
+void WebServ::cgiLockReleased(CgiProcess &cgi, Responder &responder)
+{
+    CachedResponse hit;
+    bool cached = cgi.cache->lookup(cgi.cacheKey, _now, hit);
+    if (!cached && !_zones.lockCgiCache(cgi.cacheKey, _wake.fd))
+        return;
+    _lockedCgis.erase(cgi.conn->fd);
+    _cacheLockTimers.cancel(cgi.conn->fd);
+    if (!cached)
     {
-        buffer.erase(0, sent);
-        _lastActivity[fd] = time(NULL);
+        cgi.lockHeld = true;
+        runWaitingCgi(cgi, responder);
+        return;
     }
+    HttpResponse resp;
+    std::ostringstream age;
+    age << _now - hit.validatedAt;
+    resp.setShared(hit.head, hit.body);
+    resp.setHeader("Age", age.str());
+    answerWaitingCgi(cgi, resp, responder);
+}
 
-    if (buffer.empty())
+/**
+ * answerWaitingCgis()
+ * The lock holder's response is in: the requests of this loop that waited
+ * for it get it too, whether it was cached or not. A streamed one can't be
+ * shared, nor one meant for the holder's client only (Set-Cookie,
+ * Cache-Control: private): those wait for the lock to be free, like the
+ * requests of the other loops.
+ */
+void WebServ::answerWaitingCgis(CgiProcess &holder, const HttpResponse &shared,
+                                Responder &responder)
+{
+    std::string control = shared.getHeader("Cache-Control");
+    std::transform(control.begin(), control.end(), control.begin(), ::tolower);
+    if (shared.getBodySource().get() || !shared.getHeader("Set-Cookie").empty()
+        || control.find("private") != std::string::npos)
+        return;
+    std::vector<std::pair<int, CgiProcess *> > locked(_lockedCgis.begin(), _lockedCgis.end());
+    for (size_t i = 0; i < locked.size(); i++)
     {
-        closeClient(fd);
+        std::map<int, CgiProcess *>::iterator it = _lockedCgis.find(locked[i].first);
+        if (it == _lockedCgis.end() || it->second != locked[i].second
+            || it->second->cacheKey != holder.cacheKey)
+            continue;
+        _lockedCgis.erase(it);
+        _cacheLockTimers.cancel(locked[i].first);
+        answerWaitingCgi(*locked[i].second, shared, responder);
     }
-    else if (sent == -1 &&  errno != EAGAIN)
+}
+
+// A request that waited for the lock is answered with the response shared
+// by its key, with its own session cookie and compression
+void WebServ::answerWaitingCgi(CgiProcess &cgi, HttpResponse resp, Responder &responder)
+{
+    Connection &conn = *cgi.conn;
+    if (!cgi.sessionCookie.empty() && resp.getHeader("Set-Cookie").empty())
+        resp.setHeader("Set-Cookie", cgi.sessionCookie);
+    conn.cgis.erase(std::find(conn.cgis.begin(), conn.cgis.end(), &cgi));
+    conn.cgi = NULL;
+    delete &cgi;
+    const HttpParser &parser = conn.requests.front().parser;
+    responder.compressResponse(parser, *parser.getChosenServer(), resp);
+    queueResponse(conn, resp);
+    processRequests(conn, responder);
+    armTimer(conn);
+    wakeClient(conn);
+}
+
+// A request that waited runs the script after all, holding the key's lock if lockHeld
+void WebServ::runWaitingCgi(CgiProcess &cgi, Responder &responder)
+{
+    int status = submitCgi(cgi);
+    if (status)
     {
-        closeClient(fd);
+        failCgi(cgi, status, responder);
+        return;
     }
+    if (cgi.limit && cgi.pid < 0)
+        startQueuedCgis(*cgi.limit, responder);
 }
 
-void WebServ::closeClient(int fd)
+/**
+ * unlockCgi()
+ * The request holding the cgi_cache_lock of its key has its response (in
+ * the cache if it could be), or is gone: the requests waiting for it, in
+ * all the loops, are woken.
+ */
+void WebServ::unlockCgi(CgiProcess &cgi)
 {
-    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-    close(fd);
-    _parsers.erase(fd);
-    _clientToServerIndex.erase(fd);
-    _writeBuffers.erase(fd);
-    _lastActivity.erase(fd);
+    if (!cgi.lockHeld)
+        return;
+    cgi.lockHeld = false;
+    _zones.unlockCgiCache(cgi.cacheKey);
 }
 
-void WebServ::acceptNewConnection(int listen_fd)
+// A script under cgi_max_concurrent was reaped: its slot is free again
+void WebServ::releaseCgiSlot(CgiProcess &cgi)
 {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
+    if (!cgi.limit || cgi.pid < 0)
+        return;
+    _zones.releaseCgiSlot(_cgiLimits[cgi.limit].slots);
+    cgi.limit = NULL;
+}
 
-    if (client_fd == -1)
+// The fds a child still has open join the event loop; false if one can't
+bool WebServ::watchCgiProcess(CgiProcess &cgi)
+{
+    CgiPipe *pipes[3] = { &cgi.stdinPipe, &cgi.stdoutPipe, &cgi.exitWatch };
+    for (size_t i = 0; i < 3; i++)
     {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        if (pipes[i]->fd >= 0 && !watchCgi(*pipes[i]))
         {
-            std::cerr << "accept error: " << strerror(errno) << std::endl;
+            std::cerr << "epoll_ctl cgi failed: " << strerror(errno) << std::endl;
+            for (size_t j = 0; j < i; j++)
+                closeCgiPipe(*pipes[j]);
+            return false;
         }
+    }
+    return true;
+}
+
+// Stdin is watched for room, stdout for data and the pidfd for the exit
+bool WebServ::watchCgi(CgiPipe &pipe)
+{
+#ifdef WEBSERV_IO_URING
+    uringPoll(pipe);
+    return true;
+#else
+    struct epoll_event event;
+    event.events = (pipe.type == POLL_CGI_IN ? EPOLLOUT : EPOLLIN) | EPOLLET;
+    event.data.ptr = &pipe;
+    _syscalls++;
+    return epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, pipe.fd, &event) == 0;
+#endif
+}
+
+/**
+ * outputRoom()
+ * How much of a script's output to read now: everything until its headers
+ * are in (all of it while it may be cached: cgiProgress bounds that), then
+ * what keeps the unsent part within CGI_BUFFER_SIZE. The
+ * output of a request whose client is gone (or of no request) is dropped,
+ * it is all read.
+ */
+static size_t outputRoom(const CgiProcess *request)
+{
+    if (!request || !request->conn || request->output->discard)
+        return std::string::npos;
+    if (!request->headQueued && (request->bodyOffset() == std::string::npos || request->cache))
+        return std::string::npos;
+    size_t held = request->output->data.size();
+    return held < CGI_BUFFER_SIZE ? CGI_BUFFER_SIZE - held : 0;
+}
+
+// What a FastCGI connection may receive now: the least room of its requests
+static size_t fastCgiRoom(const FastCgiConnection &fc)
+{
+    size_t room = std::string::npos;
+    for (std::map<unsigned short, CgiProcess *>::const_iterator it = fc.requests.begin();
+         it != fc.requests.end(); ++it)
+        room = std::min(room, outputRoom(it->second));
+    return room;
+}
+
+/**
+ * handleCgiEvent()
+ * One of a script's fds is ready: feed its stdin, drain its stdout or reap
+ * it, until that would block. Then its response moves on (cgiProgress),
+ * and once it is reaped its cgi_max_concurrent slot goes to the next
+ * request waiting.
+ */
+void WebServ::handleCgiEvent(CgiPipe &pipe, Responder &responder)
+{
+    CgiProcess &cgi = *pipe.cgi;
+    // Closed by an earlier event of this batch
+    if (pipe.fd < 0)
+        return;
+    if (cgi.pool)
+    {
+        handleWorkerEvent(pipe, responder);
+        return;
+    }
+
+    bool more;
+    if (pipe.type == POLL_CGI_IN)
+        more = cgi.writeInput();
+    else if (pipe.type == POLL_CGI_OUT && cgi.output->relay)
+    {
+        // The response splices from it: the client only needs waking up
+        more = true;
+        cgi.paused = true;
+    }
+    else if (pipe.type == POLL_CGI_OUT)
+        more = cgi.readOutput(outputRoom(&cgi));
+    else
+        more = !cgi.reap();
+    if (!more)
+        closeCgiPipe(pipe);
+    if (cgi.output->eof && !cgi.exited && cgi.exitWatch.fd < 0)
+        _unreapedCgis[cgi.pid] = &cgi;
+#ifdef WEBSERV_IO_URING
+    else if (pipe.type != POLL_CGI_OUT || !cgi.paused)
+        uringPoll(pipe);
+#endif
+    if (cgi.done())
+        cancelCgiTimeout(cgi);
+    cgiProgress(cgi, responder);
+    if (cgi.exited && cgi.limit)
+    {
+        const LocationConfig &loc = *cgi.limit;
+        releaseCgiSlot(cgi);
+        startQueuedCgis(loc, responder);
+    }
+}
+
+/**
+ * cgiProgress()
+ * A script (or FastCGI request) got output or finished: its response is
+ * queued as soon as its headers are in, or once it is done; once streaming,
+ * the waiting client is fed. An output that already ended waits for the
+ * exit, which may still make it a 500. One that may be cached is held
+ * until it is done, as long as it fits in the cache.
+ */
+void WebServ::cgiProgress(CgiProcess &cgi, Responder &responder)
+{
+    // The client is gone: only the exit mattered, or what goes to the cache
+    if (!cgi.conn)
+    {
+        if (cgi.refresh)
+            cgiRefreshProgress(cgi, responder);
         return;
     }
+    if (!cgi.headQueued)
+    {
+        // Too big to be cached: it streams after all
+        if (cgi.cache && cgi.output->data.size() > cgi.cacheMax)
+            cgi.cache = NULL;
+        bool started = cgi.bodyOffset() != std::string::npos && !cgi.output->eof && !cgi.cache;
+        if (cgi.done() || started)
+            cgiRespond(cgi, responder);
+    }
+    else if (cgi.conn->sourceWait)
+        wakeClient(*cgi.conn);
+    if (cgi.conn && cgi.done())
+        retireCgi(cgi);
+}
 
-    fcntl(client_fd, F_SETFL, O_NONBLOCK);
+/**
+ * cgiRefreshProgress()
+ * A cgi_cache refresh got output or finished: once done, its response
+ * replaces the stale entry. One growing too big for the cache is stopped.
+ * Either way the next stale hit may refresh the entry again.
+ */
+void WebServ::cgiRefreshProgress(CgiProcess &cgi, Responder &responder)
+{
+    if (cgi.done())
+    {
+        HttpResponse resp = responder.cgiResponse(cgi);
+        if (!responder.cacheCgiResponse(cgi, resp))
+            cgi.cache->endRefresh(cgi.cacheKey);
+        cgi.refresh = false;
+    }
+    else if (cgi.output->data.size() > cgi.cacheMax)
+    {
+        cgi.cache->endRefresh(cgi.cacheKey);
+        cgi.refresh = false;
+        abortCgi(cgi);
+    }
+}
+
+/**
+ * cgiRespond()
+ * The script's response takes its place in the output, then the requests
+ * it held back are answered and the client is woken up to send them all.
+ */
+void WebServ::cgiRespond(CgiProcess &cgi, Responder &responder)
+{
+    Connection &conn = *cgi.conn;
+    const HttpParser &parser = conn.requests.front().parser;
+    HttpResponse resp = responder.cgiResponse(cgi);
+    if (cgi.cache)
+        responder.cacheCgiResponse(cgi, resp);
+    if (cgi.lockHeld)
+        answerWaitingCgis(cgi, resp, responder);
+    unlockCgi(cgi);
+    if (!cgi.sessionCookie.empty() && resp.getHeader("Set-Cookie").empty())
+        resp.setHeader("Set-Cookie", cgi.sessionCookie);
+    responder.compressResponse(parser, *parser.getChosenServer(), resp);
+    cgi.headQueued = true;
+    conn.cgi = NULL;
+    queueResponse(conn, resp);
+    processRequests(conn, responder);
+    armTimer(conn);
+    wakeClient(conn);
+}
 
-    // Регистрируем клиентский сокет в epoll
+/**
+ * resumeCgiOutput()
+ * The client took some of its streamed responses: the scripts (or pool
+ * workers, or FastCGI connections) whose output was left unread for it
+ * read on, and the ones it splices from and has emptied are watched for
+ * more.
+ */
+void WebServ::resumeCgiOutput(Connection &conn)
+{
+    for (size_t i = 0; i < conn.cgis.size(); i++)
+    {
+        CgiProcess &cgi = *conn.cgis[i];
+        CgiProcess &reader = cgi.worker ? *cgi.worker : cgi;
+        if (cgi.upstream)
+            resumeFastCgi(*cgi.upstream);
+        if (!reader.paused)
+            continue;
+        // A relayed pipe is watched while the client waits for it
+        if (cgi.output->relay ? conn.sourceWait : outputRoom(&cgi) > 0)
+            resumeCgiRead(reader);
+    }
+}
+
+// Watches the paused stdout again: what waits in it is read on its next event
+void WebServ::resumeCgiRead(CgiProcess &reader)
+{
+    CgiPipe &pipe = reader.stdoutPipe;
+    reader.paused = false;
+    if (pipe.fd < 0)
+        return;
+#ifdef WEBSERV_IO_URING
+    if (!pipe.armed)
+        uringPoll(pipe);
+#else
+    // Edge-triggered: re-registering reports the data already there
     struct epoll_event event;
-    event.events = EPOLLIN | EPOLLET; // Режим edge-triggered
-    event.data.fd = client_fd;
-    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1)
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &pipe;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, pipe.fd, &event);
+    _syscalls++;
+#endif
+}
+
+void WebServ::closeCgiPipe(CgiPipe &pipe)
+{
+    if (pipe.fd < 0)
+        return;
+#ifdef WEBSERV_IO_URING
+    uringClose(pipe.fd);
+#else
+    // Explicitly: a child forked meanwhile may still hold a copy of the fd
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, pipe.fd, NULL);
+    close(pipe.fd);
+    _syscalls += 2;
+#endif
+    pipe.fd = -1;
+    if (pipe.type == POLL_CGI_OUT)
+        pipe.cgi->output->pipe = -1;
+}
+
+// A finished script: its output now only lives in the response, if at all
+void WebServ::retireCgi(CgiProcess &cgi)
+{
+    std::vector<CgiProcess *> &cgis = cgi.conn->cgis;
+    cgis.erase(std::find(cgis.begin(), cgis.end(), &cgi));
+    cgi.conn = NULL;
+    // Exited without reading all of its input
+    closeCgiPipe(cgi.stdinPipe);
+    _closedCgis.push_back(&cgi);
+}
+
+/**
+ * abortCgis()
+ * The client is gone: its scripts are killed (abortCgi). Each keeps its
+ * pidfd watched until the exit is seen and reaped, the loop never waits
+ * for it.
+ */
+void WebServ::abortCgis(Connection &conn)
+{
+    for (size_t i = 0; i < conn.cgis.size(); i++)
     {
-        close(client_fd);
-        std::cerr << "epoll_ctl client failed" << std::endl;
+        abortCgi(*conn.cgis[i]);
+        _closedCgis.push_back(conn.cgis[i]);
+    }
+    conn.cgis.clear();
+    conn.cgi = NULL;
+}
+
+/**
+ * abortCgi()
+ * Nobody wants the script's output any more: it is killed, or leaves the
+ * queue if it still waits for a cgi_max_concurrent slot. FastCGI requests
+ * get an FCGI_ABORT_REQUEST; pool workers are left running.
+ */
+void WebServ::abortCgi(CgiProcess &cgi)
+{
+    std::map<int, CgiProcess *>::iterator locked
+        = cgi.conn ? _lockedCgis.find(cgi.conn->fd) : _lockedCgis.end();
+    if (locked != _lockedCgis.end() && locked->second == &cgi)
+    {
+        // It only stops waiting for the lock
+        _lockedCgis.erase(locked);
+        _cacheLockTimers.cancel(cgi.conn->fd);
+        cgi.conn = NULL;
         return;
     }
+    unlockCgi(cgi);
+    cgi.conn = NULL;
+    if (cgi.upstream)
+    {
+        FastCgiConnection &fc = *cgi.upstream;
+        fc.abort(cgi);
+        sendFastCgi(fc);
+        resumeFastCgi(fc);
+    }
+    // Its worker finishes it, for nothing; or it leaves the queue
+    if (cgi.worker)
+    {
+        cgi.worker->job = NULL;
+        if (cgi.worker->paused)
+            resumeCgiRead(*cgi.worker);
+        cgi.worker = NULL;
+    }
+    else if (!cgi.poolScript.empty())
+    {
+        std::deque<CgiProcess *> &queue
+            = cgiPool(cgi.interpreter, cgi.poolScript, cgi.poolSize, cgi.poolSpare).queue;
+        std::deque<CgiProcess *>::iterator it = std::find(queue.begin(), queue.end(), &cgi);
+        if (it != queue.end())
+            queue.erase(it);
+    }
+    else if (cgi.limit && cgi.pid < 0)
+    {
+        CgiLimit &limit = _cgiLimits[cgi.limit];
+        limit.queue.erase(std::find(limit.queue.begin(), limit.queue.end(), &cgi));
+        _zones.dequeueCgi(limit.slots);
+    }
+    closeCgiPipe(cgi.stdinPipe);
+    closeCgiPipe(cgi.stdoutPipe);
+    cgi.kill();
+}
+
+/**
+ * startCgiPools()
+ * Every location with cgi_pool_size gets its spare workers now, before the
+ * first request comes.
+ */
+void WebServ::startCgiPools()
+{
+    for (std::map< std::pair<std::string,int>, std::vector<ServerConfig> >::iterator it = serverGroups.begin();
+         it != serverGroups.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.size(); i++)
+        {
+            const std::vector<LocationConfig> &locations = it->second[i].locations;
+            for (size_t j = 0; j < locations.size(); j++)
+            {
+                const LocationConfig &loc = locations[j];
+                if (loc.cgi_pool_size == 0 || loc.cgi_worker.empty())
+                    continue;
+                spareWorkers(cgiPool(loc.cgi_pass, loc.cgi_worker, loc.cgi_pool_size,
+                                     loc.cgi_pool_spare));
+            }
+        }
+    }
+}
 
-    _parsers[client_fd] = HttpParser();
-    _lastActivity[client_fd] = time(NULL);
-    _clientToServers[client_fd] = &(_serversForSocket[listen_fd]);
+// The pool running cgi_pass on cgi_worker, made on first use
+CgiPool &WebServ::cgiPool(const std::string &interpreter, const std::string &script, size_t size,
+                          size_t spare)
+{
+    CgiPool *&pool = _pools[std::make_pair(interpreter, script)];
+    if (!pool)
+        pool = new CgiPool(interpreter, script, size, std::min(spare, size));
+    return *pool;
 }
 
-void WebServ::checkTimeouts()
+/**
+ * submitCgiJob()
+ * Queues the request for its pool, which hands it to a worker right away
+ * if one is idle or can be started. False if the pool has no worker at
+ * all and can't start one.
+ */
+bool WebServ::submitCgiJob(CgiProcess &request)
 {
-    time_t now = time(NULL);
-    std::map<int, time_t>::iterator it = _lastActivity.begin();
-    while (it != _lastActivity.end())
+    CgiPool &pool = cgiPool(request.interpreter, request.poolScript, request.poolSize,
+                            request.poolSpare);
+    pool.queue.push_back(&request);
+    dispatchCgiJobs(pool);
+    if (!request.worker && pool.workers.empty())
     {
-        int fd = it->first;
-        time_t last = it->second;
-        if (now - last > TIMEOUT_SECONDS)
+        pool.queue.pop_back();
+        return false;
+    }
+    spareWorkers(pool);
+    return true;
+}
+
+/**
+ * dispatchCgiJobs()
+ * Hands the queued requests, oldest first, to idle workers, starting new
+ * ones while the pool is below its size.
+ */
+void WebServ::dispatchCgiJobs(CgiPool &pool)
+{
+    while (!pool.queue.empty())
+    {
+        CgiProcess *worker = pool.idleWorker();
+        if (!worker && pool.workers.size() < pool.size)
+            worker = spawnWorker(pool);
+        if (!worker)
+            break;
+        CgiProcess *request = pool.queue.front();
+        pool.queue.pop_front();
+        worker->assign(*request, ++pool.jobs);
+        feedWorker(*worker);
+    }
+}
+
+/**
+ * spareWorkers()
+ * Starts workers until `spare` of them are idle (or the pool is full), so
+ * that the next requests don't wait for a fork. Only done as requests come
+ * in: a worker script that dies at once is not restarted in a loop.
+ */
+void WebServ::spareWorkers(CgiPool &pool)
+{
+    while (pool.idleWorkers() < pool.spare && pool.workers.size() < pool.size)
+    {
+        if (!spawnWorker(pool))
+            break;
+    }
+}
+
+CgiProcess *WebServ::spawnWorker(CgiPool &pool)
+{
+    CgiProcess *worker = pool.spawn();
+    if (!worker)
+    {
+        std::cerr << "cgi pool " << pool.script << ": fork failed: " << strerror(errno) << std::endl;
+        return NULL;
+    }
+    if (!watchCgiProcess(*worker))
+    {
+        pool.workers.remove(worker);
+        delete worker;
+        return NULL;
+    }
+    return worker;
+}
+
+// Writes the queued request; the rest, if any, goes on the next POLLOUT
+void WebServ::feedWorker(CgiProcess &worker)
+{
+#ifdef WEBSERV_IO_URING
+    if (worker.writeInput() && !worker.stdinPipe.armed)
+        uringPoll(worker.stdinPipe);
+#else
+    worker.writeInput();
+#endif
+}
+
+/**
+ * handleWorkerEvent()
+ * handleCgiEvent() for a pool worker: its stdin stays open between
+ * requests, and its output goes to the request it answers until the end
+ * marker, which completes that request and frees the worker for the next
+ * one. A worker that closed its stdout or exited is retired.
+ */
+void WebServ::handleWorkerEvent(CgiPipe &pipe, Responder &responder)
+{
+    CgiProcess &worker = *pipe.cgi;
+    bool alive = true;
+    if (pipe.type == POLL_CGI_IN)
+        feedWorker(worker);
+    else
+    {
+        if (pipe.type == POLL_CGI_EXIT)
+            alive = !worker.reap();
+        // What it wrote before exiting is still in the pipe
+        if (worker.stdoutPipe.fd >= 0)
         {
-            closeClient(fd);
-            it = _lastActivity.begin();
+            size_t room = alive ? outputRoom(worker.job) : std::string::npos;
+            alive = worker.readOutput(room) && alive;
         }
-        else
+#ifdef WEBSERV_IO_URING
+        if (alive && !pipe.armed && (pipe.type != POLL_CGI_OUT || !worker.paused))
+            uringPoll(pipe);
+#endif
+        CgiProcess *request = worker.job;
+        bool complete = worker.passOutput();
+        if (complete)
         {
-            ++it;
+            worker.job = NULL;
+            // The next request's output may already wait in the pipe
+            if (worker.paused)
+                resumeCgiRead(worker);
+            if (request)
+            {
+                request->worker = NULL;
+                request->exited = true;
+                request->output->eof = true;
+            }
         }
+        if (request)
+            cgiProgress(*request, responder);
+        if (complete && worker.pool)
+            dispatchCgiJobs(*worker.pool);
     }
-}
\ No newline at end of file
+    if (!alive && worker.pool)
+        retireWorker(worker, responder);
+}
+
+/**
+ * retireWorker()
+ * The worker is gone or going: it leaves the pool, and the request it was
+ * answering fails as if its script had exited with status 1. Its pidfd
+ * stays watched until the exit is reaped; a new worker takes over the
+ * queued requests.
+ */
+void WebServ::retireWorker(CgiProcess &worker, Responder &responder)
+{
+    CgiPool &pool = *worker.pool;
+    pool.workers.remove(&worker);
+    worker.pool = NULL;
+    closeCgiPipe(worker.stdinPipe);
+    closeCgiPipe(worker.stdoutPipe);
+    if (worker.exited)
+        closeCgiPipe(worker.exitWatch);
+    worker.kill();
+    _closedCgis.push_back(&worker);
+
+    if (CgiProcess *request = worker.job)
+    {
+        std::cerr << "cgi pool " << pool.script << ": worker " << worker.pid
+                  << " exited during a request" << std::endl;
+        worker.job = NULL;
+        request->worker = NULL;
+        request->output->data += worker.output->data;
+        request->status = 1 << 8;
+        request->exited = true;
+        request->output->eof = true;
+        cgiProgress(*request, responder);
+    }
+    dispatchCgiJobs(pool);
+}
+
+/**
+ * submitFastCgi()
+ * Sends the request on a connection to its fastcgi_pass server with room
+ * for it (a kept-alive idle one, or a multiplexed busy one), or on a new
+ * one. False if no connection can be opened.
+ */
+bool WebServ::submitFastCgi(CgiProcess &cgi)
+{
+    FastCgiUpstream *&upstream = _upstreams[std::make_pair(cgi.fastcgiPass, cgi.fastcgiKeepalive)];
+    if (!upstream)
+    {
+        upstream = new FastCgiUpstream(cgi.fastcgiPass, cgi.fastcgiKeepalive);
+        if (!upstream->resolve())
+            std::cerr << "fastcgi_pass " << cgi.fastcgiPass << ": bad address" << std::endl;
+    }
+
+    FastCgiConnection *fc = NULL;
+    for (std::list<FastCgiConnection *>::iterator it = upstream->connections.begin();
+         it != upstream->connections.end(); ++it)
+    {
+        if (!(*it)->full())
+        {
+            fc = *it;
+            break;
+        }
+    }
+    if (!fc)
+    {
+        fc = new FastCgiConnection(*upstream);
+        _syscalls += 2;
+        if (!fc->open() || !watchFastCgi(*fc))
+        {
+            std::cerr << "fastcgi_pass " << cgi.fastcgiPass << ": " << strerror(errno) << std::endl;
+            delete fc;
+            return false;
+        }
+        upstream->connections.push_front(fc);
+    }
+    fc->submit(cgi);
+    sendFastCgi(*fc);
+    return true;
+}
+
+// Edge-triggered for both directions: connect() completion, room and replies
+bool WebServ::watchFastCgi(FastCgiConnection &fc)
+{
+#ifdef WEBSERV_IO_URING
+    (void)fc;
+    return true;
+#else
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = &fc;
+    _syscalls++;
+    return epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fc.fd, &event) == 0;
+#endif
+}
+
+/**
+ * sendFastCgi()
+ * Writes what is queued for the server; false on a write error. io_uring
+ * has no standing registration: the read poll (unless paused), and the
+ * write poll while something is left, are armed again here.
+ */
+bool WebServ::sendFastCgi(FastCgiConnection &fc)
+{
+    bool ok = fc.flush();
+    _syscalls++;
+#ifdef WEBSERV_IO_URING
+    if (!fc.readArmed && !fc.paused)
+        uringPoll(fc, false);
+    if (!fc.out.empty() && !fc.writeArmed)
+        uringPoll(fc, true);
+#endif
+    return ok;
+}
+
+/**
+ * resumeFastCgi()
+ * A paused FastCGI connection reads on once all of its requests have room
+ * again (or the one that had none was aborted).
+ */
+void WebServ::resumeFastCgi(FastCgiConnection &fc)
+{
+    if (!fc.paused || fc.fd < 0 || fastCgiRoom(fc) == 0)
+        return;
+    fc.paused = false;
+#ifdef WEBSERV_IO_URING
+    if (!fc.readArmed)
+        uringPoll(fc, false);
+#else
+    // Edge-triggered: re-registering reports the data already there
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = &fc;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fc.fd, &event);
+    _syscalls++;
+#endif
+}
+
+/**
+ * handleFastCgiEvent()
+ * A connection to a FastCGI server is ready: the replies received move
+ * their requests on, reading no more than the slowest of their clients
+ * takes, and what is queued is sent. A connection left idle
+ * beyond the upstream's keepalive count is closed; a broken one dropped.
+ */
+void WebServ::handleFastCgiEvent(FastCgiConnection &fc, Responder &responder)
+{
+    // Closed by an earlier event of this batch
+    if (fc.fd < 0)
+        return;
+
+    std::vector<CgiProcess *> progressed;
+    bool ok = fc.checkConnect() && fc.receive(progressed, fastCgiRoom(fc));
+    for (size_t i = 0; i < progressed.size(); i++)
+        cgiProgress(*progressed[i], responder);
+    if (!ok || !sendFastCgi(fc))
+        dropFastCgi(fc, responder);
+    else if (fc.requests.empty() && fc.upstream->idleConnections() > fc.upstream->keepalive)
+        closeFastCgi(fc);
+    else
+        // The request that had no room ended, or its client took it all already
+        resumeFastCgi(fc);
+}
+
+/**
+ * dropFastCgi()
+ * The server closed the connection (or it failed): the requests it still
+ * carried get a 502. Except a request on a kept-alive connection that got
+ * nothing yet: the server most likely closed it while idle, so that
+ * request is sent again, once, on a fresh connection.
+ */
+void WebServ::dropFastCgi(FastCgiConnection &fc, Responder &responder)
+{
+    std::map<unsigned short, CgiProcess *> requests;
+    requests.swap(fc.requests);
+    closeFastCgi(fc);
+
+    for (std::map<unsigned short, CgiProcess *>::iterator it = requests.begin();
+         it != requests.end(); ++it)
+    {
+        CgiProcess *cgi = it->second;
+        // Aborted
+        if (!cgi)
+            continue;
+        cgi->upstream = NULL;
+        if (fc.reused && !cgi->retried && cgi->output->data.empty())
+        {
+            cgi->retried = true;
+            if (submitFastCgi(*cgi))
+                continue;
+        }
+        std::cerr << "fastcgi_pass " << fc.upstream->address << ": "
+                  << (fc.connected ? "connection lost" : "connect() failed") << std::endl;
+        cgi->fail();
+        cgiProgress(*cgi, responder);
+    }
+}
+
+void WebServ::closeFastCgi(FastCgiConnection &fc)
+{
+    fc.upstream->connections.remove(&fc);
+#ifdef WEBSERV_IO_URING
+    uringClose(fc.fd);
+#else
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fc.fd, NULL);
+    close(fc.fd);
+    _syscalls += 2;
+#endif
+    fc.fd = -1;
+    _closedUpstreams.push_back(&fc);
+}
@@ -0,0 +1,427 @@
+#include "WebServ.hpp"
+#include <cerrno>
+#include <cstring>
+#include <signal.h>
+#include <poll.h>
+
+extern volatile sig_atomic_t stop_flag;
+
+#define URING_ENTRIES 4096
+// Received data lands in these kernel-selected buffers (provided buffer group)
+#define RECV_BUFFER_SIZE 4096
+#define RECV_BUFFER_COUNT 1024
+#define RECV_BUFFER_GROUP 0
+
+// The operation is stored in the low bits of the (aligned) Pollable pointer
+#define URING_OP_MASK 7UL
+enum UringOp
+{
+    URING_NONE = 0,     // bookkeeping (buffers, cancel, close): result ignored
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_WRITABLE,     // POLLOUT poll while sendfile() waits for room
+    URING_CGI,          // poll on a CGI pipe or pidfd, or on the wake eventfd
+    URING_FASTCGI_READ, // polls on a FastCGI server connection
+    URING_FASTCGI_WRITE
+};
+
+static __u64 uringTag(Pollable *source, UringOp op)
+{
+    return reinterpret_cast<unsigned long>(source) | op;
+}
+
+/**
+ * uringLoop()
+ * io_uring counterpart of mainLoop(). Listeners keep one multishot accept
+ * and clients one multishot recv armed, so the kernel posts completions
+ * without being asked again. Everything queued while handling a batch
+ * (re-provided buffers, sends, closes) goes to the kernel in the single
+ * io_uring_enter() that also waits for the next batch.
+ */
+void WebServ::uringLoop()
+{
+    Responder responder(_zones);
+
+    _ring.init(URING_ENTRIES);
+    _recvBuffers.resize(RECV_BUFFER_SIZE * RECV_BUFFER_COUNT);
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = RECV_BUFFER_COUNT;
+    sqe->addr = reinterpret_cast<unsigned long>(&_recvBuffers[0]);
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->off = 0;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+
+    for (size_t i = 0; i < _listeners.size(); i++)
+        uringAccept(*_listeners[i]);
+    uringPollWake();
+    startCgiPools();
+
+    while (!stop_flag)
+    {
+        int timeout = loopTimeout();
+        int ret = _ring.submitAndWait(timeout);
+        _wakeups++;
+        _now = time(NULL);
+        if (ret < 0 && errno != EINTR)
+        {
+            std::cerr << "io_uring_enter error: " << strerror(errno) << std::endl;
+            continue;
+        }
+
+        checkTimeouts(responder);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = _ring.peekCqe()) != NULL)
+        {
+            __u64 userData = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            _ring.advanceCq();
+            uringComplete(userData, res, flags, responder);
+        }
+        releaseClosedConnections();
+    }
+}
+
+void WebServ::uringComplete(__u64 userData, int res, unsigned flags, Responder &responder)
+{
+    Pollable *source = reinterpret_cast<Pollable *>(userData & ~URING_OP_MASK);
+
+    switch (userData & URING_OP_MASK)
+    {
+    case URING_ACCEPT:
+    {
+        Listener &listener = *static_cast<Listener *>(source);
+        if (res >= 0)
+            uringRecvArm(*openConnection(res, listener));
+        else if (res != -EINTR && res != -ECONNABORTED)
+            std::cerr << "accept error: " << strerror(-res) << std::endl;
+        if (!(flags & IORING_CQE_F_MORE) && !stop_flag)
+            uringAccept(listener);
+        break;
+    }
+    case URING_RECV:
+        uringRecv(*static_cast<Connection *>(source), res, flags, responder);
+        break;
+    case URING_SEND:
+        uringSent(*static_cast<Connection *>(source), res);
+        break;
+    case URING_CGI:
+    {
+        if (source->type == POLL_WAKE)
+        {
+            handleWake(responder);
+            uringPollWake();
+            break;
+        }
+        CgiPipe &pipe = *static_cast<CgiPipe *>(source);
+        pipe.armed = false;
+        handleCgiEvent(pipe, responder);
+        break;
+    }
+    case URING_FASTCGI_READ:
+    case URING_FASTCGI_WRITE:
+    {
+        FastCgiConnection &fc = *static_cast<FastCgiConnection *>(source);
+        if ((userData & URING_OP_MASK) == URING_FASTCGI_READ)
+            fc.readArmed = false;
+        else
+            fc.writeArmed = false;
+        handleFastCgiEvent(fc, responder);
+        break;
+    }
+    case URING_WRITABLE:
+    {
+        Connection &conn = *static_cast<Connection *>(source);
+        conn.sendArmed = false;
+        if (conn.fd >= 0 && res < 0)
+            closeClient(conn);
+        else if (conn.fd >= 0)
+            uringSend(conn);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * uringRecv()
+ * One completion of a client's multishot recv. Same flow as
+ * handleClientRead(), except the data is already there: parse, answer, and
+ * start sending right away. The buffer goes back to the kernel in any case,
+ * even when the connection is already gone.
+ */
+void WebServ::uringRecv(Connection &conn, int res, unsigned flags, Responder &responder)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+        conn.recvArmed = false;
+
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned index = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && conn.fd >= 0 && conn.keepAlive)
+        {
+            feedParser(conn, std::string(&_recvBuffers[index * RECV_BUFFER_SIZE], res));
+            processRequests(conn, responder);
+        }
+        uringProvideBuffer(index);
+    }
+    if (conn.fd < 0)
+        return;
+
+    if (res == 0 && !conn.cgi && conn.requests.empty() && conn.output.empty())
+    {
+        closeClient(conn);
+        return;
+    }
+    if (res == 0)
+    {
+        // Client half-closed after sending its requests: answer them (a
+        // running script's too), then close
+        conn.keepAlive = false;
+    }
+    else if (res < 0 && res != -ENOBUFS && !(res == -ECANCELED && conn.readPaused))
+    {
+        closeClient(conn);
+        return;
+    }
+
+    // Enough pipelined responses waiting (or requests held back by a CGI) -
+    // let the client read them first, the rest stays in the socket until
+    // resetClient() resumes reading
+    if (conn.queuedResponses + conn.requests.size() >= MAX_PIPELINED && !conn.readPaused)
+    {
+        conn.readPaused = true;
+        if (conn.recvArmed)
+        {
+            struct io_uring_sqe *sqe = _ring.getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = uringTag(&conn, URING_RECV);
+        }
+    }
+    if (res != 0 && !conn.recvArmed && !conn.readPaused)
+        uringRecvArm(conn);
+
+    armTimer(conn);
+    if (!conn.output.empty())
+        uringSend(conn);
+}
+
+/**
+ * uringSend()
+ * Works through the output until the kernel holds an operation on it.
+ * In-memory segments are gathered like in handleClientWrite() and go out
+ * with one IORING_OP_SENDMSG, MSG_WAITALL making the kernel finish them all
+ * before completing; when that is the end of a closing connection, the
+ * close is hard-linked to it, so the socket goes away without another trip
+ * through the loop. io_uring has no sendfile: file segments are sent with
+ * sendfile() right here, a script's stdout spliced, and a POLLOUT poll waits
+ * whenever the socket is full.
+ * Body sources are pulled here too, one chunk per SENDMSG; one with nothing
+ * yet (CGI) leaves the connection waiting for wakeClient().
+ */
+void WebServ::uringSend(Connection &conn)
+{
+    while (!conn.sendArmed)
+    {
+        if (conn.output.empty() && conn.cgi)
+        {
+            // Everything before the CGI response is out, it comes later
+            armTimer(conn);
+            return;
+        }
+        if (conn.output.empty())
+        {
+            if (conn.keepAlive)
+                resetClient(conn);
+            else
+                closeClient(conn);
+            return;
+        }
+
+        OutputSegment &front = conn.output.front();
+        size_t max = OUTPUT_SPLICE_SIZE;
+        int pipe = -1;
+        if (front.source.get() && !front.chunked)
+            pipe = front.source->splicePipe(max);
+        if (front.source.get() && pipe < 0)
+        {
+            PullResult pulled = conn.pullSource();
+            if (pulled == PULL_ERROR)
+                closeClient(conn);
+            else if (pulled == PULL_WAIT)
+                resumeCgiOutput(conn);
+            if (pulled != PULL_OK)
+                return;
+            continue;
+        }
+
+        if (!front.file.isOpen() && pipe < 0)
+        {
+            size_t count = conn.gatherOutput(conn.sendIov, OUTPUT_IOV_MAX);
+            bool last = !conn.keepAlive && !conn.cgi && count == conn.output.size();
+
+            memset(&conn.sendMsg, 0, sizeof(conn.sendMsg));
+            conn.sendMsg.msg_iov = conn.sendIov;
+            conn.sendMsg.msg_iovlen = count;
+
+            _ring.reserve(3);
+            struct io_uring_sqe *sqe = _ring.getSqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = conn.fd;
+            sqe->addr = reinterpret_cast<unsigned long>(&conn.sendMsg);
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = uringTag(&conn, URING_SEND);
+            conn.sendArmed = true;
+            if (last)
+            {
+                sqe->flags |= IOSQE_IO_HARDLINK;
+                uringClose(conn.fd);
+                detachClient(conn);
+            }
+            return;
+        }
+
+        ssize_t sent;
+        if (pipe >= 0)
+            sent = spliceSource(conn, pipe, max);
+        else
+            sent = sendFile(conn.fd, front, conn.outputSent);
+        if (sent > 0)
+        {
+            if (pipe < 0)
+                conn.consumeOutput(sent);
+            armTimer(conn);
+        }
+        // 0: the script closed its stdout, the source reads on
+        else if (sent == 0)
+            continue;
+        else if (errno == EAGAIN && conn.sourceWait)
+        {
+            // Spliced all the pipe had: its next output wakes the connection
+            resumeCgiOutput(conn);
+            return;
+        }
+        else if (errno == EAGAIN)
+        {
+            struct io_uring_sqe *sqe = _ring.getSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = conn.fd;
+            sqe->poll32_events = POLLOUT;
+            sqe->user_data = uringTag(&conn, URING_WRITABLE);
+            conn.sendArmed = true;
+        }
+        else
+        {
+            closeClient(conn);
+            return;
+        }
+    }
+}
+
+void WebServ::uringSent(Connection &conn, int res)
+{
+    conn.sendArmed = false;
+    if (conn.fd < 0)
+        return;
+    if (res < 0)
+    {
+        closeClient(conn);
+        return;
+    }
+
+    conn.consumeOutput(res);
+    // Made progress - the send timeout restarts
+    armTimer(conn);
+    resumeCgiOutput(conn);
+    uringSend(conn);
+}
+
+void WebServ::uringAccept(Listener &listener)
+{
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener.fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uringTag(&listener, URING_ACCEPT);
+}
+
+void WebServ::uringRecvArm(Connection &conn)
+{
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    sqe->user_data = uringTag(&conn, URING_RECV);
+    conn.recvArmed = true;
+}
+
+/**
+ * uringClose()
+ * Cancels whatever is still pending on the socket (the multishot recv holds
+ * a reference that close() alone would not drop), then closes it. Hard links
+ * keep the close even when there was nothing to cancel.
+ */
+void WebServ::uringClose(int fd)
+{
+    _ring.reserve(2);
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+void WebServ::uringProvideBuffer(unsigned index)
+{
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<unsigned long>(&_recvBuffers[index * RECV_BUFFER_SIZE]);
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->off = index;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+}
+
+// One-shot poll for a CGI fd, armed again by handleCgiEvent() while needed
+void WebServ::uringPoll(CgiPipe &pipe)
+{
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = pipe.fd;
+    sqe->poll32_events = (pipe.type == POLL_CGI_IN) ? POLLOUT : POLLIN;
+    sqe->user_data = uringTag(&pipe, URING_CGI);
+    pipe.armed = true;
+}
+
+// One-shot poll on a FastCGI connection, armed again by sendFastCgi()
+void WebServ::uringPoll(FastCgiConnection &fc, bool write)
+{
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fc.fd;
+    sqe->poll32_events = write ? POLLOUT : POLLIN;
+    sqe->user_data = uringTag(&fc, write ? URING_FASTCGI_WRITE : URING_FASTCGI_READ);
+    (write ? fc.writeArmed : fc.readArmed) = true;
+}
+
+// One-shot poll on the wake eventfd, armed again once it was read
+void WebServ::uringPollWake()
+{
+    struct io_uring_sqe *sqe = _ring.getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = _wake.fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uringTag(&_wake, URING_CGI);
+}
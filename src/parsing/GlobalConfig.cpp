@@ -0,0 +1,51 @@
+#include "GlobalConfig.hpp"
+#include <unistd.h>
+
+GlobalConfig::GlobalConfig() : worker_processes(1), worker_threads(1), cpu_affinity_auto(false) {}
+GlobalConfig::GlobalConfig(const GlobalConfig &other)
+{
+	*this = other;
+}
+GlobalConfig &GlobalConfig::operator=(const GlobalConfig &other)
+{
+	if (this != &other)
+	{
+		worker_processes = other.worker_processes;
+		worker_threads = other.worker_threads;
+		cpu_affinity_auto = other.cpu_affinity_auto;
+		cpu_affinity_masks = other.cpu_affinity_masks;
+	}
+	return *this;
+}
+GlobalConfig::~GlobalConfig() {}
+
+void GlobalConfig::reset()
+{
+	worker_processes = 1;
+	worker_threads = 1;
+	cpu_affinity_auto = false;
+	cpu_affinity_masks.clear();
+}
+
+static int onlineCpus()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? static_cast<int>(n) : 1;
+}
+
+// worker_processes 0 means "auto": one worker per online CPU
+int GlobalConfig::getWorkerCount() const
+{
+	if (worker_processes > 0)
+		return worker_processes;
+	return onlineCpus();
+}
+
+// worker_threads 0 means "auto": fill the CPUs left over by the processes
+int GlobalConfig::getThreadCount() const
+{
+	if (worker_threads > 0)
+		return worker_threads;
+	int n = onlineCpus() / getWorkerCount();
+	return (n > 0) ? n : 1;
+}
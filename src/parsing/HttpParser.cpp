@@ -97,6 +97,10 @@ bool HttpParser::headersComplete() const {
     return _headersDone;
 }
 
+bool HttpParser::hasStarted() const {
+    return _headersDone || !_buffer.empty();
+}
+
 bool HttpParser::serverSelected() const {
     return _serverSelected;
 }
@@ -161,6 +165,18 @@ void HttpParser::appendData(const std::string &data)
 }
 
 
+/**
+ * takeRemainder()
+ * Once the request is complete, whatever is left in the buffer belongs to the
+ * next pipelined request on the same connection. Hand it over and forget it.
+ */
+std::string HttpParser::takeRemainder()
+{
+    std::string rest;
+    if (_status == COMPLETE)
+        rest.swap(_buffer);
+    return rest;
+}
 
 void HttpParser::parseHeaders()
 {
@@ -389,7 +405,6 @@ void HttpParser::parseChunkedBody() {
 
         // 2) Take the chunk size
         std::string hexLen = _buffer.substr(0, posRN);
-        _buffer.erase(0, posRN + 2); // Remove the chunk size and CRLF
 
         // 3) Transform the chunk size from hex to decimal
         long chunkSize = parseHexNumber(hexLen);
@@ -405,18 +420,27 @@ void HttpParser::parseChunkedBody() {
             return;
         }
 
-        // 4) If chunkSize == 0, then it's the last chunk
+        // 4) If chunkSize == 0, then it's the last chunk: the body ends
+        // with the empty line after the (ignored) trailer fields, which may
+        // still be on its way
         if (chunkSize == 0) {
-            // Remove the trailing CRLF
-            if (_buffer.size() >= 2 && _buffer.substr(0,2) == "\r\n")
-                _buffer.erase(0,2);
+            size_t end;
+            if (_buffer.compare(posRN + 2, 2, "\r\n") == 0)
+                end = posRN + 4;
+            else if ((end = _buffer.find("\r\n\r\n", posRN + 2)) != std::string::npos)
+                end += 4;
+            else
+                return; // wait for more data
+            _buffer.erase(0, end);
             _status = COMPLETE;
             return;
         }
 
-        // 5) Check if we have enough data for the chunk
-        if (_buffer.size() < static_cast<size_t>(chunkSize) + 2)
+        // 5) Check if we have enough data for the chunk; the size line
+        // stays in the buffer until all of it is there
+        if (_buffer.size() < posRN + 2 + static_cast<size_t>(chunkSize) + 2)
             return; //  wait for more data
+        _buffer.erase(0, posRN + 2); // Remove the chunk size and CRLF
 
         // 6) Take the chunk data
         std::string chunkData = _buffer.substr(0, chunkSize);
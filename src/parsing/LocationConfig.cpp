@@ -1,6 +1,11 @@
 #include "LocationConfig.hpp"
 
-LocationConfig::LocationConfig() : autoindex(false), max_body_size(0) {}
+LocationConfig::LocationConfig() : autoindex(false), fastcgi_keepalive(FASTCGI_KEEPALIVE),
+	  cgi_pool_size(0), cgi_pool_spare(CGI_POOL_SPARE), cgi_max_concurrent(0),
+	  cgi_queue_size(CGI_QUEUE_SIZE), cgi_timeout(0), cgi_rlimit_cpu(0), cgi_rlimit_memory(0),
+	  cgi_cache(0), cgi_cache_valid(CGI_CACHE_VALID), cgi_cache_stale(CGI_CACHE_STALE),
+	  cgi_cache_lock(false), cgi_cache_lock_timeout(CGI_CACHE_LOCK_TIMEOUT), max_body_size(0),
+	  static_cache(-1), gzip_static(false) {}
 LocationConfig::LocationConfig(const LocationConfig &other)
 {
 	*this = other;
@@ -16,9 +21,26 @@ LocationConfig &LocationConfig::operator=(const LocationConfig &other)
 		index = other.index;
 		cgi_pass = other.cgi_pass;
 		cgi_extension = other.cgi_extension;
+		fastcgi_pass = other.fastcgi_pass;
+		fastcgi_keepalive = other.fastcgi_keepalive;
+		cgi_pool_size = other.cgi_pool_size;
+		cgi_pool_spare = other.cgi_pool_spare;
+		cgi_worker = other.cgi_worker;
+		cgi_max_concurrent = other.cgi_max_concurrent;
+		cgi_queue_size = other.cgi_queue_size;
+		cgi_timeout = other.cgi_timeout;
+		cgi_rlimit_cpu = other.cgi_rlimit_cpu;
+		cgi_rlimit_memory = other.cgi_rlimit_memory;
+		cgi_cache = other.cgi_cache;
+		cgi_cache_valid = other.cgi_cache_valid;
+		cgi_cache_stale = other.cgi_cache_stale;
+		cgi_cache_lock = other.cgi_cache_lock;
+		cgi_cache_lock_timeout = other.cgi_cache_lock_timeout;
 		upload_store = other.upload_store;
 		redirect = other.redirect;
 		max_body_size = other.max_body_size;
+		static_cache = other.static_cache;
+		gzip_static = other.gzip_static;
 	}
 	return *this;
 }
@@ -33,9 +55,26 @@ void LocationConfig::reset()
 	index.clear();
 	cgi_pass.clear();
 	cgi_extension.clear();
+	fastcgi_pass.clear();
+	fastcgi_keepalive = FASTCGI_KEEPALIVE;
+	cgi_pool_size = 0;
+	cgi_pool_spare = CGI_POOL_SPARE;
+	cgi_worker.clear();
+	cgi_max_concurrent = 0;
+	cgi_queue_size = CGI_QUEUE_SIZE;
+	cgi_timeout = 0;
+	cgi_rlimit_cpu = 0;
+	cgi_rlimit_memory = 0;
+	cgi_cache = 0;
+	cgi_cache_valid = CGI_CACHE_VALID;
+	cgi_cache_stale = CGI_CACHE_STALE;
+	cgi_cache_lock = false;
+	cgi_cache_lock_timeout = CGI_CACHE_LOCK_TIMEOUT;
 	upload_store.clear();
 	redirect.clear();
 	max_body_size = 0;
+	static_cache = -1;
+	gzip_static = false;
 }
 
 std::string LocationConfig::getRoot() const
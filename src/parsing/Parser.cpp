@@ -11,6 +11,7 @@ Parser &Parser::operator=(const Parser &other)
 	if (this != &other)
 	{
 		servers = other.servers;
+		global = other.global;
 		tokens = other.tokens;
 		currentIndex = other.currentIndex;
 	}
@@ -23,6 +24,11 @@ const std::vector<ServerConfig> &Parser::getServers() const
 	return servers;
 }
 
+const GlobalConfig &Parser::getGlobal() const
+{
+	return global;
+}
+
 void Parser::checkUniqueListen()
 {
 	for (size_t i = 0; i < servers.size(); i++)
@@ -42,6 +48,7 @@ void Parser::checkUniqueListen()
 void Parser::parseConfig(const std::string &filename)
 {
 	servers.clear();
+	global.reset();
 	tokens.clear();
 	currentIndex = 0;
 
@@ -135,12 +142,18 @@ void Parser::parseServers()
 			parseServerBlock(srv);
 			servers.push_back(srv);
 		}
-		else
+		else if (t == "{" || t == "}" || t == ";")
 		{
 			// Something unexpected -  error
 			throw std::runtime_error("Unexpected token: " + t);
 			getToken();
 		}
+		else
+		{
+			// Directive outside of any server block
+			std::string directive = getToken();
+			parseGlobalDirective(directive);
+		}
 	}
 }
 
@@ -202,16 +215,93 @@ void Parser::parseLocationBlock(ServerConfig &srv)
 			parseLocationDirective(loc, directive);
 		}
 	}
+	// Only a script forked for its request is counted, timed and limited
+	bool forked = loc.fastcgi_pass.empty() && loc.cgi_pool_size == 0;
+	if (!forked && (loc.cgi_max_concurrent || loc.cgi_timeout
+					|| loc.cgi_rlimit_cpu || loc.cgi_rlimit_memory))
+		throw std::runtime_error("cgi_max_concurrent, cgi_timeout and cgi_rlimit do not apply with "
+								 + std::string(loc.cgi_pool_size ? "cgi_pool_size" : "fastcgi_pass")
+								 + ": location " + loc.path);
 	srv.locations.push_back(loc);
 }
 
+void Parser::parseGlobalDirective(const std::string &directive)
+{
+	if (directive == "worker_processes")
+	{
+		// worker_processes 4; or worker_processes auto;
+		std::string val = getToken();
+		expectToken(";");
+		if (val == "auto")
+			global.worker_processes = 0;
+		else
+		{
+			global.worker_processes = std::atoi(val.c_str());
+			if (global.worker_processes < 1)
+				throw std::runtime_error("Invalid worker_processes: " + val);
+		}
+	}
+	else if (directive == "worker_threads")
+	{
+		// worker_threads 4; or worker_threads auto; - event loops per process
+		std::string val = getToken();
+		expectToken(";");
+		if (val == "auto")
+			global.worker_threads = 0;
+		else
+		{
+			global.worker_threads = std::atoi(val.c_str());
+			if (global.worker_threads < 1)
+				throw std::runtime_error("Invalid worker_threads: " + val);
+		}
+	}
+	else if (directive == "worker_cpu_affinity")
+	{
+		// worker_cpu_affinity auto; or one CPU bitmask per worker: 0001 0010 ...
+		global.cpu_affinity_auto = false;
+		global.cpu_affinity_masks.clear();
+		while (!isEnd() && peekToken() != ";")
+		{
+			std::string mask = getToken();
+			if (mask == "auto")
+				global.cpu_affinity_auto = true;
+			else if (mask == "off")
+				global.cpu_affinity_auto = false;
+			else if (mask.find_first_not_of("01") == std::string::npos)
+				global.cpu_affinity_masks.push_back(mask);
+			else
+				throw std::runtime_error("Invalid worker_cpu_affinity mask: " + mask);
+		}
+		expectToken(";");
+	}
+	else
+	{
+		throw std::runtime_error("Unknown directive: " + directive);
+	}
+}
+
 void Parser::parseServerDirective(ServerConfig &srv, const std::string &directive)
 {
 	if (directive == "listen")
 	{
+		// listen 127.0.0.1:8080 [backlog=N] [deferred];
 		std::string val = getToken();
-		expectToken(";");
 		parseListen(srv, val);
+		while (!isEnd() && peekToken() != ";")
+		{
+			std::string opt = getToken();
+			if (opt.compare(0, 8, "backlog=") == 0)
+			{
+				srv.backlog = std::atoi(opt.c_str() + 8);
+				if (srv.backlog < 1)
+					throw std::runtime_error("Invalid listen backlog: " + opt);
+			}
+			else if (opt == "deferred")
+				srv.defer_accept = true;
+			else
+				throw std::runtime_error("Unknown listen option: " + opt);
+		}
+		expectToken(";");
 	}
 	else if (directive == "server_name")
 	{
@@ -243,6 +333,109 @@ void Parser::parseServerDirective(ServerConfig &srv, const std::string &directiv
 		int code = parseStatusCode(code_str);
 		srv.error_pages[code] = page;
 	}
+	else if (directive == "keepalive_timeout")
+	{
+		// keepalive_timeout 15s; (0 disables keep-alive)
+		std::string val = getToken();
+		expectToken(";");
+		srv.keepalive_timeout = parseTime(val);
+	}
+	else if (directive == "client_header_timeout")
+	{
+		// Time allowed to receive the whole request line and headers
+		std::string val = getToken();
+		expectToken(";");
+		srv.client_header_timeout = parseTime(val);
+	}
+	else if (directive == "client_body_timeout")
+	{
+		// Longest pause between two reads of the request body
+		std::string val = getToken();
+		expectToken(";");
+		srv.client_body_timeout = parseTime(val);
+	}
+	else if (directive == "send_timeout")
+	{
+		// Longest pause between two successful writes of the response
+		std::string val = getToken();
+		expectToken(";");
+		srv.send_timeout = parseTime(val);
+	}
+	else if (directive == "static_cache")
+	{
+		// static_cache 10m; or static_cache off; - cache of small static responses
+		std::string val = getToken();
+		expectToken(";");
+		srv.static_cache = (val == "off") ? 0 : parseSize(val);
+	}
+	else if (directive == "open_file_cache")
+	{
+		// open_file_cache max=N [inactive=time]; or open_file_cache off;
+		srv.open_file_cache = 0;
+		while (!isEnd() && peekToken() != ";")
+		{
+			std::string opt = getToken();
+			if (opt.compare(0, 4, "max=") == 0)
+			{
+				srv.open_file_cache = static_cast<size_t>(std::atol(opt.c_str() + 4));
+				if (srv.open_file_cache == 0)
+					throw std::runtime_error("Invalid open_file_cache max: " + opt);
+			}
+			else if (opt.compare(0, 9, "inactive=") == 0)
+				srv.open_file_cache_inactive = parseTime(opt.substr(9));
+			else if (opt != "off")
+				throw std::runtime_error("Unknown open_file_cache option: " + opt);
+		}
+		expectToken(";");
+	}
+	else if (directive == "open_file_cache_valid")
+	{
+		// How long a cached stat result is trusted
+		std::string val = getToken();
+		expectToken(";");
+		srv.open_file_cache_valid = parseTime(val);
+	}
+	else if (directive == "open_file_cache_errors")
+	{
+		std::string val = getToken();
+		expectToken(";");
+		srv.open_file_cache_errors = (val == "on");
+	}
+	else if (directive == "gzip")
+	{
+		// gzip on; - compress responses of the gzip_types on the fly
+		std::string val = getToken();
+		expectToken(";");
+		srv.gzip = (val == "on");
+	}
+	else if (directive == "gzip_types")
+	{
+		// gzip_types text/css application/javascript; (text/html always is)
+		srv.gzip_types.clear();
+		while (!isEnd() && peekToken() != ";")
+			srv.gzip_types.push_back(getToken());
+		expectToken(";");
+	}
+	else if (directive == "gzip_min_length")
+	{
+		std::string val = getToken();
+		expectToken(";");
+		srv.gzip_min_length = parseSize(val);
+	}
+	else if (directive == "gzip_comp_level")
+	{
+		std::string val = getToken();
+		expectToken(";");
+		srv.gzip_comp_level = std::atoi(val.c_str());
+		if (srv.gzip_comp_level < 1 || srv.gzip_comp_level > 9)
+			throw std::runtime_error("Invalid gzip_comp_level: " + val);
+	}
+	else if (directive == "keepalive_requests")
+	{
+		std::string val = getToken();
+		expectToken(";");
+		srv.keepalive_requests = static_cast<size_t>(std::atol(val.c_str()));
+	}
 	else if (directive == "methods")
 	{
 		// methods GET POST DELETE;
@@ -292,6 +485,117 @@ void Parser::parseLocationDirective(LocationConfig &loc, const std::string &dire
 		loc.cgi_pass = getToken();
 		expectToken(";");
 	}
+	else if (directive == "fastcgi_pass")
+	{
+		// fastcgi_pass unix:/run/php-fpm.sock | 127.0.0.1:9000 [keepalive=N];
+		loc.fastcgi_pass = getToken();
+		bool unixSocket = loc.fastcgi_pass.compare(0, 5, "unix:") == 0;
+		size_t colon = loc.fastcgi_pass.rfind(':');
+		if (unixSocket ? loc.fastcgi_pass.size() == 5
+			: (colon == std::string::npos || colon == 0
+			   || std::atoi(loc.fastcgi_pass.c_str() + colon + 1) <= 0))
+			throw std::runtime_error("Invalid fastcgi_pass address: " + loc.fastcgi_pass);
+		while (!isEnd() && peekToken() != ";")
+		{
+			std::string opt = getToken();
+			if (opt.compare(0, 10, "keepalive=") != 0)
+				throw std::runtime_error("Unknown fastcgi_pass option: " + opt);
+			loc.fastcgi_keepalive = static_cast<size_t>(std::atol(opt.c_str() + 10));
+		}
+		expectToken(";");
+	}
+	else if (directive == "cgi_pool_size")
+	{
+		// cgi_pool_size 4 [spare=1]; - keep cgi_pass running cgi_worker
+		long size = std::atol(getToken().c_str());
+		if (size <= 0)
+			throw std::runtime_error("Invalid cgi_pool_size");
+		loc.cgi_pool_size = static_cast<size_t>(size);
+		while (!isEnd() && peekToken() != ";")
+		{
+			std::string opt = getToken();
+			if (opt.compare(0, 6, "spare=") != 0)
+				throw std::runtime_error("Unknown cgi_pool_size option: " + opt);
+			loc.cgi_pool_spare = static_cast<size_t>(std::atol(opt.c_str() + 6));
+		}
+		expectToken(";");
+	}
+	else if (directive == "cgi_worker")
+	{
+		loc.cgi_worker = getToken();
+		expectToken(";");
+	}
+	else if (directive == "cgi_max_concurrent")
+	{
+		// cgi_max_concurrent 16; - more scripts wait in the queue. The loops
+		// of a worker share the slots; each worker process gets its share
+		std::string val = getToken();
+		if (val.empty() || !isdigit((unsigned char)val[0]))
+			throw std::runtime_error("Invalid cgi_max_concurrent: " + val);
+		loc.cgi_max_concurrent = static_cast<size_t>(std::atol(val.c_str()));
+		expectToken(";");
+	}
+	else if (directive == "cgi_queue_size")
+	{
+		// cgi_queue_size 64; - 0 answers 503 as soon as all slots are taken
+		std::string val = getToken();
+		if (val.empty() || !isdigit((unsigned char)val[0]))
+			throw std::runtime_error("Invalid cgi_queue_size: " + val);
+		loc.cgi_queue_size = static_cast<size_t>(std::atol(val.c_str()));
+		expectToken(";");
+	}
+	else if (directive == "cgi_timeout")
+	{
+		// cgi_timeout 30s; - then SIGTERM, and SIGKILL if that is not enough
+		loc.cgi_timeout = parseTime(getToken());
+		expectToken(";");
+	}
+	else if (directive == "cgi_rlimit")
+	{
+		// cgi_rlimit cpu=10s memory=256m;
+		while (!isEnd() && peekToken() != ";")
+		{
+			std::string opt = getToken();
+			if (opt.compare(0, 4, "cpu=") == 0)
+				loc.cgi_rlimit_cpu = parseTime(opt.substr(4));
+			else if (opt.compare(0, 7, "memory=") == 0)
+				loc.cgi_rlimit_memory = parseSize(opt.substr(7));
+			else
+				throw std::runtime_error("Unknown cgi_rlimit option: " + opt);
+		}
+		expectToken(";");
+	}
+	else if (directive == "cgi_cache")
+	{
+		// cgi_cache 10m [valid=1s] [stale=10s]; or cgi_cache off;
+		std::string val = getToken();
+		loc.cgi_cache = (val == "off") ? 0 : parseSize(val);
+		while (!isEnd() && peekToken() != ";")
+		{
+			std::string opt = getToken();
+			if (opt.compare(0, 6, "valid=") == 0)
+				loc.cgi_cache_valid = parseTime(opt.substr(6));
+			else if (opt.compare(0, 6, "stale=") == 0)
+				loc.cgi_cache_stale = parseTime(opt.substr(6));
+			else
+				throw std::runtime_error("Unknown cgi_cache option: " + opt);
+		}
+		expectToken(";");
+	}
+	else if (directive == "cgi_cache_lock")
+	{
+		// cgi_cache_lock on; - concurrent misses for a key share one script run
+		std::string val = getToken();
+		expectToken(";");
+		loc.cgi_cache_lock = (val == "on");
+	}
+	else if (directive == "cgi_cache_lock_timeout")
+	{
+		// cgi_cache_lock_timeout 5s; - then a waiting request runs the script itself
+		std::string val = getToken();
+		expectToken(";");
+		loc.cgi_cache_lock_timeout = parseTime(val);
+	}
 	else if (directive == "cgi_extension")
 	{
 		
@@ -309,6 +613,19 @@ void Parser::parseLocationDirective(LocationConfig &loc, const std::string &dire
 		expectToken(";");
 		loc.max_body_size = parseSize(val);
 	}
+	else if (directive == "gzip_static")
+	{
+		// gzip_static on; - send the precompressed file.gz next to the file
+		std::string val = getToken();
+		expectToken(";");
+		loc.gzip_static = (val == "on");
+	}
+	else if (directive == "static_cache")
+	{
+		std::string val = getToken();
+		expectToken(";");
+		loc.static_cache = (val == "off") ? 0 : static_cast<long>(parseSize(val));
+	}
 	else if (directive == "return")
 	{
 		// Example: return 301 /newpath;
@@ -363,6 +680,20 @@ size_t Parser::parseSize(const std::string &value)
 	}
 }
 
+int Parser::parseTime(const std::string &value)
+{
+	// s = seconds, m = minutes
+	// Without suffix - seconds
+	size_t len = value.size();
+	if (len == 0 || !isdigit((unsigned char)value[0]))
+		throw std::runtime_error("Invalid time value: " + value);
+	char c = value[len - 1];
+	int base = std::atoi(value.c_str());
+	if (c == 'm' || c == 'M')
+		return base * 60;
+	return base;
+}
+
 int Parser::parseStatusCode(const std::string &value)
 {
 	int code = atoi(value.c_str());
@@ -1,6 +1,12 @@
 #include "ServerConfig.hpp"
 
-ServerConfig::ServerConfig() : host("0.0.0.0"), port(80), max_body_size(0), autoindex(false) {}
+ServerConfig::ServerConfig()
+	: host("0.0.0.0"), port(80), backlog(511), defer_accept(false),
+	  max_body_size(0), autoindex(false),
+	  keepalive_timeout(15), client_header_timeout(30), client_body_timeout(30),
+	  send_timeout(30), keepalive_requests(100), static_cache(0),
+	  open_file_cache(0), open_file_cache_inactive(60), open_file_cache_valid(60),
+	  open_file_cache_errors(false), gzip(false), gzip_min_length(20), gzip_comp_level(1) {}
 ServerConfig::ServerConfig(const ServerConfig &other)
 {
 	*this = other;
@@ -11,6 +17,8 @@ ServerConfig &ServerConfig::operator=(const ServerConfig &other)
 	{
 		host = other.host;
 		port = other.port;
+		backlog = other.backlog;
+		defer_accept = other.defer_accept;
 		server_name = other.server_name;
 		root = other.root;
 		max_body_size = other.max_body_size;
@@ -18,6 +26,20 @@ ServerConfig &ServerConfig::operator=(const ServerConfig &other)
 		error_pages = other.error_pages;
 		methods = other.methods;
 		locations = other.locations;
+		keepalive_timeout = other.keepalive_timeout;
+		client_header_timeout = other.client_header_timeout;
+		client_body_timeout = other.client_body_timeout;
+		send_timeout = other.send_timeout;
+		keepalive_requests = other.keepalive_requests;
+		static_cache = other.static_cache;
+		open_file_cache = other.open_file_cache;
+		open_file_cache_inactive = other.open_file_cache_inactive;
+		open_file_cache_valid = other.open_file_cache_valid;
+		open_file_cache_errors = other.open_file_cache_errors;
+		gzip = other.gzip;
+		gzip_types = other.gzip_types;
+		gzip_min_length = other.gzip_min_length;
+		gzip_comp_level = other.gzip_comp_level;
 	}
 	return *this;
 }
@@ -27,6 +49,8 @@ void ServerConfig::reset()
 {
 	host.clear();
 	port = 80;
+	backlog = 511;
+	defer_accept = false;
 	server_name.clear();
 	root.clear();
 	max_body_size = 0;
@@ -34,6 +58,20 @@ void ServerConfig::reset()
 	error_pages.clear();
 	methods.clear();
 	locations.clear();
+	keepalive_timeout = 15;
+	client_header_timeout = 30;
+	client_body_timeout = 30;
+	send_timeout = 30;
+	keepalive_requests = 100;
+	static_cache = 0;
+	open_file_cache = 0;
+	open_file_cache_inactive = 60;
+	open_file_cache_valid = 60;
+	open_file_cache_errors = false;
+	gzip = false;
+	gzip_types.clear();
+	gzip_min_length = 20;
+	gzip_comp_level = 1;
 }
 
 int ServerConfig::getPort() const
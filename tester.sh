@@ -143,6 +143,96 @@ function test_delete() {
     fi
 }
 
+# Function to test GET requests carrying an extra request header.
+# Arguments:
+#   $1 - URL
+#   $2 - Host header value
+#   $3 - Extra header ("Name: value")
+#   $4 - Expected HTTP status code
+#   $5 - Test description
+function test_get_with() {
+    url="$1"
+    host="$2"
+    header="$3"
+    expected="$4"
+    desc="$5"
+    echo -e "${YELLOW}GET${NC} $url with \"$header\" [$desc]: "
+    code=$(curl -s -H "Host: $host" -H "$header" -H "Connection: close" -o /dev/null -w "%{http_code}" "$url")
+    if [ "$code" -eq "$expected" ]; then
+        echo -e "${GREEN}${CHECK_MARK} SUCCESS${NC} (status: $code)"
+    else
+        echo -e "${RED}${CROSS_MARK} FAIL${NC} (status: $code, expected: $expected)"
+    fi
+}
+
+# Function to print the value of a response header.
+# Arguments:
+#   $1 - URL
+#   $2 - Host header value
+#   $3 - Header name
+function response_header() {
+    curl -s -H "Host: $2" -H "Connection: close" -D - -o /dev/null "$1" \
+        | tr -d '\r' | grep -i "^$3:" | head -n 1 | cut -d' ' -f2-
+}
+
+# Function to check a value measured by the caller.
+# Arguments:
+#   $1 - Measured value
+#   $2 - Expected value
+#   $3 - Test description
+function test_value() {
+    value="$1"
+    expected="$2"
+    desc="$3"
+    echo -e "${YELLOW}CHECK${NC} [$desc]: "
+    if [ "$value" = "$expected" ]; then
+        echo -e "${GREEN}${CHECK_MARK} SUCCESS${NC} (value: $value)"
+    else
+        echo -e "${RED}${CROSS_MARK} FAIL${NC} (value: $value, expected: $expected)"
+    fi
+}
+
+# Function to check the coding of a response to an Accept-Encoding value:
+# its Content-Encoding, its Vary header, and its body, decompressed when
+# gzipped, against a file.
+# Arguments:
+#   $1 - URL
+#   $2 - Accept-Encoding value ("" for none)
+#   $3 - Expected Content-Encoding ("identity" for none)
+#   $4 - File holding the expected body
+#   $5 - Test description
+function test_encoding() {
+    accept=()
+    [ -n "$2" ] && accept=(-H "Accept-Encoding: $2")
+    headers=$(mktemp)
+    body=$(mktemp)
+    curl -s "${accept[@]}" -H "Connection: close" -D "$headers" -o "$body" "$1"
+    encoding=$(tr -d '\r' < "$headers" | grep -i "^Content-Encoding:" | cut -d' ' -f2-)
+    vary=$(tr -d '\r' < "$headers" | grep -i "^Vary:" | cut -d' ' -f2-)
+    if [ "$encoding" = "gzip" ]; then
+        gzip -dc < "$body" 2>/dev/null | cmp -s - "$4" && same="same body" || same="other body"
+    else
+        cmp -s "$body" "$4" && same="same body" || same="other body"
+    fi
+    rm -f "$headers" "$body"
+    test_value "${encoding:-identity}, Vary: $vary, $same" "$3, Vary: Accept-Encoding, same body" "$5"
+}
+
+# Without WEBSERV_BIN the server must already be running. With it, that
+# build is started on config/config.conf and stopped at the end, e.g. the
+# io_uring one: make IO_BACKEND=uring NAME=webserv_uring, then
+# WEBSERV_BIN=./webserv_uring ./tester.sh. It is not made a job of this
+# shell: the plain waits below would wait for it too.
+if [ -n "$WEBSERV_BIN" ]; then
+    webserv_pid=$("$WEBSERV_BIN" config/config.conf > /dev/null 2>&1 & echo $!)
+    trap 'kill $webserv_pid 2>/dev/null' EXIT
+    sleep 0.5
+    if ! kill -0 $webserv_pid 2>/dev/null; then
+        echo -e "${RED}${CROSS_MARK} FAIL${NC} ($WEBSERV_BIN did not start)"
+        exit 1
+    fi
+fi
+
 ###########################################
 # Begin Tests
 ###########################################
@@ -155,6 +245,52 @@ test_get "http://127.0.0.1:8080/ajax" "localhost" 200 "Site1 ajax index"
 test_get "http://127.0.0.1:8080/uploads" "localhost" 200 "Site1 uploads autoindex"
 test_get "http://127.0.0.1:8080/oldpath" "localhost" 301 "Old path redirect"
 
+# Pipelined keep-alive: requests sent in one write are answered in order,
+# a script's response before the static ones queued behind it, each with
+# the requests left on the connection
+pipelined=$(python3 - <<'EOF'
+import socket
+s = socket.create_connection(("127.0.0.1", 8080))
+s.sendall(b"GET /test.sh?first HTTP/1.1\r\nHost: localhost\r\n\r\n"
+          b"GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n"
+          b"GET /nonexistent.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+          b"GET /test.sh?last HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+s.settimeout(5)
+data = b""
+while True:
+    chunk = s.recv(65536)
+    if not chunk:
+        break
+    data += chunk
+index = open("www/site1/index.html", "rb").read()
+answers = []
+while data:
+    head, data = data.split(b"\r\n\r\n", 1)
+    lines = head.decode().split("\r\n")
+    headers = dict((k.lower(), v) for k, v in (l.split(": ", 1) for l in lines[1:]))
+    if "content-length" in headers:
+        length = int(headers["content-length"])
+        body, data = data[:length], data[length:]
+    else:
+        body = b""
+        while True:
+            size, data = data.split(b"\r\n", 1)
+            size = int(size, 16)
+            body, data = body + data[:size], data[size + 2:]
+            if size == 0:
+                break
+    what = "other"
+    if body == index:
+        what = "index"
+    elif b"QUERY_STRING = " in body:
+        what = body.split(b"QUERY_STRING = ")[1].split(b"<")[0].decode()
+    alive = headers.get("keep-alive", headers.get("connection", "")).split("max=")[-1]
+    answers.append("%s %s %s" % (lines[0].split()[1], what, alive))
+print(", ".join(answers))
+EOF
+)
+test_value "$pipelined" "200 first 99, 200 index 98, 404 other 97, 200 last close" "Four pipelined requests answered in order"
+
 # UNKNOW tests (e.g., using an unknown method)
 test_unknow "http://127.0.0.1:8080/" "localhost" 405 "Site1 index with unknown method"
 
@@ -192,10 +328,265 @@ chmod +x www/site2/test.sh
 test_post "http://127.0.0.1:8082/test.sh" "mydomain.com" "data=foo" 200 "Shell CGI execution on mydomain.com"
 rm -f www/site2/test.sh
 
+print_header "Testing non-blocking CGI on 127.0.0.1:8082 (server_name: mydomain.com, root: www/site3)"
+# A script that takes 2s must not hold up the other clients of the loop
+cat <<'EOF' > www/site3/slow.sh
+#!/bin/sh
+sleep 2
+echo 'Content-Type: text/plain'
+echo ''
+echo 'slow'
+EOF
+slow=$(mktemp)
+curl -s -H "Host: mydomain.com" -o /dev/null -w "%{http_code}" "http://127.0.0.1:8082/slow.sh" > "$slow" &
+slow_pid=$!
+sleep 0.3
+elapsed=$(curl -s -H "Host: mydomain.com" -H "Connection: close" -o /dev/null -w "%{time_total}" "http://127.0.0.1:8082/")
+test_value "$(awk -v t="$elapsed" 'BEGIN { print (t < 1) ? "under 1s" : t "s" }')" "under 1s" "Static GET while a CGI script sleeps"
+wait $slow_pid
+test_value "$(cat "$slow")" "200" "The sleeping script's own response"
+# A keep-alive client half-closing right after its request still gets the
+# script's response, then the connection closes
+halfclose=$(python3 - <<'EOF'
+import socket
+s = socket.create_connection(("127.0.0.1", 8082))
+s.sendall(b"GET /slow.sh HTTP/1.1\r\nHost: mydomain.com\r\n\r\n")
+s.shutdown(socket.SHUT_WR)
+s.settimeout(5)
+data = b""
+while True:
+    chunk = s.recv(65536)
+    if not chunk:
+        break
+    data += chunk
+print(data.split(b"\r\n", 1)[0].decode() if data else "nothing")
+EOF
+)
+test_value "$halfclose" "HTTP/1.1 200 OK" "Half-closed client waiting for a CGI script"
+rm -f www/site3/slow.sh "$slow"
+
+print_header "Testing FastCGI on 127.0.0.1:8086 (fastcgi_pass 127.0.0.1:9086 keepalive=2)"
+# Minimal FastCGI responder: one connection at a time, answers with the
+# number of connections it accepted and the script name (or echoes a POST);
+# /fcgi/big gets 8 MB, sent as fast as the socket takes them
+fcgi_server=$(mktemp)
+cat <<'EOF' > "$fcgi_server"
+import socket, struct
+def record(kind, rid, content=b''):
+    return struct.pack('>BBHHBB', 1, kind, rid, len(content), 0, 0) + content
+def read(conn, n):
+    data = b''
+    while len(data) < n:
+        chunk = conn.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+def params(data):
+    out, pos = {}, 0
+    while pos < len(data):
+        sizes = []
+        for _ in range(2):
+            if data[pos] & 0x80:
+                sizes.append(struct.unpack('>I', data[pos:pos + 4])[0] & 0x7fffffff)
+                pos += 4
+            else:
+                sizes.append(data[pos])
+                pos += 1
+        out[data[pos:pos + sizes[0]].decode()] = data[pos + sizes[0]:pos + sum(sizes)].decode()
+        pos += sum(sizes)
+    return out
+listener = socket.create_server(('127.0.0.1', 9086))
+accepted = 0
+while True:
+    conn, _ = listener.accept()
+    accepted += 1
+    env, body = b'', b''
+    try:
+        while True:
+            _, kind, rid, length, padding, _ = struct.unpack('>BBHHBB', read(conn, 8))
+            content = read(conn, length + padding)[:length]
+            if kind == 9:
+                answer = b'\x0f\x01FCGI_MPXS_CONNS0'
+                conn.sendall(record(10, 0, answer))
+            elif kind == 4:
+                env += content
+            elif kind == 5 and content:
+                body += content
+            elif kind == 5:
+                name = params(env).get('SCRIPT_NAME', '')
+                out = body if body else ('connections=%d script=%s\n' % (accepted, name)).encode()
+                head = b'Content-Type: text/plain\r\n\r\n'
+                if name == '/fcgi/big':
+                    conn.sendall(record(6, rid, head))
+                    for _ in range(256):
+                        conn.sendall(record(6, rid, b'x' * 32768))
+                else:
+                    conn.sendall(record(6, rid, head + out))
+                conn.sendall(record(6, rid) + record(3, rid, struct.pack('>IB3x', 0, 0)))
+                env, body = b'', b''
+    except (EOFError, ConnectionError):
+        conn.close()
+EOF
+python3 "$fcgi_server" &
+fcgi_pid=$!
+sleep 0.5
+test_get "http://127.0.0.1:8086/fcgi/hello" "localhost" 200 "GET through fastcgi_pass"
+test_value "$(curl -s "http://127.0.0.1:8086/fcgi/hello")" "connections=1 script=/fcgi/hello" "Upstream connection kept alive between requests"
+test_value "$(curl -s -d "posted=1" "http://127.0.0.1:8086/fcgi/echo")" "posted=1" "POST body passed as FCGI_STDIN"
+test_get "http://127.0.0.1:8086/down/hello" "localhost" 502 "fastcgi_pass to a closed port"
+# The upstream is read only as fast as the client takes the response
+test_value "$(curl -s --limit-rate 4M "http://127.0.0.1:8086/fcgi/big" | wc -c)" "8388608" "Large FastCGI response to a slow client"
+kill $fcgi_pid
+wait $fcgi_pid 2>/dev/null
+rm -f "$fcgi_server"
+
+print_header "Testing the CGI worker pool on 127.0.0.1:8087 (cgi_pool_size 2, root: www/site3)"
+# $$ is the pool worker's pid: the pool's workers run every request
+cat <<'EOF' > www/site3/pooled.sh
+echo 'Content-Type: text/plain'
+echo ''
+echo "$$"
+cat
+EOF
+test_get "http://127.0.0.1:8087/pooled.sh" "localhost" 200 "Script run by a pool worker"
+workers=$(for i in 1 2 3 4 5 6; do curl -s "http://127.0.0.1:8087/pooled.sh"; done | sort -u | wc -l)
+test_value "$(awk -v n="$workers" 'BEGIN { print (n <= 2) ? "at most 2" : n }')" "at most 2" "Six requests answered by the two pool workers"
+test_value "$(curl -s -d "body=1" "http://127.0.0.1:8087/pooled.sh" | tail -n 1)" "body=1" "POST body on the script's stdin"
+rm -f www/site3/pooled.sh
+
+print_header "Testing streamed CGI output on 127.0.0.1:8082 (server_name: mydomain.com, root: www/site3)"
+# The first line goes out while the script still sleeps
+cat <<'EOF' > www/site3/ticks.sh
+#!/bin/sh
+echo 'Content-Type: text/plain'
+echo ''
+echo 'first'
+sleep 2
+echo 'second'
+EOF
+timing=$(curl -s -H "Host: mydomain.com" -o /dev/null -w "%{time_starttransfer} %{size_download}" "http://127.0.0.1:8082/ticks.sh")
+test_value "$(echo "$timing" | awk '{ print ($1 < 1) ? "under 1s" : $1 "s" }')" "under 1s" "First bytes before the script ends"
+test_value "$(echo "$timing" | cut -d' ' -f2)" "13" "Whole streamed body"
+rm -f www/site3/ticks.sh
+test_value "$(curl -s -o /dev/null -w "%{size_download}" "http://127.0.0.1:8080/cgi-bin/stream.sh?5000000&chunked")" "5000000" "5 MB of chunked CGI output"
+
+print_header "Testing spliced CGI output on 127.0.0.1:8080 (server_name: localhost, root: www/site1)"
+test_value "$(curl -s -o /dev/null -w "%{size_download}" "http://127.0.0.1:8080/cgi-bin/stream.sh?50000000")" "50000000" "50 MB of CGI output with a Content-Length"
+# A client reading 100 KB/s gives up after a second: the script and what it
+# started must be gone
+curl -s --limit-rate 100k -m 1 -o /dev/null "http://127.0.0.1:8080/cgi-bin/stream.sh?987654321"
+sleep 1
+test_value "$(pgrep -fc "cgi-bin/stream.sh|head -c 987654321")" "0" "Script of a slow client that left killed"
+
+print_header "Testing CGI limits on 127.0.0.1:8084 (cgi_max_concurrent 1, cgi_queue_size 1, cgi_timeout 2s)"
+# Sleeps past cgi_timeout: stopped, and answered with a 504
+cat <<'EOF' > www/site3/limited.sh
+#!/bin/sh
+sleep 5
+echo 'Content-Type: text/plain'
+echo ''
+echo 'limited'
+EOF
+test_get "http://127.0.0.1:8084/limited.sh" "localhost" 504 "Script past cgi_timeout"
+# One request runs, the next waits for its slot, the third finds the queue full
+limited=$(mktemp)
+curl -s -o /dev/null -w "%{http_code}\n" "http://127.0.0.1:8084/limited.sh" >> "$limited" &
+sleep 0.2
+curl -s -o /dev/null -w "%{http_code}\n" "http://127.0.0.1:8084/limited.sh" >> "$limited" &
+sleep 0.2
+test_get "http://127.0.0.1:8084/limited.sh" "localhost" 503 "Request past cgi_max_concurrent and cgi_queue_size"
+wait
+test_value "$(tr '\n' ' ' < "$limited")" "504 504 " "The running and the queued request"
+rm -f www/site3/limited.sh "$limited"
+
+print_header "Testing cgi_cache on 127.0.0.1:8085 (valid=5s stale=30s, cgi_cache_lock, gzip, root: www/site3)"
+# Every run of the script adds a line to $runs
+runs=$(mktemp)
+cat <<EOF > www/site3/counted.sh
+#!/bin/sh
+echo run >> $runs
+echo 'Content-Type: text/plain'
+echo ''
+echo 'counted'
+EOF
+test_get "http://127.0.0.1:8085/counted.sh" "localhost" 200 "Miss: the script runs"
+test_get "http://127.0.0.1:8085/counted.sh" "localhost" 200 "Fresh hit"
+test_value "$(wc -l < "$runs")" "1" "The script ran once for both"
+# The server's own session cookie does not bypass the cache, other cookies do
+curl -s -o /dev/null -H "Cookie: session_id=0123abcd" "http://127.0.0.1:8085/counted.sh"
+test_value "$(wc -l < "$runs")" "1" "Hit for a client sending its session_id"
+curl -s -o /dev/null -H "Cookie: session_id=0123abcd; theme=dark" "http://127.0.0.1:8085/counted.sh"
+test_value "$(wc -l < "$runs")" "2" "Miss for a client sending another cookie"
+# valid= is counted in whole seconds: 5s may end up to 1s early, never late
+sleep 5.2
+# Past valid: the stale entry goes out at once, one request refreshes it
+test_value "$(response_header "http://127.0.0.1:8085/counted.sh" "localhost" "Age" | grep -c '^[0-9]')" "1" "Stale hit with an Age header"
+for i in 1 2 3 4; do
+    curl -s -o /dev/null "http://127.0.0.1:8085/counted.sh" &
+done
+wait
+sleep 0.5
+test_value "$(wc -l < "$runs")" "3" "One refresh for all the stale hits"
+# cgi_cache_lock: concurrent misses for a key wait for one run of the script
+rm -f "$runs"
+sed -i 's/^echo run/sleep 1\necho run/' www/site3/counted.sh
+for i in 1 2 3 4 5 6; do
+    curl -s -o /dev/null "http://127.0.0.1:8085/counted.sh?lock" &
+done
+wait
+test_value "$(wc -l < "$runs")" "1" "Six concurrent misses, one run of the script"
+test_value "$(curl -s "http://127.0.0.1:8085/counted.sh?lock")" "counted" "Cached by that run"
+rm -f www/site3/counted.sh "$runs"
+# gzip for text/plain: each variant is stored compressed once, or plain
+cat <<'EOF' > www/site3/numbers.sh
+#!/bin/sh
+echo 'Content-Type: text/plain'
+echo ''
+seq 1 1000
+EOF
+numbers=$(mktemp)
+seq 1 1000 > "$numbers"
+test_encoding "http://127.0.0.1:8085/numbers.sh" "gzip" "gzip" "$numbers" "Miss compressed for a client taking gzip"
+test_encoding "http://127.0.0.1:8085/numbers.sh" "gzip" "gzip" "$numbers" "Hit on the gzip variant"
+test_encoding "http://127.0.0.1:8085/numbers.sh" "" "identity" "$numbers" "Plain variant without Accept-Encoding"
+test_encoding "http://127.0.0.1:8085/numbers.sh" "" "identity" "$numbers" "Hit on the plain variant"
+rm -f www/site3/numbers.sh "$numbers"
+
 print_header "Testing Server on 127.0.0.1:8080 (server_name: mydomain.com, root: www/site2)"
 test_get "http://127.0.0.1:8080/" "mydomain.com" 200 "Site2 index on mydomain.com"
 test_get "http://127.0.0.1:8080/secret" "mydomain.com" 200 "Site2 secret on mydomain.com"
 
+print_header "Testing conditional GET on 127.0.0.1:8080 (static_cache, open_file_cache)"
+etag=$(response_header "http://127.0.0.1:8080/index.html" "localhost" "ETag")
+last_modified=$(response_header "http://127.0.0.1:8080/index.html" "localhost" "Last-Modified")
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "If-None-Match: $etag" 304 "If-None-Match with the current ETag"
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "If-None-Match: \"stale\"" 200 "If-None-Match with another ETag"
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "If-Modified-Since: $last_modified" 304 "If-Modified-Since at Last-Modified"
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT" 200 "If-Modified-Since in the future"
+
+print_header "Testing byte ranges on 127.0.0.1:8080 (server_name: localhost, root: www/site1)"
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "Range: bytes=0-99" 206 "First 100 bytes"
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "Range: bytes=-100" 206 "Last 100 bytes"
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "Range: bytes=0-9,20-29" 206 "Two ranges (multipart/byteranges)"
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "Range: bytes=99999999-" 416 "Range past the end of the file"
+test_get_with "http://127.0.0.1:8080/index.html" "localhost" "Range: lines=1-2" 200 "Unknown range unit"
+
+print_header "Testing gzip on 127.0.0.1:8080 (gzip_types text/css ..., gzip_min_length 1k, gzip_static)"
+test_encoding "http://127.0.0.1:8080/assets/css/main.css" "gzip, deflate" "gzip" www/site1/assets/css/main.css "Compressed for a client taking gzip"
+test_encoding "http://127.0.0.1:8080/assets/css/main.css" "gzip, deflate" "gzip" www/site1/assets/css/main.css "Compressed again from the static_cache"
+test_encoding "http://127.0.0.1:8080/assets/css/main.css" "" "identity" www/site1/assets/css/main.css "Plain without Accept-Encoding"
+test_encoding "http://127.0.0.1:8080/assets/css/main.css" "gzip;q=0, identity" "identity" www/site1/assets/css/main.css "Plain for gzip;q=0"
+# gzip_static: the .gz sibling, told apart from the plain file by what it holds
+sibling=$(mktemp)
+echo 'plain file' > www/site1/precompressed.html
+echo 'gzip sibling' > "$sibling"
+gzip -c "$sibling" > www/site1/precompressed.html.gz
+test_encoding "http://127.0.0.1:8080/precompressed.html" "gzip" "gzip" "$sibling" "gzip_static sends the .gz sibling"
+test_value "$(curl -s -H "Accept-Encoding: gzip" -o /dev/null -w "%{content_type}" "http://127.0.0.1:8080/precompressed.html")" "text/html" "With the type of the plain file"
+test_encoding "http://127.0.0.1:8080/precompressed.html" "" "identity" www/site1/precompressed.html "gzip_static sends the plain file without Accept-Encoding"
+rm -f www/site1/precompressed.html www/site1/precompressed.html.gz "$sibling"
+
 print_header "Testing POST /uploads with chunked encoding (max_body_size from location)"
 head -c 100 /dev/urandom > small_body.txt
 test_post_chunked "http://127.0.0.1:8080/uploads" "localhost" "small_body.txt" 201 "POST /uploads within limit (chunked)"
@@ -0,0 +1,56 @@
+#!/bin/sh
+# pool_worker.sh - Persistent CGI worker for a location with cgi_pool_size:
+#
+#   location ~ \.sh$ {
+#       cgi_extension .sh;
+#       cgi_pass      /bin/sh;
+#       cgi_pool_size 4 spare=1;
+#       cgi_worker    www/site1/cgi-bin/pool_worker.sh;
+#   }
+#
+# The server starts it once, then writes it one request after another:
+# NAME=VALUE lines (the CGI environment), an empty line, then
+# CONTENT_LENGTH bytes of body. Each script is sourced in a subshell, with
+# its own environment and the body on stdin, then a line holding
+# $CGI_POOL_END and its exit status tells the server that the response is
+# complete.
+
+BODY=$(mktemp) || exit 1
+trap 'rm -f "$BODY"' EXIT
+
+while :; do
+    # 1) The environment, up to the empty line; EOF: the server is done with us
+    REQUEST=""
+    END=""
+    while IFS= read -r LINE && [ -n "$LINE" ]; do
+        REQUEST="$REQUEST$LINE
+"
+        case "$LINE" in
+            CGI_POOL_END=*) END="${LINE#CGI_POOL_END=}" ;;
+        esac
+    done
+    [ -n "$REQUEST" ] || exit 0
+
+    (
+        # 2) This request's variables only, one per line
+        set -f
+        IFS='
+'
+        for VAR in $REQUEST; do
+            export "$VAR"
+        done
+        unset IFS
+        set +f
+
+        # 3) The body: exactly CONTENT_LENGTH bytes of our stdin
+        if [ "${CONTENT_LENGTH:-0}" -gt 0 ]; then
+            head -c "$CONTENT_LENGTH" > "$BODY"
+        else
+            : > "$BODY"
+        fi
+
+        # 4) The script; its exit only ends this subshell
+        . "$SCRIPT_FILENAME" < "$BODY"
+    )
+    printf '\n%s %d\n' "$END" "$?"
+done
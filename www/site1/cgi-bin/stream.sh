@@ -0,0 +1,17 @@
+#!/bin/sh
+# stream.sh - Streams zeros for throughput benchmarks (bench.sh -t).
+# QUERY_STRING: the size in bytes (1 GiB by default), "&chunked" to leave the
+# Content-Length out - the server then relays the output through memory
+# instead of splicing it to the client.
+
+SIZE="${QUERY_STRING%%&*}"
+[ -n "$SIZE" ] || SIZE=1073741824
+
+echo "Content-Type: application/octet-stream"
+case "$QUERY_STRING" in
+    *chunked*) ;;
+    *) echo "Content-Length: $SIZE" ;;
+esac
+echo ""
+
+head -c "$SIZE" /dev/zero